@@ -21,7 +21,7 @@ from multiprocessing import Process
 
 print (sys.version)
 print '[NVthread-eval] ----------------------------------------------------Welcome-------------------------------------------------------'
-print '[NVthread-eval] Usage: ./eval.py action[build/run] benchmark input-size[simlarge/native] thread-type[p/d/nvthread] runs ncore[1/2/4/8/12core] delays[10/25/50/100/1000(ns)]'
+print '[NVthread-eval] Usage: ./eval.py action[build/run] benchmark input-size[simlarge/native] thread-type[p/d/nvthread] runs ncore[1/2/4/8/12core] delays[10/25/50/100/1000(ns)] [emu]'
 
 log_path = '/mnt/ramdisk/'
 MAX_failed = 20
@@ -29,6 +29,7 @@ runs = 1
 start_time = 0
 disk = 0
 pagedensity = 0
+emulate = 0
 memory_overhead = 0
 #input_size = 'simsmall'
 input_size = 'simlarge'
@@ -106,6 +107,8 @@ for p in sys.argv:
 		log_path = '/mnt/ssd/terry/tmp/'
 	elif p == 'pagedensity':
 		pagedensity = 1
+	elif p == 'emu':
+		emulate = 1
 
 if len(benchmarks) == 0:
 	benchmarks = all_benchmarks
@@ -413,6 +416,11 @@ def mountNVMfs(delay):
 	os.system(cmd)
 	print '[NVthread-eval] Mounted NVM filesystem with write delay '+str(delay)+' ns at ' + mountPoint
 
+# Emulate the write delay in the library (built with -DNVM_EMULATION) instead of nvmfs
+def setNVMEmulation(delay):
+	os.environ['NVTHREAD_NVM_WRITE_NS'] = str(delay)
+	print '[NVthread-eval] Emulating NVM write delay '+str(delay)+' ns in libnvthread'
+
 # Umount nvmfs
 def umountNVMfs():
 	cmd = 'sudo umount '+mountPoint
@@ -431,7 +439,10 @@ def main():
 		delay = d;
 		start_time = time.time()
 		if delay != 0:
-			mountNVMfs(delay)
+			if emulate == 1:
+				setNVMEmulation(delay)
+			else:
+				mountNVMfs(delay)
 
 		if build == 1:
 			buildAll()
@@ -444,7 +455,7 @@ def main():
 		elapsed_time = time.time() - start_time
 		print '[NVthread-eval] Finished, time: ' + str(elapsed_time) + ' seconds.'
 
-		if delay != 0:
+		if delay != 0 and emulate == 0:
 			umountNVMfs()
 
 main()
@@ -0,0 +1,122 @@
+// -*- C++ -*-
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   crc32c.h
+ * @brief  CRC32C (Castagnoli) checksums of log records.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32C_X86
+#endif
+
+/* The SSE4.2 crc32 instruction is used when the cpu has it, a table driven
+ * loop otherwise; both give the same values. Checksums are chained: the
+ * result of one call can be passed as "crc" to continue over more bytes.
+ */
+class crc32c {
+public:
+  typedef uint32_t (*crcFunc)(uint32_t crc, const void * buf, size_t length);
+
+  static uint32_t compute(const void * buf, size_t length) {
+    return extend(0, buf, length);
+  }
+
+  static uint32_t extend(uint32_t crc, const void * buf, size_t length) {
+    static crcFunc func = select();
+    return func(crc, buf, length);
+  }
+
+  static bool hardware(void) {
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+#else
+    return false;
+#endif
+  }
+
+  static uint32_t extendSoftware(uint32_t crc, const void * buf, size_t length) {
+    static uint32_t * table = makeTable();
+    const unsigned char * p = (const unsigned char *)buf;
+
+    crc = ~crc;
+    while (length--) {
+      crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+  }
+
+#ifdef CRC32C_X86
+  __attribute__((target("sse4.2")))
+  static uint32_t extendHardware(uint32_t crc, const void * buf, size_t length) {
+    const unsigned char * p = (const unsigned char *)buf;
+
+    crc = ~crc;
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t), p += sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, p, sizeof(word));
+      crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+#endif
+    for (; length >= sizeof(uint32_t); length -= sizeof(uint32_t), p += sizeof(uint32_t)) {
+      uint32_t word;
+      memcpy(&word, p, sizeof(word));
+      crc = _mm_crc32_u32(crc, word);
+    }
+    while (length--) {
+      crc = _mm_crc32_u8(crc, *p++);
+    }
+    return ~crc;
+  }
+#endif
+
+private:
+  static crcFunc select(void) {
+#ifdef CRC32C_X86
+    if (hardware()) {
+      return extendHardware;
+    }
+#endif
+    return extendSoftware;
+  }
+
+  static uint32_t * makeTable(void) {
+    static uint32_t table[256];
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t value = i;
+      for (int bit = 0; bit < 8; bit++) {
+        value = (value & 1) ? (value >> 1) ^ 0x82f63b78U : (value >> 1);
+      }
+      table[i] = value;
+    }
+    return table;
+  }
+};
+
+#endif
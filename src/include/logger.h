@@ -42,10 +42,37 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include <fcntl.h>
 #include <errno.h>
 #include <fstream>
+#include <stdint.h>
+#include <time.h>
 #include "xdefines.h"
 #include "prof.h"
+#include "crc32c.h"
+#include "xlzcodec.h"
+#include "xpmem.h"
+#ifdef GROUP_COMMIT
+#include "xgroupcommit.h"
+#endif
+#ifdef URING_LOG
+#include "xuring.h"
+#endif
+#ifdef NVM_EMULATION
+#include "xnvmemu.h"
+#endif
+#ifdef PMEM_LOG
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#ifndef MAP_SHARED_VALIDATE
+#define MAP_SHARED_VALIDATE 0x03
+#endif
+#ifndef MAP_SYNC
+#define MAP_SYNC 0x80000
+#endif
+#endif
 
 //#define DIFF_LOGGING
+#ifdef DIFF_LOGGING
+#include "xpagediff.h"
+#endif
 #define ADDRBYTE sizeof(void*)
 #define NVLOGGING
 #define LDEBUG 0
@@ -65,17 +92,150 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 const char eol_symbol[] = "EOL";
 
+#if defined(CIRCULAR_LOG) && defined(DIFF_LOGGING)
+#error "CIRCULAR_LOG does not keep the DIFF record chains of DIFF_LOGGING"
+#endif
+
+#if defined(PMEM_LOG) && defined(URING_LOG)
+#error "PMEM_LOG stores to a mapping of the log, URING_LOG writes it through io_uring"
+#endif
+
+// Bytes of one per-thread log segment, header included.
+#ifndef NVTHREAD_LOG_SEGMENT_SIZE
+#define NVTHREAD_LOG_SEGMENT_SIZE (64UL * 1048576)
+#endif
+
+#if NVTHREAD_LOG_SEGMENT_SIZE % 4096 != 0
+#error "NVTHREAD_LOG_SEGMENT_SIZE must be a multiple of the page size"
+#endif
+
 class LogDefines {
  public:
   enum {PageSize = 4096UL };
   enum {PAGE_SIZE_MASK = (PageSize - 1)};
+  enum {SegmentSize = NVTHREAD_LOG_SEGMENT_SIZE };
+  enum {SegmentHeaderSize = PageSize };
+  enum {RecordHeaderSize = 64 };
+  enum {PageRecordSize = RecordHeaderSize + PageSize };
+  // Larger transactions are written in chunks of this size.
+  enum {StageLimit = 1024 * PageRecordSize };
+  // Diffs with a larger payload are logged as a whole page instead.
+  enum {DiffLimit = PageSize / 2 };
+  // Longest chain of DIFF records recovery has to follow for a page.
+  enum {DiffChainLimit = 16 };
+  // Page images are logged packed when their payload gets below this size.
+  enum {PackLimit = PageSize - PageSize / 8 };
+};
+
+/* A transaction is logged as a TXN record, one PAGE record per logged page
+ * and a COMMIT record. The page lookup info holds the log offset of the page
+ * image, right behind its record header.
+ *
+ * Every record carries a CRC32C of itself, computed with its crc field set
+ * to 0. The COMMIT record also holds the number of PAGE records and a CRC32C
+ * over the crc fields of the TXN and PAGE records, so a transaction is
+ * known to be complete without ordering its end behind the other records:
+ * it is made durable with a single flush.
+ *
+ * Without CIRCULAR_LOG the transactions a thread commits with the same
+ * xactID (the barrier epoch) are appended to MemLog_<threadID>_<xactID>.
+ *
+ * With CIRCULAR_LOG every thread logs to one preallocated segment file,
+ * MemLog_<threadID>. The segment header is followed by a ring of records.
+ * Records are addressed by a logical offset that only grows and are stored
+ * at SegmentHeaderSize + offset % ringSize; they never wrap around the end
+ * of the ring, a PAD record fills the gap instead. Transactions are
+ * reclaimed as a whole; their pages still referenced by the lookup info are
+ * copied forward into COPY records, which only carry their own CRC32C.
+ *
+ * With DIFF_LOGGING a page with few modified bytes is logged as a DIFF
+ * record instead of a PAGE record. It holds the (offset, length) extents of
+ * the modified runs and their bytes, and links to the record the page was
+ * logged in before, whose contents it applies to. Recovery follows the chain
+ * back to a PAGE record, or to a page that was never logged and is zero.
+ *
+ * With LOG_COMPRESSION a page image is logged as a ZERO record if all its
+ * bytes are zero, or as an LZ record holding it compressed by xlzcodec if
+ * that is smaller than PackLimit. Both start with a LogPackHeader and stand
+ * for a PAGE record everywhere; recovery reads them in every build.
+ *
+ * With PMEM_LOG the log file is mapped, with MAP_SYNC on a DAX file system
+ * or plainly on tmpfs and ramfs, whose page cache is the log device. The
+ * staged records are copied into the mapping and their cache lines written
+ * back as they go; a transaction is made durable by one sfence, see
+ * xpmem.h. Elsewhere stores to a mapping are not durable, the logger falls
+ * back to FSYNC. The files are laid out as in every other build. Without
+ * CIRCULAR_LOG the file of an epoch stays mapped between its transactions;
+ * it is preallocated in doubling steps and cut back to its last record once
+ * the thread moves on to the next epoch or ends. After a crash recovery
+ * skips the zeros behind the last record.
+ */
+enum LogRecordType {
+  LOG_RECORD_TXN = 1,
+  LOG_RECORD_PAGE,
+  LOG_RECORD_COMMIT,
+  LOG_RECORD_PAD,
+  LOG_RECORD_COPY,
+  LOG_RECORD_DIFF,
+  LOG_RECORD_ZERO,
+  LOG_RECORD_LZ
+};
+
+#define LOG_SEGMENT_MAGIC "NVLOGSEG"
+#define LOG_RECORD_MAGIC 0x4e56524bU
+
+struct LogSegmentHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t threadID;
+  uint64_t ringSize;
+  uint64_t tail;       // oldest record still referenced when last cleaned
+};
+
+struct LogRecordHeader {
+  uint32_t magic;
+  uint32_t type;
+  uint64_t offset;     // logical offset of this header
+  uint64_t length;     // whole record, header included
+  uint64_t xactID;
+  uint64_t link;       // TXN: the previous TXN record, PAGE, DIFF and COMMIT: their TXN record
+  int32_t pageNo;      // PAGE, COPY and DIFF records
+  int32_t threadID;
+  uint32_t count;      // COMMIT: page records in the transaction, COPY: type of the record copied
+  uint32_t sum;        // COMMIT: CRC32C of the crc fields of the transaction
+  uint32_t crc;        // CRC32C of the whole record
+  uint32_t reserved;
+};
+
+/* A DIFF record is its header, a LogDiffHeader, "extents" LogExtents and
+ * the bytes of the extents in the same order, padded to 8 bytes. */
+struct LogDiffHeader {
+  uint64_t prevOffset;    // the page as logged before, a lookup info offset
+  uint16_t prevXactID;
+  uint16_t prevThreadID;  // 0 if the page was never logged before
+  uint16_t extents;
+  uint16_t chain;         // DIFF records back to a PAGE record, this one included
+};
+
+struct LogExtent {
+  uint16_t offset;
+  uint16_t length;
+};
+
+/* ZERO and LZ records are their header, a LogPackHeader and the compressed
+ * bytes, padded to 8 bytes. */
+struct LogPackHeader {
+  uint32_t rawSize;       // bytes of the page image
+  uint32_t packedSize;    // bytes following this header, 0 for ZERO
 };
 
 enum DurableMethod {
   MSYNC,
   MFENCE,
   MFENCEMSYNC,
-  FSYNC
+  FSYNC,
+  URING,        // FSYNC through io_uring, falls back to FSYNC without it
+  PMEM          // stores to a mapping of the log, falls back to FSYNC without DAX
 };
 
 #define PATH_CONFIG "/tmp/nvthread.config"
@@ -133,7 +293,6 @@ class MemoryLog {
   char* _mempages_ptr;
   static int _DurableMethod;
   int _dirtiedPagesCount;
-  unsigned long _buffered_bytes;
   unsigned long logged_bytes;
   int _log_flags;
   char logPath[FILENAME_MAX];
@@ -156,6 +315,52 @@ class MemoryLog {
   char _eol_filename[FILENAME_MAX];
   int _eol_size;
 
+  /* Records of the current transaction, written out with one call */
+  char* _stage_ptr;
+  unsigned long _stage_size;
+  unsigned long _stage_bytes;
+  unsigned long _stage_offset;   // log offset of the first staged byte
+  unsigned long _last_record;    // log offset of the last page image
+#ifdef LOG_COMPRESSION
+  /* The page image being logged, and its compressed bytes */
+  char _pack_image[LogDefines::PageSize] __attribute__((aligned(8)));
+  char _pack_buf[LogDefines::PackLimit];
+#endif
+#ifdef URING_LOG
+  /* With URING, one stage buffer is written while the other one fills */
+  xuring _uring;
+  char* _stage_buf[2];
+  int _stage_index;
+#endif
+#ifdef PMEM_LOG
+  /* With PMEM, the log file mapped from its start */
+  char* _pmem_ptr;
+  unsigned long _pmem_length;
+#ifndef CIRCULAR_LOG
+  unsigned long _pmem_xactID;    // epoch of the file kept mapped between its transactions
+  unsigned long _pmem_end;       // end of its last transaction
+#endif
+#endif
+
+  /* Transaction being logged */
+  unsigned long _txn_offset;     // log offset of its TXN record
+  unsigned long _last_txn;
+  uint32_t _txn_pages;
+  uint32_t _txn_sum;
+
+#ifdef CIRCULAR_LOG
+  /* For the log segment, _mempages_fd stays open between transactions */
+  typedef bool (*liveFunc)(void* owner, int threadID, int pageNo, unsigned long offset);
+  typedef void (*moveFunc)(void* owner, int threadID, int pageNo, unsigned long from, unsigned long to);
+
+  unsigned long _ring_size;
+  unsigned long _ring_head;      // logical offset of the next record
+  unsigned long _ring_tail;      // oldest record that may still be referenced
+  liveFunc _record_live;
+  moveFunc _record_moved;
+  void* _record_owner;
+#endif
+
   MemoryLog() {
   }
   ~MemoryLog() {
@@ -177,12 +382,55 @@ class MemoryLog {
     _mempages_file_count = 0;
     _dirtiedPagesCount = 0;
     nvid = _nvid;
+    // A new thread inherits the buffers of its parent, which are not its own.
+    _stage_ptr = NULL;
+    _stage_size = 0;
+#ifdef URING_LOG
+    _stage_buf[0] = NULL;
+    _stage_buf[1] = NULL;
+    _stage_index = 0;
+    if (_DurableMethod == URING && !_uring.setup()) {
+      lprintf("io_uring is not available, using fdatasync\n");
+      _DurableMethod = FSYNC;
+    }
+#endif
+#ifdef PMEM_LOG
+    // A new thread drops the mapping of its parent's log file; the
+    // descriptor is shared and stays open.
+    UnmapLog();
+    _mempages_fd = -1;
+#endif
+#ifdef CIRCULAR_LOG
+    _mempages_fd = -1;
+    _record_live = NULL;
+    _record_moved = NULL;
+#endif
   }
 
   void finalize() {
     if (!_logging_enabled) {
       return;
     }
+#ifdef URING_LOG
+    if (_DurableMethod == URING) {
+      _uring.waitAll();
+      _uring.teardown();
+    }
+#endif
+#if defined(PMEM_LOG) && !defined(CIRCULAR_LOG)
+    if (_pmem_ptr != NULL) {
+      CloseLogFile();
+    }
+#endif
+#ifdef PMEM_LOG
+    UnmapLog();
+#endif
+#ifdef CIRCULAR_LOG
+    if (_mempages_fd != -1) {
+      close(_mempages_fd);
+      _mempages_fd = -1;
+    }
+#endif
   }
 
   void setNVID(int _nvid) {
@@ -197,9 +445,43 @@ class MemoryLog {
     }
   }
 
+  // NVTHREAD_DURABLE_METHOD picks FSYNC or the method built in (URING with
+  // URING_LOG, PMEM with PMEM_LOG) at run time; unset keeps the build default.
+  static void ReadDurableMethod(void) {
+    const char* method = getenv("NVTHREAD_DURABLE_METHOD");
+    if (method == NULL) {
+      return;
+    }
+    if (strcmp(method, "FSYNC") == 0) {
+      _DurableMethod = FSYNC;
+#ifdef URING_LOG
+    } else if (strcmp(method, "URING") == 0) {
+      _DurableMethod = URING;
+#endif
+#ifdef PMEM_LOG
+    } else if (strcmp(method, "PMEM") == 0) {
+      _DurableMethod = PMEM;
+#endif
+    } else {
+      static bool warned = false;
+      if (!warned) {
+        fprintf(stderr, "NVTHREAD_DURABLE_METHOD=%s is not built in, using %d\n", method, _DurableMethod);
+        warned = true;
+      }
+    }
+    lprintf("Durable method: %s, _DurableMethod = %d\n", method, _DurableMethod);
+  }
+
   void ReadConfig(void) {
     log_dest = NVM_RAMDISK;
+#if defined(URING_LOG)
+    _DurableMethod = URING;
+#elif defined(PMEM_LOG)
+    _DurableMethod = PMEM;
+#else
     _DurableMethod = FSYNC;
+#endif
+    ReadDurableMethod();
     _eol_size = sizeof(eol_symbol);
     _log_flags = O_RDWR | O_ASYNC | O_APPEND;
     return;
@@ -230,7 +512,9 @@ class MemoryLog {
 
   void OpenMemoryLog(int dirtiedPagesCount, bool isHeap, unsigned long XactID) {
     _dirtiedPagesCount = dirtiedPagesCount;
-    _mempages_filesize = _dirtiedPagesCount * LogEntry::LogEntrySize + _eol_size;
+    // Every page, the TXN and COMMIT records; DIFF records are smaller
+    _mempages_filesize = (unsigned long)_dirtiedPagesCount * LogDefines::PageRecordSize
+                         + 2 * LogDefines::RecordHeaderSize;
     _local_transaction_id = XactID;
     _mempages_offset = 0;
 
@@ -243,31 +527,509 @@ class MemoryLog {
       abort();
     }
   
-    // Create memlog 
-    sprintf(_mempages_filename, "%s/MemLog_%d_%lu", logPath, threadID, XactID);
-    _mempages_fd = open(_mempages_filename, O_RDWR | O_ASYNC | O_CREAT, 0644);
+#ifdef CIRCULAR_LOG
     if (_mempages_fd == -1) {
-      fprintf(stderr, "%d: Error creating %s\n", getpid(), _mempages_filename);
-      perror("mkstemp: ");
-      abort();
+      OpenLogSegment();
     }
 
+    // Room for the transaction and a PAD record.
+    OpenStage(_mempages_filesize + LogDefines::PageRecordSize);
+    ReserveRing(_mempages_filesize + LogDefines::PageRecordSize);
+    BeginTransaction();
+    return;
+#else
+#ifdef PMEM_LOG
+    if (_pmem_ptr != NULL && _pmem_xactID != XactID) {
+      CloseLogFile();
+    }
+    if (_pmem_ptr != NULL) {
+      // The file of the epoch is still open and mapped, see CloseMemoryLog().
+      _mempages_offset = _pmem_end;
+    } else
+#endif
+    {
+      // Create memlog
+      sprintf(_mempages_filename, "%s/MemLog_%d_%lu", logPath, threadID, XactID);
+      _mempages_fd = open(_mempages_filename, O_RDWR | O_ASYNC | O_CREAT, 0644);
+      if (_mempages_fd == -1) {
+        fprintf(stderr, "%d: Error creating %s\n", getpid(), _mempages_filename);
+        perror("mkstemp: ");
+        abort();
+      }
 
+      // Every commit of a thread within one epoch has the same XactID, later
+      // ones are appended behind the earlier transactions.
+      off_t end = lseek(_mempages_fd, 0, SEEK_END);
+      if (end == -1) {
+        perror("lseek: ");
+        abort();
+      }
+      _mempages_offset = end;
+#ifdef PMEM_LOG
+      if (_DurableMethod == PMEM) {
+        _pmem_xactID = XactID;
+        MapLog(_mempages_offset, _mempages_filesize);
+      }
+#endif
+    }
+#endif
 
-#ifdef DIFF_LOGGING
-    // Allocate memory buffer to store dirtied bytes
-    _buffered_bytes = 0;
-    _mempages_ptr = (char*)InternalMalloc(LogDefines::PageSize * dirtiedPagesCount);
-    lprintf("Opened diff memory page log. fd: %d, filename: %s, ptr: %p, offset: %lu\n",
-            _mempages_fd, _mempages_filename, _mempages_ptr, _mempages_offset);
-#else   
-    // Only need 1 page as we log page by page
-    _mempages_ptr = (char*)InternalMalloc(LogDefines::PageSize);
+    // Records are staged and written together, at offsets known in advance
+    _last_txn = 0;
+    OpenStage(_mempages_filesize);
+    BeginTransaction();
     lprintf("Opened memory page log. fd: %d, filename: %s, size: %lu, ptr: %p, offset: %lu\n",
             _mempages_fd, _mempages_filename, _mempages_filesize, _mempages_ptr, _mempages_offset);
+  }
+
+  /* Stage the TXN record of a new transaction */
+  void BeginTransaction(void) {
+    struct LogRecordHeader* txn = (struct LogRecordHeader*)StageRecord(LogDefines::RecordHeaderSize, &_txn_offset);
+    MakeRecordHeader(txn, LOG_RECORD_TXN, LogDefines::RecordHeaderSize, -1, _txn_offset);
+    txn->link = _last_txn;
+    _last_txn = _txn_offset;
+    _txn_pages = 0;
+    _txn_sum = 0;
+    SealRecord(txn, true);
+  }
+
+  void MakeRecordHeader(struct LogRecordHeader* header, int type, unsigned long length, int pageNo, unsigned long offset) {
+    memset(header, 0, sizeof(*header));
+    header->magic = LOG_RECORD_MAGIC;
+    header->type = type;
+    header->offset = offset;
+    header->length = length;
+    header->xactID = _local_transaction_id;
+    header->pageNo = pageNo;
+    header->threadID = threadID;
+  }
+
+  /* Checksum a staged record, and add it to the transaction sum if "chain" */
+  inline void SealRecord(struct LogRecordHeader* header, bool chain) {
+    header->crc = crc32c::compute(header, header->length);
+    if (chain) {
+      _txn_sum = crc32c::extend(_txn_sum, &header->crc, sizeof(header->crc));
+    }
+  }
+
+  /* Offset of the last logged page image, as recorded in the page lookup info */
+  unsigned long LastRecordOffset(void) {
+    return _last_record;
+  }
+
+  /* Bytes logged by the current transaction so far */
+  unsigned long TransactionBytes(void) {
+    return LogHead() - _txn_offset;
+  }
+
+  /* Log offset of the next record */
+  inline unsigned long LogHead(void) {
+#ifdef CIRCULAR_LOG
+    return _ring_head;
+#else
+    return _mempages_offset;
+#endif
+  }
+
+  /* Make the stage large enough for "bytes" bytes of records, up to StageLimit */
+  void OpenStage(unsigned long bytes) {
+    if (bytes > LogDefines::StageLimit) {
+      bytes = LogDefines::StageLimit;
+    }
+    if (bytes > _stage_size) {
+#ifdef URING_LOG
+      if (_DurableMethod == URING) {
+        GrowUringStage(bytes);
+      } else
 #endif
+      {
+        if (_stage_ptr != NULL) {
+          InternalFree(_stage_ptr, _stage_size);
+        }
+        _stage_size = (bytes + LogDefines::PAGE_SIZE_MASK) & ~(unsigned long)LogDefines::PAGE_SIZE_MASK;
+        _stage_ptr = (char*)InternalMalloc(_stage_size);
+      }
+    }
+    _stage_bytes = 0;
+    _stage_offset = LogHead();
+    _mempages_ptr = _stage_ptr;
   }
 
+  /* Take "length" bytes of the stage, writing out what is staged if it is full */
+  inline char* StageBytes(unsigned long length) {
+    if (_stage_bytes + length > _stage_size) {
+      FlushStage();
+    }
+    char* ptr = _stage_ptr + _stage_bytes;
+    _stage_bytes += length;
+    return ptr;
+  }
+
+  /* The log length of a record of "bytes" bytes. In the ring every record
+   * is a multiple of the header size, so the gap left at the ring end always
+   * has room for the header of a PAD record. */
+  static inline unsigned long RecordLength(unsigned long bytes) {
+#ifdef CIRCULAR_LOG
+    return (bytes + LogDefines::RecordHeaderSize - 1) & ~(unsigned long)(LogDefines::RecordHeaderSize - 1);
+#else
+    return (bytes + 7) & ~7UL;
+#endif
+  }
+
+  /* Take room for the next record; "offset" receives its log offset */
+  inline char* StageRecord(unsigned long length, unsigned long* offset) {
+#ifdef CIRCULAR_LOG
+    unsigned long left = _ring_size - _ring_head % _ring_size;
+    if (left < length) {
+      // Only the header of the PAD record is written. The next record
+      // starts at the beginning of the ring, away from what is staged.
+      struct LogRecordHeader* pad = (struct LogRecordHeader*)StageBytes(LogDefines::RecordHeaderSize);
+      MakeRecordHeader(pad, LOG_RECORD_PAD, left, -1, _ring_head);
+      _ring_head += left;
+      FlushStage();
+    } else if (left == _ring_size && _stage_bytes > 0) {
+      // The staged records end at the end of the ring; they are written
+      // out on their own, one write never wraps around.
+      FlushStage();
+    }
+    char* record = StageBytes(length);
+    *offset = _ring_head;
+    _ring_head += length;
+#else
+    char* record = StageBytes(length);
+    *offset = _mempages_offset;
+    _mempages_offset += length;
+#endif
+    return record;
+  }
+
+#ifdef URING_LOG
+  /* Both stage buffers are registered with the ring, so they are replaced together */
+  void GrowUringStage(unsigned long bytes) {
+    _uring.waitAll();
+    for (int i = 0; i < 2; i++) {
+      if (_stage_buf[i] != NULL) {
+        InternalFree(_stage_buf[i], _stage_size);
+      }
+    }
+    _stage_size = (bytes + LogDefines::PAGE_SIZE_MASK) & ~(unsigned long)LogDefines::PAGE_SIZE_MASK;
+    _stage_buf[0] = (char*)InternalMalloc(_stage_size);
+    _stage_buf[1] = (char*)InternalMalloc(_stage_size);
+    _uring.registerBuffers(_stage_buf[0], _stage_buf[1], _stage_size);
+    _stage_index = 0;
+    _stage_ptr = _stage_buf[0];
+  }
+#endif
+
+  /* File position of the first staged byte */
+  inline off_t StagePosition(void) {
+#ifdef CIRCULAR_LOG
+    return RingPosition(_stage_offset);
+#else
+    return _stage_offset;
+#endif
+  }
+
+  /* Wait until the staged records written so far have reached the file */
+  inline void WaitStage(void) {
+#ifdef URING_LOG
+    if (_DurableMethod == URING) {
+      _uring.waitAll();
+    }
+#endif
+  }
+
+  /* Write the staged records with a single call */
+  void FlushStage(void) {
+    unsigned long done = 0;
+    int retry = 0;
+
+#ifdef NVM_EMULATION
+    xnvmemu::getInstance().write(_stage_bytes);
+#endif
+
+#ifdef URING_LOG
+    if (_DurableMethod == URING) {
+      // Logging goes on in the other buffer while this one is written.
+      if (_stage_bytes > 0) {
+        _uring.write(_mempages_fd, _stage_ptr, _stage_bytes, StagePosition(), _stage_index);
+        _stage_index ^= 1;
+        _uring.waitBuffer(_stage_index);
+        _stage_ptr = _stage_buf[_stage_index];
+        _mempages_ptr = _stage_ptr;
+      }
+      _stage_bytes = 0;
+      _stage_offset = LogHead();
+      return;
+    }
+#endif
+
+#ifdef PMEM_LOG
+    if (_DurableMethod == PMEM) {
+      // Records of a larger transaction than expected get a new mapping.
+      unsigned long position = StagePosition();
+      if (position + _stage_bytes > _pmem_length) {
+        MapLog(position, _stage_bytes);
+      }
+      if (_DurableMethod == PMEM) {
+        char* dest = _pmem_ptr + position;
+        memcpy(dest, _stage_ptr, _stage_bytes);
+        ADD_COUNTER(pmemlines, xpmem::getInstance().flush(dest, _stage_bytes));
+        _stage_bytes = 0;
+        _stage_offset = LogHead();
+        return;
+      }
+    }
+#endif
+
+    off_t position = StagePosition();
+    while (done < _stage_bytes) {
+      ssize_t sz = pwrite(_mempages_fd, _stage_ptr + done, _stage_bytes - done, position + done);
+      if (sz == -1) {
+        fprintf(stderr, "%d: write error fd: %d, filename: %s\n", getpid(), _mempages_fd, _mempages_filename);
+        perror("pwrite (records): ");
+        // Filesystem error, cannot write file
+        if (++retry == 3) {
+          abort();
+        }
+        continue;
+      }
+      done += sz;
+    }
+
+    _stage_bytes = 0;
+    _stage_offset = LogHead();
+  }
+
+#ifdef PMEM_LOG
+  /* Map the log file from its start up to at least position + length,
+   * growing the file if it ends before. A mapping that is too small is
+   * replaced by one of twice its size, so the transactions of an epoch
+   * remap the file only a few times. Without a mapping whose stores are
+   * durable the logger falls back to FSYNC. */
+  void MapLog(unsigned long position, unsigned long length) {
+    unsigned long size = position + length;
+    if (size < 2 * _pmem_length) {
+      size = 2 * _pmem_length;
+    }
+    size = (size + LogDefines::PAGE_SIZE_MASK) & ~(unsigned long)LogDefines::PAGE_SIZE_MASK;
+    UnmapLog();
+
+    struct stat st;
+    if (fstat(_mempages_fd, &st) != 0) {
+      perror("fstat: ");
+      abort();
+    }
+    if ((unsigned long)st.st_size < size) {
+      // Preallocated so that no store faults in a block; the file is cut
+      // back to its last record when closed.
+      if (fallocate(_mempages_fd, 0, st.st_size, size - st.st_size) != 0
+          && ftruncate(_mempages_fd, size) != 0) {
+        fprintf(stderr, "%d: Error sizing %s\n", getpid(), _mempages_filename);
+        perror("ftruncate: ");
+        abort();
+      }
+    }
+
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE | MAP_SYNC, _mempages_fd, 0);
+    if (ptr == MAP_FAILED && (errno == EOPNOTSUPP || errno == EINVAL) && MemoryFileSystem(_mempages_fd)) {
+      ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, _mempages_fd, 0);
+    }
+    if (ptr == MAP_FAILED) {
+      fprintf(stderr, "%d: %s cannot be mapped for persistent stores (%s), using fdatasync\n",
+              getpid(), _mempages_filename, strerror(errno));
+      _DurableMethod = FSYNC;
+#ifndef CIRCULAR_LOG
+      // Nothing is logged past position yet.
+      if ((unsigned long)st.st_size < size && ftruncate(_mempages_fd, position) != 0) {
+        perror("ftruncate: ");
+      }
+#endif
+      return;
+    }
+    _pmem_ptr = (char*)ptr;
+    _pmem_length = size;
+  }
+
+  void UnmapLog(void) {
+    if (_pmem_ptr != NULL) {
+      munmap(_pmem_ptr, _pmem_length);
+      _pmem_ptr = NULL;
+      _pmem_length = 0;
+    }
+  }
+
+  /* Whether the file lives in memory, so its page cache is the log device */
+  static bool MemoryFileSystem(int fd) {
+    struct statfs fs;
+    return fstatfs(fd, &fs) == 0 && (fs.f_type == TMPFS_MAGIC || fs.f_type == RAMFS_MAGIC);
+  }
+#endif
+
+#ifdef CIRCULAR_LOG
+  /* Tell the ring which records are still referenced by the page lookup
+   * info, and how to follow a record that is copied forward. */
+  void SetRecordOwner(liveFunc live, moveFunc moved, void* owner) {
+    _record_live = live;
+    _record_moved = moved;
+    _record_owner = owner;
+  }
+
+  /* Create and preallocate the segment of this thread */
+  void OpenLogSegment(void) {
+    sprintf(_mempages_filename, "%s/MemLog_%d", logPath, threadID);
+    _mempages_fd = open(_mempages_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (_mempages_fd == -1) {
+      fprintf(stderr, "%d: Error creating %s\n", getpid(), _mempages_filename);
+      perror("open: ");
+      abort();
+    }
+
+    if (fallocate(_mempages_fd, 0, 0, LogDefines::SegmentSize) != 0) {
+      // Not every file system preallocates; the file is still sized once.
+      if (ftruncate(_mempages_fd, LogDefines::SegmentSize) != 0) {
+        fprintf(stderr, "%d: Error sizing %s\n", getpid(), _mempages_filename);
+        perror("ftruncate: ");
+        abort();
+      }
+    }
+
+    _ring_size = LogDefines::SegmentSize - LogDefines::SegmentHeaderSize;
+    _ring_head = 0;
+    _ring_tail = 0;
+    _last_txn = 0;
+    _last_record = 0;
+    WriteSegmentHeader();
+#ifdef PMEM_LOG
+    if (_DurableMethod == PMEM) {
+      MapLog(0, LogDefines::SegmentSize);
+    }
+#endif
+    lprintf("Opened log segment. fd: %d, filename: %s, ring: %lu\n", _mempages_fd, _mempages_filename, _ring_size);
+  }
+
+  void WriteSegmentHeader(void) {
+    struct LogSegmentHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LOG_SEGMENT_MAGIC, sizeof(header.magic));
+    header.version = 1;
+    header.threadID = threadID;
+    header.ringSize = _ring_size;
+    header.tail = _ring_tail;
+#ifdef NVM_EMULATION
+    xnvmemu::getInstance().write(sizeof(header));
+#endif
+    if (pwrite(_mempages_fd, &header, sizeof(header), 0) != sizeof(header)) {
+      fprintf(stderr, "%d: write error fd: %d, filename: %s\n", getpid(), _mempages_fd, _mempages_filename);
+      perror("pwrite (segment header): ");
+      abort();
+    }
+  }
+
+  inline unsigned long RingPosition(unsigned long offset) {
+    return LogDefines::SegmentHeaderSize + offset % _ring_size;
+  }
+
+  void PreadRing(void* buf, unsigned long length, unsigned long offset) {
+    if (pread(_mempages_fd, buf, length, RingPosition(offset)) != (ssize_t)length) {
+      fprintf(stderr, "%d: read error fd: %d, filename: %s\n", getpid(), _mempages_fd, _mempages_filename);
+      perror("pread (record): ");
+      abort();
+    }
+  }
+
+  /* Make sure "bytes" more bytes can be appended without overwriting a
+   * page image the lookup info still refers to. Old transactions are
+   * dropped from the tail as a whole; the referenced pages are copied to
+   * the head first. */
+  void ReserveRing(unsigned long bytes) {
+    unsigned long end = _ring_head;
+    unsigned long copied = 0;
+    bool inTxn = false;
+
+#ifdef GROUP_COMMIT
+    // What replaced the records at the tail may not be durable yet.
+    if (_ring_size - (_ring_head - _ring_tail) < bytes) {
+      xgroupcommit::getInstance().drain();
+    }
+#endif
+
+    while (_ring_size - (_ring_head - _ring_tail) < bytes || inTxn) {
+      if (_ring_tail == end) {
+        fprintf(stderr, "%d: log segment %s is too small for %lu live pages and %lu new bytes,"
+                " raise NVTHREAD_LOG_SEGMENT_SIZE\n", getpid(), _mempages_filename, copied, bytes);
+        abort();
+      }
+
+      struct LogRecordHeader header;
+      PreadRing(&header, sizeof(header), _ring_tail);
+      if (header.magic != LOG_RECORD_MAGIC || header.offset != _ring_tail) {
+        fprintf(stderr, "%d: corrupted record at %lu in %s\n", getpid(), _ring_tail, _mempages_filename);
+        abort();
+      }
+
+      if (header.type == LOG_RECORD_TXN) {
+        inTxn = true;
+      } else if (header.type == LOG_RECORD_COMMIT) {
+        inTxn = false;
+      }
+
+      unsigned long image = _ring_tail + LogDefines::RecordHeaderSize;
+      if ((header.type == LOG_RECORD_PAGE || header.type == LOG_RECORD_COPY || header.type == LOG_RECORD_ZERO
+           || header.type == LOG_RECORD_LZ) && _record_live != NULL
+          && _record_live(_record_owner, threadID, header.pageNo, image)) {
+        // Room for the copy and a PAD record in front of it.
+        if (_ring_size - (_ring_head - _ring_tail) < 2 * LogDefines::PageRecordSize) {
+          fprintf(stderr, "%d: log segment %s is full of live pages, raise NVTHREAD_LOG_SEGMENT_SIZE\n",
+                  getpid(), _mempages_filename);
+          abort();
+        }
+
+        // The record is re-appended with its transaction id; its own
+        // checksum vouches for it once the transaction is gone.
+        unsigned long offset;
+        struct LogRecordHeader* copy = (struct LogRecordHeader*)StageRecord(header.length, &offset);
+        PreadRing(copy, header.length, _ring_tail);
+        copy->crc = 0;
+        if (header.length > LogDefines::PageRecordSize || crc32c::compute(copy, header.length) != header.crc) {
+          fprintf(stderr, "%d: corrupted record at %lu in %s\n", getpid(), _ring_tail, _mempages_filename);
+          abort();
+        }
+        if (header.type != LOG_RECORD_COPY) {
+          copy->count = header.type;
+        }
+        copy->type = LOG_RECORD_COPY;
+        copy->offset = offset;
+        copy->link = 0;
+        SealRecord(copy, false);
+        _record_moved(_record_owner, threadID, header.pageNo, image, offset + LogDefines::RecordHeaderSize);
+        copied++;
+        INC_COUNTER(logcopied);
+      }
+      _ring_tail += header.length;
+    }
+
+    if (copied > 0) {
+      // The copies must be durable before the space they came from is reused.
+      FlushStage();
+      WaitStage();
+#ifdef PMEM_LOG
+      if (_DurableMethod == PMEM) {
+        xpmem::fence();
+      }
+#endif
+      WriteSegmentHeader();
+      if (fdatasync(_mempages_fd) != 0) {
+        perror("fdatasync(): ");
+        abort();
+      }
+#ifdef NVM_EMULATION
+      xnvmemu::getInstance().flush();
+#endif
+    }
+  }
+#endif
+
   /* Log word to memory log */
   void logWord(char* local, char* twin, char* share, char *dest) {
     for (int i = 0; i < sizeof(long long); i++) {
@@ -286,8 +1048,20 @@ class MemoryLog {
     long long* mylocal = (long long*)((unsigned long)local & ~LogDefines::PAGE_SIZE_MASK);
     long long* mytwin = (long long*)twin;
     long long* myshare = (long long*)share;
-    long long* mylog = (long long*)(_mempages_ptr);
-    
+#ifdef LOG_COMPRESSION
+    // The image is built aside, its record size is known once it is packed.
+    long long* mylog = (long long*)_pack_image;
+#else
+    unsigned long offset;
+
+    // The image is built in place in the stage, behind its record header.
+    struct LogRecordHeader* header = (struct LogRecordHeader*)StageRecord(LogDefines::PageRecordSize, &offset);
+    MakeRecordHeader(header, LOG_RECORD_PAGE, LogDefines::PageRecordSize, pageNo, offset);
+    header->link = _txn_offset;
+    long long* mylog = (long long*)((char*)header + LogDefines::RecordHeaderSize);
+    _last_record = offset + LogDefines::RecordHeaderSize;
+#endif
+
     // Get the correct shared state before logging
     for (int i = 0; i < xdefines::PageSize / sizeof(long long); i++) {
       // Modified, log the updated bytes
@@ -299,124 +1073,240 @@ class MemoryLog {
         mylog[i] = myshare[i];
       }
     }
-
-    // Log the page
-    size_t sz;
-    int retry = 0;
-    do {
-      sz = write(_mempages_fd, (void*)_mempages_ptr, xdefines::PageSize);
-      if (sz == -1) {
-        fprintf(stderr, "%d: write image %p error fd: %d, filename: %s\n", getpid(), _mempages_ptr, _mempages_fd, _mempages_filename);
-        perror("write (page): ");
-        // Close and reopen the file to retry write again
-        close(_mempages_fd);
-        _mempages_fd = open(_mempages_filename, _log_flags);
-        retry++;
-        // Filesystem error, cannot open/write file
-        if (retry == 3) {
-          abort();
-        }
-      }
-    }while (sz == -1 && retry < 3);
+#ifdef LOG_COMPRESSION
+    struct LogRecordHeader* header = StagePackedPage(pageNo);
+#endif
+    _txn_pages++;
+    SealRecord(header, true);
 
     lprintf("Logged page %d\n", pageNo);
     INC_COUNTER(loggedpages);
     return 0;
   }
 
-#ifdef DIFF_LOGGING
-  /* Apply diff bytes from src to dest (vs twin) and return copied bytes */
-  inline int logDiffWord(char* src, char* twin, int block, int pageNo, 
-                     unsigned short xactID, unsigned short threadID, struct lookupinfo *pageLookupTmp) {
-    int copied_bytes = 0;
-    int page_start = block * sizeof(long long);
-    ssize_t rv = 0;
-    for (int i = 0; i < sizeof(long long); i++) {
-      if (src[i] != twin[i]) {
-        int page_offset = page_start + i;
+#ifdef LOG_COMPRESSION
+  /* Stage the record of the page image in _pack_image: ZERO if it is all
+   * zero, LZ if it compresses below PackLimit, PAGE otherwise. */
+  struct LogRecordHeader* StagePackedPage(int pageNo) {
+#ifdef ENABLE_PROFILING
+    struct timespec begin;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &begin);
+#endif
+    const uint64_t* words = (const uint64_t*)_pack_image;
+    int type = LOG_RECORD_ZERO;
+    unsigned long packed = 0;
 
-        START_TIMER(diff_logging);
-        memcpy(&_mempages_ptr[_buffered_bytes], &src[i], sizeof(char));
+    for (unsigned long i = 0; i < LogDefines::PageSize / sizeof(uint64_t); i++) {
+      if (words[i] != 0) {
+        type = LOG_RECORD_LZ;
+        break;
+      }
+    }
+    if (type == LOG_RECORD_LZ) {
+      packed = xlzcodec::compress(_pack_image, LogDefines::PageSize, _pack_buf, LogDefines::PackLimit);
+      if (packed == 0) {
+        type = LOG_RECORD_PAGE;
+      }
+    }
 
-        // Buffer page lookup info for each byte in the page
-        pageLookupTmp[pageNo]->xactIDs[page_offset] = xactID;
-        pageLookupTmp[pageNo]->threadIDs[page_offset] = threadID;
-        pageLookupTmp[pageNo]->memlogOffsets[page_offset] = _buffered_bytes;
-        pageLookupTmp[pageNo]->dirtied[page_offset] = true;
+    unsigned long length = LogDefines::PageRecordSize;
+    if (type != LOG_RECORD_PAGE) {
+      length = RecordLength(LogDefines::RecordHeaderSize + sizeof(struct LogPackHeader) + packed);
+    }
+    unsigned long offset;
+    struct LogRecordHeader* header = (struct LogRecordHeader*)StageRecord(length, &offset);
+    MakeRecordHeader(header, type, length, pageNo, offset);
+    header->link = _txn_offset;
+    _last_record = offset + LogDefines::RecordHeaderSize;
 
-        lprintf("Buffering Page %d: <byte, xactID, threadID, memlogOffset> = <%d, %d, %d, %lu>\n", 
-                 pageNo, page_offset, 
-                 pageLookupTmp[pageNo]->xactIDs[page_offset],
-                 pageLookupTmp[pageNo]->threadIDs[page_offset],
-                 pageLookupTmp[pageNo]->memlogOffsets[page_offset]);
+    char* body = (char*)header + LogDefines::RecordHeaderSize;
+    if (type == LOG_RECORD_PAGE) {
+      memcpy(body, _pack_image, LogDefines::PageSize);
+    } else {
+      struct LogPackHeader* pack = (struct LogPackHeader*)body;
+      pack->rawSize = LogDefines::PageSize;
+      pack->packedSize = packed;
+      memcpy(pack + 1, _pack_buf, packed);
+      memset((char*)(pack + 1) + packed, 0, (char*)header + length - ((char*)(pack + 1) + packed));
+    }
 
-        STOP_TIMER(diff_logging);
-        _buffered_bytes++;
-        copied_bytes++;
-      }
+#ifdef ENABLE_PROFILING
+    struct timespec end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    ADD_COUNTER(packtime, (end.tv_sec - begin.tv_sec) * 1000000000L + (end.tv_nsec - begin.tv_nsec));
+#endif
+    if (type == LOG_RECORD_ZERO) {
+      INC_COUNTER(zeropages);
+    } else if (type == LOG_RECORD_LZ) {
+      INC_COUNTER(lzpages);
     }
-    lprintf("committed bytes %d\n", copied_bytes);
-    return copied_bytes;
+    ADD_COUNTER(packraw, LogDefines::PageSize);
+    ADD_COUNTER(packbytes, length - LogDefines::RecordHeaderSize);
+    return header;
   }
+#endif
 
-  /* Append page diffs to the end of the memory log */
-  void AppendDiffsToMemoryLog(const void* local, const void* twin, int pageNo, 
-                              unsigned short xactID, unsigned short threadID, 
-                              struct lookupinfo pageLookupTmp) {
-    int diff_bytes = 0;
+#ifdef DIFF_LOGGING
+  /* Log the bytes of the page that differ from twin, as a DIFF record applied
+   * to what was logged for the page before at (prevThreadID, prevXactID,
+   * prevOffset) with chain length prevChain. Pages with too many changes, or
+   * at the end of a long chain, are logged whole. Returns the chain length
+   * of the new record, 0 for a PAGE record. */
+  int AppendDiffMemoryLog(const void* local, const void* twin, const void* share, int pageNo,
+                          unsigned short prevThreadID, unsigned short prevXactID,
+                          unsigned long prevOffset, int prevChain) {
+    const char* mylocal = (const char*)((unsigned long)local & ~LogDefines::PAGE_SIZE_MASK);
+    const char* myshare = (const char*)share;
+    uint64_t mask[xpagediff::MaskWords];
+    struct LogExtent extents[LogDefines::DiffLimit / sizeof(struct LogExtent)];
+    unsigned long payload = sizeof(struct LogDiffHeader);
     int count = 0;
-    size_t sz;
+
+    if (prevChain >= LogDefines::DiffChainLimit) {
+      AppendMemoryLog(local, twin, share, pageNo);
+      return 0;
+    }
 
     START_TIMER(diff_calculation);
-    // Count diff in bytes
-    long long* mylocal = (long long*)local;
-    long long* mytwin = (long long*)twin;
+    xpagediff::getInstance().diffMask(mylocal, twin, mask);
 
-    // #blocks: 512
-    lprintf("Checking diffs\n");
-    for (int i = 0; i < xdefines::PageSize / sizeof(long long); i++) {
-      if (mylocal[i] != mytwin[i]) {
-        lprintf("commiting %d-th word in page %d\n", i, pageNo);  
-        diff_bytes = diff_bytes + logDiffWord( (char*)&mylocal[i], (char*)&mytwin[i], i, pageNo, xactID, threadID, pageLookupTmp);
-        lprintf("Wrote %d-th block, diff_bytes: %d\n", i, diff_bytes);
+    // Runs closer than an extent entry are merged, the bytes in between
+    // are logged with their shared value.
+    int pos = 0;
+    while ((pos = NextMaskBit(mask, pos, true)) < (int)LogDefines::PageSize) {
+      int end = NextMaskBit(mask, pos, false);
+      if (count > 0 && pos - (extents[count - 1].offset + extents[count - 1].length) <= (int)sizeof(struct LogExtent)) {
+        payload += pos - (extents[count - 1].offset + extents[count - 1].length) + (end - pos);
+        extents[count - 1].length = end - extents[count - 1].offset;
+      } else {
+        payload += sizeof(struct LogExtent) + (end - pos);
+        extents[count].offset = pos;
+        extents[count].length = end - pos;
+        count++;
       }
+      if (payload > LogDefines::DiffLimit) {
+        break;
+      }
+      pos = end;
     }
     STOP_TIMER(diff_calculation);
-    lprintf("Write diffs for a total of %d / %lu bytes\n", diff_bytes, _buffered_bytes);
+
+    if (payload > LogDefines::DiffLimit) {
+      AppendMemoryLog(local, twin, share, pageNo);
+      return 0;
+    }
+
+    START_TIMER(diff_logging);
+    unsigned long length = RecordLength(LogDefines::RecordHeaderSize + payload);
+    unsigned long offset;
+    struct LogRecordHeader* header = (struct LogRecordHeader*)StageRecord(length, &offset);
+    MakeRecordHeader(header, LOG_RECORD_DIFF, length, pageNo, offset);
+    header->link = _txn_offset;
+    _last_record = offset + LogDefines::RecordHeaderSize;
+
+    struct LogDiffHeader* diff = (struct LogDiffHeader*)((char*)header + LogDefines::RecordHeaderSize);
+    diff->prevOffset = prevOffset;
+    diff->prevXactID = prevXactID;
+    diff->prevThreadID = prevThreadID;
+    diff->extents = count;
+    diff->chain = prevChain + 1;
+
+    struct LogExtent* table = (struct LogExtent*)(diff + 1);
+    char* data = (char*)(table + count);
+    memcpy(table, extents, count * sizeof(struct LogExtent));
+    for (int i = 0; i < count; i++) {
+      // Bytes this thread did not change keep the shared value.
+      for (int b = extents[i].offset; b < extents[i].offset + extents[i].length; b++) {
+        *data++ = ((mask[b / 64] >> (b % 64)) & 1) ? mylocal[b] : myshare[b];
+      }
+    }
+    memset(data, 0, (char*)header + length - data);
+
+    _txn_pages++;
+    SealRecord(header, true);
+    STOP_TIMER(diff_logging);
+
+    lprintf("Logged %d extents of page %d in %lu bytes\n", count, pageNo, length);
+    INC_COUNTER(loggedpages);
+    INC_COUNTER(diffpages);
+    ADD_COUNTER(diffbytes, length);
+    return diff->chain;
+  }
+
+  /* First byte at or after "from" whose mask bit is "set", PageSize if none */
+  static inline int NextMaskBit(const uint64_t* mask, int from, bool set) {
+    int word = from / 64;
+    uint64_t bits = (set ? mask[word] : ~mask[word]) & (~0ULL << (from % 64));
+    while (bits == 0) {
+      if (++word == xpagediff::MaskWords) {
+        return LogDefines::PageSize;
+      }
+      bits = set ? mask[word] : ~mask[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
   }
 #endif
 
   void CloseMemoryLog(void) {
-#ifdef DIFF_LOGGING
-    FlushBufferToLog();
-    InternalFree(_mempages_ptr, _dirtiedPagesCount * LogDefines::PageSize);
+#ifdef CIRCULAR_LOG
+    // The segment and the stage are kept for the next transaction.
+    FlushStage();
+    WaitStage();
+    _mempages_file_count++;
+#else
+    // The stage is kept for the next transaction.
+    FlushStage();
+    WaitStage();
+#ifdef PMEM_LOG
+    // A mapped file is kept for the next transaction of the epoch.
+    _pmem_end = LogHead();
+    if (_pmem_ptr == NULL) {
+      CloseLogFile();
+    }
 #else
-    InternalFree(_mempages_ptr, LogDefines::PageSize);
+    CloseLogFile();
+#endif
+    _mempages_file_count++;
+#endif
+  }
+
+#ifndef CIRCULAR_LOG
+  /* Close the log file of the epoch */
+  void CloseLogFile(void) {
+#ifdef PMEM_LOG
+    if (_pmem_ptr != NULL) {
+      // The preallocated space past the last record is cut off.
+      UnmapLog();
+      if (ftruncate(_mempages_fd, _pmem_end) != 0) {
+        perror("ftruncate: ");
+        abort();
+      }
+    }
 #endif
 
     if (log_dest == SSD || log_dest == NVM_RAMDISK) {
       /* Close the memory mapping log */
       if (_mempages_fd != -1) {
         close(_mempages_fd);
+        _mempages_fd = -1;
       }
     } else {
       fprintf(stderr, "Error: unknown logging destination: %d\n", log_dest);
       abort();
     }
-    
-    _mempages_file_count++;
     lprintf("Closed file: %s\n", _mempages_filename);
   }
+#endif
 
-  /* Write an end of log flag to file. It has to be ordered after the actual logs. */
+  /* Write the end of the transaction, its COMMIT record */
   void WriteEndOfLog(void) {
-    int sz = 0;
-    sz = write(_mempages_fd, eol_symbol, sizeof(eol_symbol));
-    if (sz == -1) {
-      fprintf(stderr, "%d: write error fd: %d, filename: %s\n", getpid(), _mempages_fd, _mempages_filename);
-      perror("write (addr): ");
-      abort();
-    }
+    unsigned long offset;
+    struct LogRecordHeader* commit = (struct LogRecordHeader*)StageRecord(LogDefines::RecordHeaderSize, &offset);
+    MakeRecordHeader(commit, LOG_RECORD_COMMIT, LogDefines::RecordHeaderSize, -1, offset);
+    commit->link = _txn_offset;
+    commit->count = _txn_pages;
+    commit->sum = _txn_sum;
+    SealRecord(commit, false);
   }
 
   /* Flush memory page to backend storage */
@@ -424,16 +1314,50 @@ class MemoryLog {
     return msync((void*)__p, LogDefines::PageSize, MS_SYNC);
   }
 
-  /* Flush cache line to main memory */
-  inline void mfencePage(volatile void* __p) {
+  /* Flush the cache lines of the range to main memory */
+  inline void mfencePage(volatile void* __p, unsigned long length) {
     __asm__ __volatile__("mfence");
-    asm volatile("clflush %0" : "+m"(*(volatile char *)__p));
+    xpmem::getInstance().flush((const void*)__p, length);
     __asm__ __volatile__("mfence");
   }
 
   /* Make sure the log is durable (visible by the restart-code after the program crashes) */
   inline void MakeDurable(volatile void* vaddr, unsigned long length) {
     int rv = 0;
+#ifdef URING_LOG
+    if (_DurableMethod == URING) {
+#ifdef GROUP_COMMIT
+      // The group flush only covers what has reached the file.
+      FlushStage();
+      WaitStage();
+      xgroupcommit::getInstance().enqueue();
+#else
+      // The last write and the fdatasync behind it are one linked submission.
+#ifdef NVM_EMULATION
+      xnvmemu::getInstance().write(_stage_bytes);
+      xnvmemu::getInstance().flush();
+#endif
+      _uring.writeDurable(_mempages_fd, _stage_ptr, _stage_bytes, StagePosition(), _stage_index);
+      _stage_bytes = 0;
+      _stage_offset = LogHead();
+#endif
+      return;
+    }
+#endif
+#ifdef PMEM_LOG
+    if (_DurableMethod == PMEM) {
+      // The write-backs were issued as the records were copied.
+      FlushStage();
+      if (_DurableMethod == PMEM) {
+        xpmem::fence();
+#ifdef NVM_EMULATION
+        xnvmemu::getInstance().flush();
+#endif
+        return;
+      }
+    }
+#endif
+    FlushStage();
     if (_DurableMethod == MSYNC) {
       rv = msync((void*)vaddr, length, MS_SYNC);
       if (rv != 0) {
@@ -443,13 +1367,18 @@ class MemoryLog {
       }
       lprintf("%d: msync %p for %d bytes\n", getpid(), vaddr, LogDefines::PageSize);
     } else if (_DurableMethod == MFENCE) {
-      mfencePage(vaddr);
-      lprintf("%d: mfence+cflush+mfence for %p for %d bytes\n", getpid(), vaddr, LogDefines::PageSize);
+      mfencePage(vaddr, length);
+      lprintf("%d: mfence+cflush+mfence for %p for %lu bytes\n", getpid(), vaddr, length);
     } else if (_DurableMethod == MFENCEMSYNC) {
-      mfencePage(vaddr);
+      mfencePage(vaddr, length);
       msyncPage(vaddr);
       lprintf("%d: mfence+cflush+mfence+msync for %p for %d bytes\n", getpid(), vaddr, LogDefines::PageSize);
     } else if (_DurableMethod == FSYNC) {
+#ifdef GROUP_COMMIT
+      // Waited for in the next atomicBegin(), see xgroupcommit.h.
+      xgroupcommit::getInstance().enqueue();
+      return;
+#endif
       rv = fdatasync(_mempages_fd);
       if (rv != 0) {
         fprintf(stderr, "fdatasync() failed, please handle error before moving on.\n");
@@ -459,6 +1388,9 @@ class MemoryLog {
     } else {
       fprintf(stderr, "undefined durable method: %d\n", _DurableMethod);
     }
+#ifdef NVM_EMULATION
+    xnvmemu::getInstance().flush();
+#endif
   }
 
   /* Dump the content of a log entry in hex format */
@@ -476,22 +1408,7 @@ class MemoryLog {
     lprintf("\n");
   }
 
-  /* Flush buffer for diff logging */
-  void FlushBufferToLog(void){
-    ssize_t rv;
-    int i = 0;
-    if (_buffered_bytes == 0) {
-      return;
-    }
-
-    rv = write(_mempages_fd, _mempages_ptr, _buffered_bytes);
-    if (rv == -1) {
-      perror("FlushBufferToLog write failed");
-    }
-    lprintf("Dumped %lu bytes from %p to file %s\n", _buffered_bytes, _mempages_ptr, _mempages_filename);
-  }
-
-  /* Malloc for diff logging */
+  /* Malloc for log buffers */
   void *InternalMalloc(size_t sz) {
     void *ptr;
     ptr = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
@@ -502,7 +1419,7 @@ class MemoryLog {
     return ptr;
   }
 
-  /* Free for diff logging */
+  /* Free for log buffers */
   void InternalFree(void *ptr, size_t sz){
     if ( (munmap(ptr, sz)) == -1 ) {
       perror("InternalFree munmap mailed");
@@ -38,6 +38,8 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include <fcntl.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <sys/mman.h>
+#include <stddef.h>
 
 // opendir()
 #include <unistd.h>
@@ -50,6 +52,7 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 // std map<>
 #include <string>
 #include <map>
+#include <algorithm>
 
 // readlink
 #include <unistd.h>
@@ -58,6 +61,16 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include <time.h>
 
 #include "logger.h"
+#include "xvarmap.h"
+#ifdef PARALLEL_RECOVERY
+#include "xreplay.h"
+#endif
+#ifdef HEAP_IMAGE
+#include "xheapimage.h"
+#endif
+#ifdef LAZY_RECOVERY
+#include "xlazyrecovery.h"
+#endif
 
 #define PATH_CONFIG "/tmp/nvthread.config"
 
@@ -77,33 +90,37 @@ extern "C"
 
 /* Lookup info for recovery code to locate memory pages */
 struct lookupinfo {
-#ifdef DIFF_LOGGING
-    unsigned short xactIDs[xdefines::PageSize];
-    unsigned short threadIDs[xdefines::PageSize];
-    unsigned long memlogOffsets[xdefines::PageSize];    
-    bool dirtied[xdefines::PageSize];   
-#else
     unsigned short xactID;
     unsigned short threadID;
     unsigned long memlogOffset;    
     bool dirtied;   
+#ifdef DIFF_LOGGING
+    unsigned short chain;   // length of the DIFF record chain at memlogOffset
 #endif
 };
 
+/* A log file of the crashed run kept open for recovery, mapped if it can be */
+struct recoverfile {
+    long key;                   // see LogFileKey()
+    int fd;                     // -1 if the entry is unused
+    char *map;                  // NULL if the file is read with pread
+    size_t size;                // bytes mapped
+    unsigned long ringSize;     // 0 for a file per transaction
+    unsigned long used;         // clock of the last lookup
+};
+
+/* An intact page record of the crashed run, see nvrecovery::LoadEarlierPage() */
+struct pagerecord {
+    unsigned long xactID;       // as in the record header, not cut to 16 bits
+    int threadID;
+    unsigned long memlogOffset; // of the page image, as in the lookup info
+};
+
 /* record the threadID last touched this page */
 struct pageDependence {
     unsigned long threadID; 
 };
 
-/* varmap = variable mapping, variable name <-> metadata
- * struct for log entry to be appended to the end of per-thread MemoryLog */
-struct varmap_entry {
-    char name[128];
-    size_t size;
-    int pageNo;
-    int pageOffset;
-};
-
 class nvrecovery {
 
 public:
@@ -126,9 +143,7 @@ public:
 
     /* For file mapped varmap log */
     DIR *logdir;
-    FILE *_varmap_fptr;
-    void *_varmap_ptr;
-    int _varmap_fd;
+    xvarmap _varmap;
     char _varmap_filename[FILENAME_MAX];
 
     // Store a list of file names for memory pages
@@ -136,6 +151,18 @@ public:
 
     // Store a list of varmap file names
     std::vector<std::string> *varmap_file_vector;
+
+    // Open log files, the least recently used one is closed first
+    enum { LogFileCacheSize = 32 };
+    struct recoverfile _logFiles[LogFileCacheSize];
+    unsigned long _logFileClock;
+
+    // Transactions checked for completeness, by thread, transaction and TXN record
+    std::map<std::pair<long, unsigned long>, bool> *_committedTxns;
+
+    // Page records of every log file by page, newest first. Only indexed
+    // once the newest record of a page turns out to be torn.
+    std::map<int, std::vector<struct pagerecord> > *_pageRecords;
     
     // Map of the actual variable and address mapping
     std::map<std::string, unsigned long> *varmap;
@@ -153,7 +180,17 @@ public:
     size_t numPagesGlobals;
     
     // Variable mapping info
-    std::map<std::string, struct varmap_entry> *recoveredVarmap;
+    xvarmap *recoveredVarmap;
+
+#ifdef PARALLEL_RECOVERY
+    // Heap pages restored up front from the logs
+    xreplay *_replay;
+#endif
+
+#ifdef HEAP_IMAGE
+    // The heap, mapped from the image of the crashed run
+    char *_heapImage;
+#endif
 
     void initialize(bool main_thread) {
         _main_thread = main_thread;
@@ -181,8 +218,21 @@ public:
 
         // Initialize pointers for variable map, page lookup info for heap and globals
         recoveredVarmap = NULL;
+        _committedTxns = NULL;
+        _pageRecords = NULL;
         _pageLookupHeap = NULL;
         _pageLookupGlobals = NULL;
+        for (int i = 0; i < LogFileCacheSize; i++) {
+            _logFiles[i].fd = -1;
+            _logFiles[i].used = 0;
+        }
+        _logFileClock = 0;
+#ifdef PARALLEL_RECOVERY
+        _replay = NULL;
+#endif
+#ifdef HEAP_IMAGE
+        _heapImage = NULL;
+#endif
 
         // Create new VarMap file for current run
         OpenVarMap();
@@ -209,8 +259,9 @@ public:
             Delete_varmap();
             Delete_memlog();
             CloseVarMap(); 
+        } else {
+            SyncVarMap();
         }
-        close(_varmap_fd);
     }
 
     // Create the path to store memory log and variable mapping
@@ -240,9 +291,14 @@ public:
         // Create a temp file for logging mapping between variable and address
         sprintf(_varmap_filename, "%svarmap", logPath);
 
+        // Threads share the map the main thread created
+        if ( _initialized ) {
+            return;
+        }
+
         // Main thread (!_intialized) checks if file exists.  
         // If file exists, we crashed before, rename the existing file to "recover" first
-        if ( !_initialized && access(_varmap_filename, F_OK) != -1 ) {
+        if ( access(_varmap_filename, F_OK) != -1 ) {
             char _recoverFname[FILENAME_MAX];
             sprintf(_recoverFname, "%s_recover", _varmap_filename);
             if ( rename(_varmap_filename, _recoverFname) != 0 ){
@@ -252,40 +308,33 @@ public:
         }
         
         // Create the variable map file
-        _varmap_fd = open(_varmap_filename, O_RDWR | O_SYNC | O_CREAT | O_APPEND, 0644);    
-
-        if ( _varmap_fd == -1 ) {
+        if ( !_varmap.open(_varmap_filename, true) ) {
             fprintf(stderr, "%d: Error creating %s\n", getpid(), _varmap_filename);
             perror("OpenVarMap");
             abort();
         }
     }
 
-    // Close variable mapping file descriptor and remove it
+    // Unmap the variable mapping file and remove it
     void CloseVarMap(void) {
-        close(_varmap_fd);
+        _varmap.close();
         unlink(_varmap_filename);
     }
 
+    // Make variables added since the last call durable. Called before a
+    // transaction commits, so no data is recovered for an unknown variable.
+    void SyncVarMap(void) {
+        if ( !_logging_enabled ) {
+            return;
+        }
+        _varmap.sync();
+    }
+
     // Add a entry for variable mapping. Called by nvmalloc
     void AppendVarMapLog(void *start, size_t size, char *name, int pageNo, int pageOffset) {
-        // Append record to the end of the varmap log
-        char tmp[FILENAME_MAX];
-        struct varmap_entry varmap;
-        sprintf(varmap.name, "%s", name);
-        varmap.size = size;
-        varmap.pageNo = pageNo;
-        varmap.pageOffset = pageOffset;
-        sprintf(tmp, "%s:%zu:%d:%d\n", varmap.name, varmap.size, varmap.pageNo, varmap.pageOffset);
-
-        // Write variable metadata to varmap file
-        if ( write(_varmap_fd, tmp, strlen(tmp)) == -1 ) {
-            fprintf(stderr, "Error writing log to varmap file: %s\n", _varmap_filename);
-            perror("write");
-            abort();
-        }
-        fdatasync(_varmap_fd);
-        lprintf("Added variable address map record: %s\n", tmp);
+        // Append record to the varmap, durable with the next commit
+        _varmap.append(name, size, pageNo, pageOffset);
+        lprintf("Added variable address map record: %s:%zu:%d:%d\n", name, size, pageNo, pageOffset);
     }
 
     // Delete the line number of the current program entry in nvlib.crash
@@ -396,6 +445,10 @@ public:
         if ( line >= 0 ) {
             lprintf("Your program CRASHED before.  Please recover your progress using libnvthread API\n");
             crashed = true;
+#ifdef CIRCULAR_LOG
+            RetireLogSegments();
+#endif
+            RetireBaseImage();
         } else {
             lprintf("Your program did not crash before.  Continue normal execution\n");
             CreateLogPath();
@@ -403,6 +456,546 @@ public:
         }
     }
 
+    // The base image of the log cleaner is recovered from, the new run starts its own.
+    void RetireBaseImage(void) {
+        char from[FILENAME_MAX];
+        char to[FILENAME_MAX];
+        sprintf(from, "%sMemLog_base", memLogPath);
+        sprintf(to, "%s_recover", from);
+        if ( access(from, F_OK) != -1 && rename(from, to) != 0 ) {
+            lprintf("error: unable to rename %s\n", from);
+        }
+    }
+
+#ifdef CIRCULAR_LOG
+    // The new run reuses the log segment names, so the segments of the
+    // crashed run are renamed to MemLog_<threadID>_recover first.
+    void RetireLogSegments(void) {
+        DIR *dir = opendir(memLogPath);
+        struct dirent *ent;
+
+        if ( dir == NULL ) {
+            return;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+            int tid;
+            char rest;
+            if ( sscanf(ent->d_name, "MemLog_%d%c", &tid, &rest) != 1 ) {
+                continue;
+            }
+
+            char from[FILENAME_MAX];
+            char to[FILENAME_MAX];
+            sprintf(from, "%s%s", memLogPath, ent->d_name);
+            sprintf(to, "%s_recover", from);
+            if ( rename(from, to) != 0 ) {
+                lprintf("error: unable to rename %s\n", from);
+            }
+        }
+        closedir(dir);
+    }
+
+    // Ring size of an opened log segment
+    unsigned long SegmentRingSize(int memlogFd, const char *memlogFn) {
+        struct LogSegmentHeader segment;
+        if ( pread(memlogFd, &segment, sizeof(segment), 0) != sizeof(segment)
+             || memcmp(segment.magic, LOG_SEGMENT_MAGIC, sizeof(segment.magic)) != 0 ) {
+            fprintf(stderr, "%s is not a log segment\n", memlogFn);
+            abort();
+        }
+        return segment.ringSize;
+    }
+#endif
+
+    // Position of a log record in its file, ringSize is 0 for a file per transaction
+    static off_t LogPosition(unsigned long offset, unsigned long ringSize) {
+        if ( ringSize == 0 ) {
+            return offset;
+        }
+        return LogDefines::SegmentHeaderSize + offset % ringSize;
+    }
+
+    // Read the record at offset into buf and check its header and checksum.
+    // Only the header of a PAD record is read.
+    static bool ReadLogRecord(int memlogFd, unsigned long offset, unsigned long ringSize, char *buf, size_t size) {
+        struct LogRecordHeader *header = (struct LogRecordHeader *)buf;
+        off_t pos = LogPosition(offset, ringSize);
+
+        if ( pread(memlogFd, buf, sizeof(*header), pos) != sizeof(*header)
+             || header->magic != LOG_RECORD_MAGIC || header->offset != offset ) {
+            return false;
+        }
+        if ( header->type == LOG_RECORD_PAD ) {
+            return true;
+        }
+        if ( header->length < sizeof(*header) || header->length > size ) {
+            return false;
+        }
+
+        size_t rest = header->length - sizeof(*header);
+        if ( rest > 0 && pread(memlogFd, buf + sizeof(*header), rest, pos + sizeof(*header)) != (ssize_t)rest ) {
+            return false;
+        }
+
+        uint32_t crc = header->crc;
+        header->crc = 0;
+        bool valid = (crc32c::compute(buf, header->length) == crc);
+        header->crc = crc;
+        return valid;
+    }
+
+    // CRC32C of a record as if its crc field were 0
+    static uint32_t RecordChecksum(const struct LogRecordHeader *header) {
+        const uint32_t zero = 0;
+        size_t at = offsetof(struct LogRecordHeader, crc);
+        uint32_t crc = crc32c::compute(header, at);
+        crc = crc32c::extend(crc, &zero, sizeof(zero));
+        at += sizeof(zero);
+        return crc32c::extend(crc, (const char *)header + at, header->length - at);
+    }
+
+    // The record at offset, checked as by ReadLogRecord. A mapped record is
+    // returned where it is, others are read into buf. NULL if it is not intact.
+    static const char *GetLogRecord(struct recoverfile *file, unsigned long offset, char *buf, size_t size) {
+        off_t pos = LogPosition(offset, file->ringSize);
+        const struct LogRecordHeader *header = (const struct LogRecordHeader *)(file->map + pos);
+
+        if ( file->map == NULL || pos + sizeof(*header) > file->size || header->length > size
+             || pos + header->length > file->size ) {
+            return ReadLogRecord(file->fd, offset, file->ringSize, buf, size) ? buf : NULL;
+        }
+        if ( header->magic != LOG_RECORD_MAGIC || header->offset != offset ) {
+            return NULL;
+        }
+        if ( header->type == LOG_RECORD_PAD ) {
+            return (const char *)header;
+        }
+        if ( header->length < sizeof(*header) || RecordChecksum(header) != header->crc ) {
+            return NULL;
+        }
+        return (const char *)header;
+    }
+
+    // Cache key of the log file of threadID's transaction xactID
+    static long LogFileKey(int threadID, unsigned short xactID) {
+#ifdef CIRCULAR_LOG
+        // One segment holds every transaction of a thread.
+        xactID = 0;
+#endif
+        return ((long)threadID << 16) | xactID;
+    }
+
+    enum { BaseImageKey = -1 };
+
+    // The log file with key, opened and mapped on the first use.
+    // NULL if the file does not exist.
+    struct recoverfile *OpenLogFile(long key) {
+        struct recoverfile *victim = &_logFiles[0];
+
+        _logFileClock++;
+        for (int i = 0; i < LogFileCacheSize; i++) {
+            if ( _logFiles[i].fd != -1 && _logFiles[i].key == key ) {
+                _logFiles[i].used = _logFileClock;
+                return &_logFiles[i];
+            }
+            if ( _logFiles[i].used < victim->used ) {
+                victim = &_logFiles[i];
+            }
+        }
+
+        char memlogFn[FILENAME_MAX];
+        if ( key == BaseImageKey ) {
+            sprintf(memlogFn, "%sMemLog_base_recover", memLogPath);
+        } else {
+#ifdef CIRCULAR_LOG
+            sprintf(memlogFn, "%sMemLog_%ld_recover", memLogPath, key >> 16);
+#else
+            sprintf(memlogFn, "%sMemLog_%ld_%ld", memLogPath, key >> 16, key & 0xFFFF);
+#endif
+        }
+        int fd = open(memlogFn, O_RDONLY);
+        if ( fd == -1 ) {
+            return NULL;
+        }
+        CloseLogFile(victim);
+        INC_COUNTER(recoverfiles);
+
+        struct stat st;
+        victim->key = key;
+        victim->fd = fd;
+        victim->map = NULL;
+        victim->size = 0;
+        victim->ringSize = 0;
+        victim->used = _logFileClock;
+        if ( fstat(fd, &st) == 0 && st.st_size > 0 ) {
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if ( map != MAP_FAILED ) {
+                victim->map = (char *)map;
+                victim->size = st.st_size;
+            }
+        }
+#ifdef CIRCULAR_LOG
+        if ( key != BaseImageKey ) {
+            victim->ringSize = SegmentRingSize(fd, memlogFn);
+        }
+#endif
+        lprintf("Opened %s for recovery, %zu bytes mapped\n", memlogFn, victim->size);
+        return victim;
+    }
+
+    void CloseLogFile(struct recoverfile *file) {
+        if ( file->fd == -1 ) {
+            return;
+        }
+        if ( file->map != NULL ) {
+            munmap(file->map, file->size);
+        }
+        close(file->fd);
+        file->fd = -1;
+    }
+
+    // Whether the transaction whose TXN record is at txn has a COMMIT record
+    // matching its pages. Every transaction is only checked once.
+    bool TransactionCommitted(struct recoverfile *file, int threadID, unsigned short xactID, unsigned long txn) {
+        std::pair<long, unsigned long> key(((long)threadID << 16) | xactID, txn);
+        if ( _committedTxns == NULL ) {
+            _committedTxns = new std::map<std::pair<long, unsigned long>, bool>;
+        }
+        std::map<std::pair<long, unsigned long>, bool>::iterator it = _committedTxns->find(key);
+        if ( it != _committedTxns->end() ) {
+            return it->second;
+        }
+
+        char buf[LogDefines::PageRecordSize];
+        const struct LogRecordHeader *header;
+        bool committed = false;
+        unsigned long offset = txn;
+
+        header = (const struct LogRecordHeader *)GetLogRecord(file, offset, buf, sizeof(buf));
+        if ( header != NULL && header->type == LOG_RECORD_TXN ) {
+            uint64_t txnID = header->xactID;
+            uint32_t sum = crc32c::extend(0, &header->crc, sizeof(header->crc));
+            uint32_t pages = 0;
+
+            offset += header->length;
+            while ( (header = (const struct LogRecordHeader *)GetLogRecord(file, offset, buf, sizeof(buf))) != NULL ) {
+                if ( header->type != LOG_RECORD_PAD ) {
+                    if ( header->xactID != txnID || header->link != txn ) {
+                        break;
+                    }
+                    if ( header->type == LOG_RECORD_COMMIT ) {
+                        committed = (header->count == pages && header->sum == sum);
+                        break;
+                    }
+                    if ( header->type != LOG_RECORD_PAGE && header->type != LOG_RECORD_DIFF
+                         && header->type != LOG_RECORD_ZERO && header->type != LOG_RECORD_LZ ) {
+                        break;
+                    }
+                    sum = crc32c::extend(sum, &header->crc, sizeof(header->crc));
+                    pages++;
+                }
+                offset += header->length;
+            }
+        }
+
+        lprintf("transaction %d of thread %d at %lu committed: %d\n", xactID, threadID, txn, committed);
+        (*_committedTxns)[key] = committed;
+        return committed;
+    }
+
+    // Read the page record logged at memlogOffset into buf; NULL unless the
+    // record and its transaction are intact.
+    const char *GetIntactRecord(struct recoverfile *file, int threadID, unsigned short xactID,
+                                int pageNo, unsigned long memlogOffset, char *buf, size_t size) {
+        // The record header sits right in front of the image.
+        const char *record = GetLogRecord(file, memlogOffset - LogDefines::RecordHeaderSize, buf, size);
+        const struct LogRecordHeader *header = (const struct LogRecordHeader *)record;
+        if ( record == NULL
+             || (header->type != LOG_RECORD_PAGE && header->type != LOG_RECORD_COPY
+                 && header->type != LOG_RECORD_DIFF && header->type != LOG_RECORD_ZERO
+                 && header->type != LOG_RECORD_LZ)
+             || header->pageNo != pageNo || (unsigned short)header->xactID != xactID ) {
+            lprintf("Error: record of page %d at %lu is torn or was overwritten\n", pageNo, memlogOffset);
+            return NULL;
+        }
+
+        // A copied record outlives its transaction, which was complete.
+        if ( header->type != LOG_RECORD_COPY
+             && !TransactionCommitted(file, threadID, xactID, header->link) ) {
+            lprintf("Error: transaction of page %d at %lu is incomplete\n", pageNo, memlogOffset);
+            return NULL;
+        }
+        return record;
+    }
+
+    // Copy bytes at pageOffset of the page image logged at memlogOffset,
+    // if the image and its transaction are intact. Returns the bytes copied.
+    // "depth" counts the DIFF records followed to get here.
+    size_t ReadLoggedPage(void *dest, struct recoverfile *file, int threadID, unsigned short xactID,
+                          int pageNo, unsigned long memlogOffset, int pageOffset, size_t bytes, int depth = 0) {
+        char buf[LogDefines::PageRecordSize];
+        const char *record = GetIntactRecord(file, threadID, xactID, pageNo, memlogOffset, buf, sizeof(buf));
+        const struct LogRecordHeader *header = (const struct LogRecordHeader *)record;
+        if ( record == NULL ) {
+            return 0;
+        }
+
+#ifdef DIFF_LOGGING
+        if ( header->type == LOG_RECORD_DIFF ) {
+            return ApplyLoggedDiff(dest, record, pageNo, pageOffset, bytes, depth);
+        }
+#endif
+
+        // A COPY record holds the image as the record it was copied from.
+        int format = header->type;
+        if ( format == LOG_RECORD_COPY && header->count != 0 ) {
+            format = header->count;
+        }
+        if ( format == LOG_RECORD_ZERO || format == LOG_RECORD_LZ ) {
+            return UnpackLoggedPage(dest, record, format, pageNo, pageOffset, bytes);
+        }
+
+        memcpy(dest, record + LogDefines::RecordHeaderSize + pageOffset, bytes);
+        return bytes;
+    }
+
+    // Copy bytes at pageOffset of the packed page image of the record in buf.
+    static size_t UnpackLoggedPage(void *dest, const char *buf, int format, int pageNo, int pageOffset, size_t bytes) {
+        const struct LogRecordHeader *header = (const struct LogRecordHeader *)buf;
+        const struct LogPackHeader *pack = (const struct LogPackHeader *)(buf + LogDefines::RecordHeaderSize);
+        char image[LogDefines::PageSize];
+
+        if ( pack->rawSize != LogDefines::PageSize
+             || LogDefines::RecordHeaderSize + sizeof(*pack) + pack->packedSize > header->length ) {
+            lprintf("Error: packed record of page %d is malformed\n", pageNo);
+            return 0;
+        }
+        if ( format == LOG_RECORD_ZERO ) {
+            memset(dest, 0, bytes);
+            return bytes;
+        }
+        if ( !xlzcodec::decompress(pack + 1, pack->packedSize, image, LogDefines::PageSize) ) {
+            lprintf("Error: packed record of page %d does not decompress\n", pageNo);
+            return 0;
+        }
+        memcpy(dest, image + pageOffset, bytes);
+        return bytes;
+    }
+
+#ifdef DIFF_LOGGING
+    // Rebuild the bytes from the record the page was logged in before, then
+    // apply the extents of the DIFF record in buf.
+    size_t ApplyLoggedDiff(void *dest, const char *buf, int pageNo, int pageOffset, size_t bytes, int depth) {
+        const struct LogRecordHeader *header = (const struct LogRecordHeader *)buf;
+        const struct LogDiffHeader *diff = (const struct LogDiffHeader *)(buf + LogDefines::RecordHeaderSize);
+        const struct LogExtent *extents = (const struct LogExtent *)(diff + 1);
+        const char *data = (const char *)(extents + diff->extents);
+        const char *end = buf + header->length;
+
+        if ( depth >= LogDefines::DiffChainLimit || data > end ) {
+            lprintf("Error: DIFF record chain of page %d is broken\n", pageNo);
+            return 0;
+        }
+
+        if ( diff->prevThreadID == 0 ) {
+            memset(dest, 0, bytes);
+        } else {
+            struct recoverfile *file = OpenLogFile(LogFileKey(diff->prevThreadID, diff->prevXactID));
+            size_t sz = 0;
+            if ( file != NULL ) {
+                sz = ReadLoggedPage(dest, file, diff->prevThreadID, diff->prevXactID, pageNo,
+                                    diff->prevOffset, pageOffset, bytes, depth + 1);
+            }
+            // The log cleaner may have folded the earlier record into the base image.
+            if ( sz != bytes && !ReadBasePage(dest, diff->prevThreadID, diff->prevXactID, pageNo,
+                                              diff->prevOffset, pageOffset, bytes) ) {
+                lprintf("Error: log of page %d by thread %d in transaction %d is missing\n", pageNo,
+                        diff->prevThreadID, diff->prevXactID);
+                return 0;
+            }
+        }
+
+        return ApplyDiffExtents(dest, buf, pageOffset, bytes) ? bytes : 0;
+    }
+
+    // Apply the extents of the DIFF record in buf that overlap the bytes at pageOffset.
+    static bool ApplyDiffExtents(void *dest, const char *buf, int pageOffset, size_t bytes) {
+        const struct LogRecordHeader *header = (const struct LogRecordHeader *)buf;
+        const struct LogDiffHeader *diff = (const struct LogDiffHeader *)(buf + LogDefines::RecordHeaderSize);
+        const struct LogExtent *extents = (const struct LogExtent *)(diff + 1);
+        const char *data = (const char *)(extents + diff->extents);
+        const char *end = buf + header->length;
+
+        if ( data > end ) {
+            return false;
+        }
+        for ( int i = 0; i < diff->extents; i++ ) {
+            unsigned long from = extents[i].offset;
+            unsigned long to = from + extents[i].length;
+            if ( to > LogDefines::PageSize || data + extents[i].length > end ) {
+                return false;
+            }
+            unsigned long lo = (from > (unsigned long)pageOffset) ? from : pageOffset;
+            unsigned long hi = (to < pageOffset + bytes) ? to : pageOffset + bytes;
+            if ( lo < hi ) {
+                memcpy((char *)dest + (lo - pageOffset), data + (lo - from), hi - lo);
+            }
+            data += extents[i].length;
+        }
+        return true;
+    }
+#endif
+
+    // Position of the base image slot of a page, see xlogcleaner.h
+    static off_t BaseSlotOffset(int pageNo) {
+        return (off_t)pageNo * LogDefines::PageRecordSize;
+    }
+
+    // Read the base image slot of pageNo into buf; true if it holds the page
+    // as logged by threadID in xactID at memlogOffset.
+    static bool ReadBaseSlot(int baseFd, char *buf, int threadID, unsigned short xactID, int pageNo,
+                             unsigned long memlogOffset) {
+        struct LogRecordHeader *header = (struct LogRecordHeader *)buf;
+
+        return ReadLogRecord(baseFd, BaseSlotOffset(pageNo), 0, buf, LogDefines::PageRecordSize)
+               && header->type == LOG_RECORD_COPY && header->length == LogDefines::PageRecordSize
+               && header->pageNo == pageNo && header->threadID == threadID
+               && (unsigned short)header->xactID == xactID && header->link == memlogOffset;
+    }
+
+    // Copy bytes at pageOffset of a page whose log record was reclaimed by the
+    // log cleaner, from the base image of the crashed run.
+    bool ReadBasePage(void *dest, int threadID, unsigned short xactID, int pageNo, unsigned long memlogOffset,
+                      int pageOffset, size_t bytes) {
+        char buf[LogDefines::PageRecordSize];
+
+        struct recoverfile *base = OpenLogFile(BaseImageKey);
+        if ( base == NULL || !ReadBaseSlot(base->fd, buf, threadID, xactID, pageNo, memlogOffset) ) {
+            return false;
+        }
+
+        lprintf("Recovered page %d from the base image\n", pageNo);
+        memcpy(dest, buf + LogDefines::RecordHeaderSize + pageOffset, bytes);
+        return true;
+    }
+
+    static bool NewerRecord(const struct pagerecord &a, const struct pagerecord &b) {
+        if ( a.xactID != b.xactID ) {
+            return a.xactID > b.xactID;
+        }
+        if ( a.memlogOffset != b.memlogOffset ) {
+            return a.memlogOffset > b.memlogOffset;
+        }
+        return a.threadID > b.threadID;
+    }
+
+    // Add the page records of the log file with key to _pageRecords. Records
+    // that are not intact are skipped, the next one is 8 byte aligned.
+    void IndexLogFile(long key) {
+        char buf[LogDefines::PageRecordSize];
+        struct recoverfile *file = OpenLogFile(key);
+        struct stat st;
+
+        if ( file == NULL || fstat(file->fd, &st) != 0 ) {
+            return;
+        }
+        unsigned long offset = 0;
+        unsigned long end = st.st_size;
+#ifdef CIRCULAR_LOG
+        struct LogSegmentHeader segment;
+        if ( pread(file->fd, &segment, sizeof(segment), 0) != sizeof(segment) ) {
+            return;
+        }
+        offset = segment.tail;
+        end = segment.tail + file->ringSize;
+#endif
+
+        while ( offset + LogDefines::RecordHeaderSize <= end ) {
+            const struct LogRecordHeader *header = (const struct LogRecordHeader *)GetLogRecord(file, offset, buf, sizeof(buf));
+            if ( header == NULL ) {
+                offset += 8;
+                continue;
+            }
+            if ( header->type == LOG_RECORD_PAGE || header->type == LOG_RECORD_COPY || header->type == LOG_RECORD_DIFF
+                 || header->type == LOG_RECORD_ZERO || header->type == LOG_RECORD_LZ ) {
+                struct pagerecord record;
+                record.xactID = header->xactID;
+                record.threadID = header->threadID;
+                record.memlogOffset = offset + LogDefines::RecordHeaderSize;
+                (*_pageRecords)[header->pageNo].push_back(record);
+            }
+            offset += header->length;
+        }
+    }
+
+    // Index the page records of every log file of the crashed run
+    void IndexPageRecords(void) {
+        _pageRecords = new std::map<int, std::vector<struct pagerecord> >;
+
+        DIR *dir = opendir(memLogPath);
+        struct dirent *ent;
+        if ( dir == NULL ) {
+            return;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+            int tid;
+            int at = 0;
+#ifdef CIRCULAR_LOG
+            if ( sscanf(ent->d_name, "MemLog_%d_%n", &tid, &at) == 1 && at > 0
+                 && strcmp(ent->d_name + at, "recover") == 0 ) {
+                IndexLogFile(LogFileKey(tid, 0));
+            }
+#else
+            unsigned long xactID;
+            char rest;
+            if ( sscanf(ent->d_name, "MemLog_%d_%lu%c", &tid, &xactID, &rest) == 2 ) {
+                IndexLogFile(LogFileKey(tid, xactID));
+            }
+#endif
+        }
+        closedir(dir);
+
+        for (std::map<int, std::vector<struct pagerecord> >::iterator it = _pageRecords->begin();
+             it != _pageRecords->end(); ++it) {
+            std::sort(it->second.begin(), it->second.end(), NewerRecord);
+        }
+    }
+
+    // Copy bytes at pageOffset of the page as it was before the record at
+    // memlogOffset, whose transaction is torn: the newest intact record of the
+    // page in an earlier transaction, or earlier in the same one. A thread
+    // logging the page in the same epoch is not ordered by the log; its
+    // record is taken as earlier, the lookup info names the newest one.
+    // Transaction ids compare as the 16 bits of the lookup info.
+    bool LoadEarlierPage(void *dest, int threadID, unsigned short xactID, int pageNo, unsigned long memlogOffset,
+                         int pageOffset, size_t bytes) {
+        if ( _pageRecords == NULL ) {
+            IndexPageRecords();
+        }
+        std::map<int, std::vector<struct pagerecord> >::iterator it = _pageRecords->find(pageNo);
+        if ( it == _pageRecords->end() ) {
+            return false;
+        }
+
+        for (size_t i = 0; i < it->second.size(); i++) {
+            const struct pagerecord &record = it->second[i];
+            short age = (short)(unsigned short)((unsigned short)record.xactID - xactID);
+            if ( age > 0 || (age == 0 && record.threadID == threadID && record.memlogOffset >= memlogOffset) ) {
+                continue;
+            }
+
+            struct recoverfile *file = OpenLogFile(LogFileKey(record.threadID, record.xactID));
+            if ( file != NULL && ReadLoggedPage(dest, file, record.threadID, record.xactID, pageNo,
+                                                record.memlogOffset, pageOffset, bytes) == bytes ) {
+                lprintf("Recovered page %d as logged by thread %d in transaction %lu at %lu\n", pageNo,
+                        record.threadID, record.xactID, record.memlogOffset);
+                INC_COUNTER(tornpages);
+                return true;
+            }
+        }
+        return false;
+    }
+
     // Return the flag indicating whether the current program crashed before
     bool isCrashed(void) {
         return crashed;
@@ -578,51 +1171,62 @@ public:
         DumpLookupInfo(true);
     }
 
-    // Read the variable mapping info from file
+    // Map the variable mapping file of the crashed run
     void RecoverVarmap(void){
         char varmapFname[FILENAME_MAX];
-        char *token;
 
-        if ( recoveredVarmap == NULL ) {
-            recoveredVarmap = new std::map<std::string, struct varmap_entry>;
-        }
-        if ( recoveredVarmap->size() != 0 ) {
-            lprintf("recoveredVarmap already set with %zu records\n", recoveredVarmap->size());
+        if ( recoveredVarmap != NULL ) {
+            lprintf("recoveredVarmap already mapped\n");
             return;
         }
 
+        recoveredVarmap = new xvarmap;
         sprintf(varmapFname, "%svarmap_recover", logPath);
-        std::string line;        
-        std::ifstream ifs(varmapFname);
-        while (getline(ifs, line)) {
-            struct varmap_entry v;
-            
-            // Name
-            token = strtok((char *)line.c_str(), ":");
-            sprintf(v.name, "%s", token);
+        if ( !recoveredVarmap->open(varmapFname, false) ) {
+            lprintf("Cannot map varmap file %s\n", varmapFname);
+        }
+    }
 
-            // Size
-            token = strtok(NULL, ":");
-            v.size = (size_t)atoi(token);
+    // Copy bytes at pageOffset of heap page pageNo as it was last logged.
+    // Returns the bytes copied, -1 if the log file of the page is gone.
+    long LoadLoggedPage(void *dest, int pageNo, int pageOffset, size_t bytes) {
+        unsigned short xactID = _pageLookupHeap[pageNo].xactID;
+        unsigned short threadID = _pageLookupHeap[pageNo].threadID;
+        unsigned long memlogOffset = _pageLookupHeap[pageNo].memlogOffset;
 
-            // pageNo
-            token = strtok(NULL, ":");
-            v.pageNo = atoi(token);
+#ifdef PARALLEL_RECOVERY
+        if ( _replay != NULL && _replay->restored(pageNo) ) {
+            memcpy(dest, _replay->page(pageNo) + pageOffset, bytes);
+            lprintf("copied %zu bytes for pageNo %d from the replayed image\n", bytes, pageNo);
+            return bytes;
+        }
+#endif
 
-            // pageOffset
-            token = strtok(NULL, ":");
-            v.pageOffset = atoi(token);
+        // The memory log stays open for the pages after this one
+        struct recoverfile *file = OpenLogFile(LogFileKey(threadID, xactID));
+        if ( file == NULL ) {
+            // A log file reclaimed by the log cleaner left the page in the base image.
+            if ( ReadBasePage(dest, threadID, xactID, pageNo, memlogOffset, pageOffset, bytes) ) {
+                return bytes;
+            }
+            return -1;
+        }
 
-            lprintf("inserting to varmap: <%s, %zu bytes, pageNo: %d, pageOffset: %d>\n", v.name, v.size, v.pageNo, v.pageOffset);
-            recoveredVarmap->insert(std::make_pair((std::string)v.name, v));
-        }        
+        // Recover data from memory log
+        size_t sz = ReadLoggedPage(dest, file, threadID, xactID, pageNo, memlogOffset, pageOffset, bytes);
+        if ( sz != bytes && ReadBasePage(dest, threadID, xactID, pageNo, memlogOffset, pageOffset, bytes) ) {
+            sz = bytes;
+        }
+        // A torn transaction leaves the page as it was logged before.
+        if ( sz != bytes && LoadEarlierPage(dest, threadID, xactID, pageNo, memlogOffset, pageOffset, bytes) ) {
+            sz = bytes;
+        }
+        return sz;
     }
 
     // Return the number of bytes we scanned + copied
     int RecoverOnePage(void *dest, struct varmap_entry *v, size_t remaining_bytes, size_t total_size, int pagecount){
         size_t bytes = 0;
-        char memlogFn[FILENAME_MAX];
-        int memlogFd;
         int pageNo = v->pageNo + pagecount; // calculate the correct pageNo        
         int pageOffset;
         unsigned short xactID = _pageLookupHeap[pageNo].xactID;
@@ -665,28 +1269,15 @@ public:
 
         // Only recover data if the page was dirtied
         if ( _pageLookupHeap[pageNo].dirtied ) {
-
-            // Get the file name of memory log
-            sprintf(memlogFn, "%sMemLog_%d_%d", memLogPath, threadID, xactID);
-            memlogFd = open(memlogFn, O_RDONLY);
-            if ( memlogFd == -1 ) {
+            long sz = LoadLoggedPage(dest, pageNo, pageOffset, bytes);
+            if ( sz == -1 ) {
                 perror("RecoverOnePage open()");
                 abort();
-            }    
-         
-            // Move file descriptor to correct offset
-            memlogOffset += pageOffset;
-            lseek(memlogFd, memlogOffset, SEEK_SET);
-            size_t sz;
-
-            // Recover data from memory log
-            sz = read(memlogFd, dest, bytes);
-            if ( sz != bytes ) {
-                lprintf("Error: copy only %zu bytes, should've copied %zu bytes\n", sz, bytes);
-            }
-           
-            close(memlogFd);
-            lprintf("copied %zu bytes for pageNo %d from %s, memlogOffset: %lu\n", sz, pageNo, memlogFn, memlogOffset);
+            }
+            if ( sz != (long)bytes ) {
+                lprintf("Error: copy only %ld bytes, should've copied %zu bytes\n", sz, bytes);
+            }
+            lprintf("copied %ld bytes for pageNo %d of thread %d, xact %d, memlogOffset: %lu\n", sz, pageNo, threadID, xactID, memlogOffset);
         }
         else{
             lprintf("pageNo %d is not dritied, checked %zu bytes, skip recoverying this page\n", pageNo, bytes);
@@ -695,6 +1286,23 @@ public:
         return bytes;
     }
 
+#ifdef PARALLEL_RECOVERY
+    // Replay the newest record of every dirtied heap page with the helper
+    // threads, see xreplay.h. Log segments are read page by page.
+    void ReplayLog(void) {
+        _replay = new xreplay();
+#ifndef CIRCULAR_LOG
+        for (size_t i = 0; i < numPagesHeap; i++) {
+            if ( _pageLookupHeap[i].dirtied ) {
+                _replay->addPage(_pageLookupHeap[i].threadID, _pageLookupHeap[i].xactID, i,
+                                 _pageLookupHeap[i].memlogOffset);
+            }
+        }
+        _replay->run(memLogPath);
+#endif
+    }
+#endif
+
     // Recover data stored in log and return the number of bytes checked (=scanned+copied)
     size_t RecoverDataFromMemlog(char *dest, struct varmap_entry *v, size_t size){
         unsigned long xactID = 0;
@@ -709,9 +1317,8 @@ public:
             rv = RecoverOnePage(dest, v, size - bytes, size, pagecount);
             bytes += rv;
             lprintf("dest: %p, checked %zu bytes\n", dest, bytes);
-            // Advance page aligned address
-            dest = dest + xdefines::PageSize;
-            dest = (char*)((unsigned long)dest & ~LogDefines::PAGE_SIZE_MASK);
+            // dest need not share the page offset of the variable
+            dest = dest + rv;
             pagecount++;
         }
         return bytes;
@@ -719,18 +1326,18 @@ public:
 
 
     struct varmap_entry *RecoverVarmapInfo(char *name){
-        struct varmap_entry *v;
+        struct varmap_entry *v = NULL;
 
         // Look for variable name
-        std::map<std::string, struct varmap_entry>::iterator it;
-        it = recoveredVarmap->find((std::string)name);
-        if ( it == recoveredVarmap->end() ) {
+        if ( recoveredVarmap->mapped() ) {
+            v = recoveredVarmap->find(name);
+        }
+        if ( v == NULL ) {
             lprintf("Cannot find %s\n", name);
             return NULL;
         }
 
         // Found variable mapping
-        v = &it->second;
         lprintf("Found %s with size %zu at pageNo %d pageOffset %d\n", v->name, v->size, v->pageNo, v->pageOffset);
 
         return v;
@@ -740,11 +1347,23 @@ public:
         size_t bytes_checked;
 
         lprintf("Dest: 0x%p, size: %zu, name: %s\n", dest, size, name);
+
+#ifdef HEAP_IMAGE
+        if ( _heapImage != NULL ) {
+            return RecoverFromHeapImage(dest, size, name);
+        }
+#endif
         
         // Recover page lookup info
         if ( _pageLookupHeap == NULL ) {
             RecoverLookup(true);
         }
+#ifdef PARALLEL_RECOVERY
+        // Restore every dirtied page at once
+        if ( _replay == NULL ) {
+            ReplayLog();
+        }
+#endif
         // Recover <variable, address> mapping info
         if ( recoveredVarmap == NULL ) {
             RecoverVarmap();
@@ -770,6 +1389,183 @@ public:
         return 0;
     }
 
+#ifdef HEAP_IMAGE
+    // Bring the heap image of the crashed run, mapped at heap and shadow from
+    // imageFd, up to date: every dirtied page whose stamp does not name its
+    // newest log record is restored from the log. Unless the stamps are
+    // "trusted" every page is. With LAZY_RECOVERY pages are restored on
+    // first touch where the image allows it.
+    void RestoreHeapImage(char *heap, char *shadow, int imageFd, struct heapimagestamp *stamps, bool trusted) {
+        RecoverLookup(true);
+        std::map<int, unsigned short> newest;
+        NewestTransactions(newest);
+        for (size_t i = 0; i < numPagesHeap; i++) {
+            struct lookupinfo *info = &_pageLookupHeap[i];
+            if ( !info->dirtied ) {
+                continue;
+            }
+            // The image holds the pages of a torn transaction all the same:
+            // they are restored as they were logged before, right away.
+            if ( newest[info->threadID] == info->xactID && !NewestRecordIntact(i) ) {
+                stamps[i].valid = 0;
+                RestoreImagePage(heap, stamps, i);
+                continue;
+            }
+            if ( trusted && stamps[i].valid && stamps[i].threadID == info->threadID
+                 && stamps[i].xactID == info->xactID && stamps[i].memlogOffset == info->memlogOffset ) {
+                continue;
+            }
+            stamps[i].valid = 0;
+        }
+        _heapImage = heap;
+
+#ifdef LAZY_RECOVERY
+        if ( RestoreHeapImageLazily(heap, shadow, imageFd, stamps) ) {
+            return;
+        }
+#endif
+
+#if defined(PARALLEL_RECOVERY) && !defined(CIRCULAR_LOG)
+        xreplay replay;
+        for (size_t i = 0; i < numPagesHeap; i++) {
+            if ( _pageLookupHeap[i].dirtied && !stamps[i].valid ) {
+                replay.addPage(_pageLookupHeap[i].threadID, _pageLookupHeap[i].xactID, i, _pageLookupHeap[i].memlogOffset);
+            }
+        }
+        replay.run(memLogPath);
+#endif
+
+        unsigned long restored = 0;
+        for (size_t i = 0; i < numPagesHeap; i++) {
+            if ( !_pageLookupHeap[i].dirtied || stamps[i].valid ) {
+                continue;
+            }
+#if defined(PARALLEL_RECOVERY) && !defined(CIRCULAR_LOG)
+            if ( replay.restored(i) ) {
+                memcpy(heap + i * xdefines::PageSize, replay.page(i), xdefines::PageSize);
+                StampImagePage(stamps, i);
+                restored++;
+                continue;
+            }
+#endif
+            restored += RestoreImagePage(heap, stamps, i);
+        }
+
+        ADD_COUNTER(imagepages, restored);
+        lprintf("Restored %lu pages of the heap image at %p\n", restored, heap);
+    }
+
+    // The newest transaction of every thread that logged a page of the heap.
+    // Only these can be torn by the crash: with URING_LOG pages are stamped
+    // before the writes of their COMMIT record complete.
+    void NewestTransactions(std::map<int, unsigned short> &newest) {
+        for (size_t i = 0; i < numPagesHeap; i++) {
+            struct lookupinfo *info = &_pageLookupHeap[i];
+            if ( !info->dirtied ) {
+                continue;
+            }
+            std::map<int, unsigned short>::iterator it = newest.find(info->threadID);
+            if ( it == newest.end() ) {
+                newest[info->threadID] = info->xactID;
+            } else if ( (short)(unsigned short)(info->xactID - it->second) > 0 ) {
+                it->second = info->xactID;
+            }
+        }
+    }
+
+    // Whether the newest log record of page pageNo and its transaction are
+    // intact.
+    bool NewestRecordIntact(size_t pageNo) {
+        struct lookupinfo *info = &_pageLookupHeap[pageNo];
+        struct recoverfile *file = OpenLogFile(LogFileKey(info->threadID, info->xactID));
+        char buf[LogDefines::PageRecordSize];
+
+        // The log cleaner only folds the records of complete transactions.
+        if ( file == NULL ) {
+            return true;
+        }
+        return GetIntactRecord(file, info->threadID, info->xactID, pageNo, info->memlogOffset, buf, sizeof(buf)) != NULL;
+    }
+
+    // Stamp page pageNo of the image as holding its newest log record.
+    void StampImagePage(struct heapimagestamp *stamps, size_t pageNo) {
+        stamps[pageNo].threadID = _pageLookupHeap[pageNo].threadID;
+        stamps[pageNo].xactID = _pageLookupHeap[pageNo].xactID;
+        stamps[pageNo].memlogOffset = _pageLookupHeap[pageNo].memlogOffset;
+        stamps[pageNo].valid = 1;
+    }
+
+    // Restore page pageNo of the image page by page; false if it cannot be.
+    bool RestoreImagePage(char *heap, struct heapimagestamp *stamps, size_t pageNo) {
+        if ( LoadLoggedPage(heap + pageNo * xdefines::PageSize, pageNo, 0, xdefines::PageSize) != (long)xdefines::PageSize ) {
+            lprintf("Error: page %zu of the heap image cannot be restored\n", pageNo);
+            return false;
+        }
+        StampImagePage(stamps, pageNo);
+        return true;
+    }
+
+#ifdef LAZY_RECOVERY
+    // Leave the stale pages to xlazyrecovery, but for those whose log file
+    // was reclaimed by the log cleaner. False if the image cannot be served
+    // lazily.
+    bool RestoreHeapImageLazily(char *heap, char *shadow, int imageFd, struct heapimagestamp *stamps) {
+        xreplay *replay = new xreplay();
+        for (size_t i = 0; i < numPagesHeap; i++) {
+            if ( _pageLookupHeap[i].dirtied && !stamps[i].valid ) {
+                replay->addPage(_pageLookupHeap[i].threadID, _pageLookupHeap[i].xactID, i, _pageLookupHeap[i].memlogOffset);
+            }
+        }
+        if ( !replay->prepare(memLogPath) ) {
+            delete replay;
+            return false;
+        }
+
+        unsigned long restored = 0;
+        for (size_t f = 0; f < replay->numFiles(); f++) {
+            struct xreplay::file *file = replay->getFile(f);
+            if ( access(file->path, R_OK) == 0 ) {
+                continue;
+            }
+            for (size_t i = 0; i < file->count; i++) {
+                restored += RestoreImagePage(heap, stamps, file->needs[i].pageNo);
+            }
+            file->replayed = true;
+        }
+        ADD_COUNTER(imagepages, restored);
+
+        if ( !xlazyrecovery::getInstance().start(heap, shadow, imageFd, replay, stamps) ) {
+            delete replay;
+            return false;
+        }
+        // The replay serves faults, of this thread and those forked, until
+        // every page is restored.
+        return true;
+    }
+#endif
+
+    // A variable of the crashed run is at its old address in the heap image.
+    // It is copied to dest unless dest is NULL or the variable itself; the
+    // address is returned either way.
+    unsigned long RecoverFromHeapImage(void *dest, size_t size, char *name) {
+        if ( recoveredVarmap == NULL ) {
+            RecoverVarmap();
+        }
+        struct varmap_entry *v = RecoverVarmapInfo(name);
+        if ( !v ) {
+            lprintf("Error, can't find variable named %s\n", name);
+            return 0;
+        }
+
+        char *addr = _heapImage + (size_t)v->pageNo * xdefines::PageSize + v->pageOffset;
+        if ( dest != NULL && dest != addr ) {
+            memcpy(dest, addr, size);
+        }
+        lprintf("nvrecover-ed %s at %p in the heap image\n", name, addr);
+        return (unsigned long)addr;
+    }
+#endif
+
     void DumpLookupInfo(bool isHeap){
         struct lookupinfo *_pageLookup;
         unsigned long numPages;
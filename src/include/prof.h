@@ -106,6 +106,41 @@ struct runtime_stats {
     COUNTER(transactions);
     COUNTER(dirtypage_inserted);
     COUNTER(loggedpages);
+    COUNTER(parallelcommit);
+    COUNTER(trackarms);
+    COUNTER(softdirtyswitch);
+    COUNTER(softdirtyscans);
+    COUNTER(softdirtypages);
+    COUNTER(updatecalls);
+    COUNTER(updatepages);
+    COUNTER(retainedpages);
+    COUNTER(retaindrops);
+    COUNTER(silentpages);
+    COUNTER(twinreused);
+    COUNTER(pageentrychunks);
+    COUNTER(logcopied);
+    COUNTER(diffpages);
+    COUNTER(diffbytes);
+    COUNTER(zeropages);
+    COUNTER(lzpages);
+    COUNTER(packraw);
+    COUNTER(packbytes);
+    COUNTER(packtime);  // nanoseconds of thread cpu time
+    COUNTER(groupflushes);
+    COUNTER(groupcommits);
+    COUNTER(groupwait);  // microseconds
+    COUNTER(cleanrounds);
+    COUNTER(cleanfolded);
+    COUNTER(cleanreclaimed);  // bytes
+    COUNTER(cleanwait);  // microseconds
+    COUNTER(pmemlines);
+    COUNTER(nvmdelay);  // nanoseconds
+    COUNTER(replaypages);
+    COUNTER(replaybytes);
+    COUNTER(recoverfiles);
+    COUNTER(tornpages);
+    COUNTER(imagepages);
+    COUNTER(lazyfaults);
     COUNTER_ARRAY(pagedensity, 4097UL);
     COUNTER(pdcount);
     COUNTER(dummy);
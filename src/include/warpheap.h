@@ -137,7 +137,7 @@ public:
     pthread_mutexattr_t attr;
 
     // Set up the lock with a shared attribute.
-    pthread_mutexattr_init(&attr);
+    WRAP(pthread_mutexattr_init)(&attr);
     pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
 
     // Instantiate the lock structure inside a shared mmap.
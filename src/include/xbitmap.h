@@ -21,7 +21,7 @@
 
 /*
  * @file   xbitmap.h
- * @brief  Shared pages' bit map. Each page has a corresponding bit.
+ * @brief  Pool of twin pages, shared by all processes.
  * @author Tongping Liu <http://www.cs.umass.edu/~tonyliu>
  */
 
@@ -32,23 +32,50 @@
 #include <sys/types.h>
 #endif
 
+#include <new>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
 #include "xdefines.h"
 
+/* Twin pages live in a sparse memfd that is mapped chunk by chunk. Every
+ * process maps a chunk the first time it touches one of its pages, and a
+ * chunk only takes memory for the pages that were handed out, so the pool
+ * grows with the number of twins that are live at the same time.
+ *
+ * A chunk starts with the versions and the free-list links of its pages.
+ *
+ * Index 0 means "no twin". Fresh indices come from an atomic cursor; indices
+ * released when the last user of a page commits it are recycled through a
+ * lock-free list whose head carries a tag against ABA. cleanup() empties the
+ * pool at the end of a fence.
+ */
 class xbitmap {
-	// Now one bitmap for each page is 512 bytes.
 	enum {
 		BITMAP_SIZE_PER_PAGE = 4096
 	};
+	enum {
+		CHUNK_PAGES = 4096,
+		CHUNK_HEADER = 2 * CHUNK_PAGES * sizeof(int),
+		CHUNK_SIZE = CHUNK_HEADER + CHUNK_PAGES * BITMAP_SIZE_PER_PAGE
+	};
 	enum {
 #ifdef X86_32BIT
-		INITIAL_PAGES = 81920
+		MAX_CHUNKS = 64
 #else
-		INITIAL_PAGES = 81920 * 10
+		MAX_CHUNKS = 4096
 #endif
 	};
 
+	// Shared by all processes.
+	struct control {
+		volatile int cur;            // first index never handed out
+		volatile int epoch;
+		volatile int highWater;      // largest cur ever reached
+		volatile uint64_t freeHead;  // tag << 32 | first free index
+	};
+
 public:
 	xbitmap() {
 	}
@@ -60,74 +87,147 @@ public:
 	}
 
 	void initialize(void) {
-		int offset = 0;
-		char * ptr;
-#ifdef X86_32BIT
-		const size_t length = (size_t)BITMAP_SIZE_PER_PAGE * (INITIAL_PAGES + 10);
-#else
-		const size_t length = (size_t)BITMAP_SIZE_PER_PAGE * (size_t)(INITIAL_PAGES + 10);
-#endif
-		ptr = (char *) mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-
-		if (ptr == NULL) {
+		_control = (struct control *) mmap(NULL, xdefines::PageSize, PROT_READ | PROT_WRITE,
+						   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		_fd = memfd_create("nvthreadsT", MFD_CLOEXEC);
+		if (_control == MAP_FAILED || _fd == -1
+		    || ftruncate(_fd, (off_t)CHUNK_SIZE * MAX_CHUNKS) != 0) {
 			fprintf(stderr, "%d fail to initialize bit map: %s\n", getpid(),
 					strerror(errno));
 			::abort();
 		}
 
-		// Assign the address for different variables.
-		_cur = (int *) &ptr[offset];
-		offset += sizeof(int);
-
-		_versionStart = (int *) &ptr[offset];
-
-		_pageStart = (int*)((intptr_t) ptr + 2 * xdefines::PageSize);
+		for (int i = 0; i < MAX_CHUNKS; i++) {
+			_chunks[i] = NULL;
+		}
 
 		// We will start as one since we think that bitmapIndex equal to 0 means no bitmap before.
-		*_cur = 1;
-		_total = INITIAL_PAGES;
+		_control->cur = 1;
+		_control->epoch = 0;
+		_control->highWater = 1;
+		_control->freeHead = 0;
 	}
 
 	int get(void) {
-		int index;
-
-		if ((*_cur + 1) < _total) {
-			index = *_cur;
-			(*_cur)++;
-		} else {
-			// we may want to increase the size of bitmap automatically in the future.
-			fprintf(stderr, "%d: not enough bitmap _cur is %d????\n", getpid(), *_cur);
-			assert(0);
+		int index = pop();
+		if (index != 0) {
+			INC_COUNTER(twinreused);
+			return index;
+		}
+
+		index = __sync_fetch_and_add(&_control->cur, 1);
+		if (index >= MAX_CHUNKS * CHUNK_PAGES) {
+			fprintf(stderr, "%d: not enough bitmap _cur is %d????\n", getpid(), index);
+			::abort();
+		}
+
+		int high;
+		while ((high = _control->highWater) <= index) {
+			__sync_bool_compare_and_swap(&_control->highWater, high, index + 1);
 		}
 		return index;
 	}
 
+	// Give back the twin of a page nobody uses any more.
+	void put(int index) {
+		uint64_t head;
+		uint64_t next;
+
+		do {
+			head = _control->freeHead;
+			*link(index) = (int)(head & 0xFFFFFFFF);
+			next = (((head >> 32) + 1) << 32) | (uint32_t)index;
+		} while (!__sync_bool_compare_and_swap(&_control->freeHead, head, next));
+	}
+
 	void * getAddress(int index) {
-		return ((void *) ((intptr_t) _pageStart + index * BITMAP_SIZE_PER_PAGE));
+		return (void *) (chunk(index) + CHUNK_HEADER + (index % CHUNK_PAGES) * BITMAP_SIZE_PER_PAGE);
 	}
 
 	void setVersion(int index, int version) {
-		_versionStart[index] = version;
+		*versionOf(index) = version;
 	}
 
 	int getVersion(int index) {
 		assert(index != 0);
-		return (_versionStart[index]);
+		return *versionOf(index);
+	}
+
+	// Map every chunk handed out so far. Helper threads share the address
+	// space but must not map chunks themselves.
+	void mapChunks(void) {
+		int chunks = (_control->cur + CHUNK_PAGES - 1) / CHUNK_PAGES;
+		for (int i = 0; i < chunks; i++) {
+			chunk(i * CHUNK_PAGES);
+		}
 	}
 
 	// Cleanup will be called for every transaction.
 	void cleanup(void) {
 		// First, all used bitmap can be zeroed.
 		//		memset(_pageStart, 0 , (*_cur) * BITMAP_SIZE_PER_PAGE);
-		*_cur = 1;
+		_control->cur = 1;
+		_control->freeHead = ((_control->freeHead >> 32) + 1) << 32;
+		_control->epoch++;
+	}
+
+	// Indices handed out before the last cleanup are stale.
+	int epoch(void) {
+		return _control->epoch;
+	}
+
+	// Most twin pages that were ever in use at once.
+	int highWater(void) {
+		return _control->highWater - 1;
 	}
 
 private:
-	// Current index of entry that need to be allocated.
-	int _total;
-	int * _cur;
-	int * _versionStart;
-	void * _pageStart;
+	// Start of the chunk holding index, mapped on first use.
+	inline char * chunk(int index) {
+		int c = index / CHUNK_PAGES;
+		char * base = _chunks[c];
+
+		if (base == NULL) {
+			base = (char *) mmap(NULL, CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+					     _fd, (off_t)c * CHUNK_SIZE);
+			if (base == MAP_FAILED) {
+				fprintf(stderr, "%d fail to map bit map chunk %d: %s\n", getpid(), c,
+						strerror(errno));
+				::abort();
+			}
+			_chunks[c] = base;
+		}
+		return base;
+	}
+
+	inline volatile int * versionOf(int index) {
+		return (volatile int *) chunk(index) + index % CHUNK_PAGES;
+	}
+
+	inline volatile int * link(int index) {
+		return (volatile int *) chunk(index) + CHUNK_PAGES + index % CHUNK_PAGES;
+	}
+
+	// Take a released index, or 0 if there is none.
+	int pop(void) {
+		uint64_t head;
+
+		while ((head = _control->freeHead) & 0xFFFFFFFF) {
+			int index = (int)(head & 0xFFFFFFFF);
+			uint64_t next = (((head >> 32) + 1) << 32) | (uint32_t)*link(index);
+
+			if (__sync_bool_compare_and_swap(&_control->freeHead, head, next)) {
+				return index;
+			}
+		}
+		return 0;
+	}
+
+	struct control * _control;
+	int _fd;
+
+	// Mapping of every chunk in this process.
+	char * _chunks[MAX_CHUNKS];
 };
 
 #endif
@@ -85,6 +85,12 @@ typedef struct runtime_metadata {
 } runtime_metadata_t;
 extern runtime_metadata_t *global_metadata;       
 
+// Dirty pages a process is expected to hold per transaction at most.
+// Larger write sets still work, but their page entries are freed again.
+#ifndef NVTHREAD_PAGE_ENTRY_TARGET
+#define NVTHREAD_PAGE_ENTRY_TARGET 800000
+#endif
+
 class xdefines {
 public:
   enum { STACK_SIZE = 1024 * 1024 } ; // 1 * 1048576 };
@@ -95,6 +101,7 @@ public:
 #else
 //enum { PROTECTEDHEAP_SIZE = 1048576UL * 4096 * 1 }; // FIX ME 512 };
   enum { PROTECTEDHEAP_SIZE = 1048576UL * 4096 * 2 };
+  enum { HEAP_IMAGE_BASE = 0x200000000000UL }; // where HEAP_IMAGE maps the heap in every run
 #endif
   enum { PROTECTEDHEAP_CHUNK = 10485760 };
   
@@ -105,6 +112,17 @@ public:
   enum { PAGE_SIZE_MASK = (PageSize-1) };
   enum { NUM_HEAPS = 32 }; // was 16
   enum { LOCK_OWNER_BUDGET = 10 };
+  enum { MAX_HELPER_THREADS = 63 }; // helper threads per process (xworkers)
+  enum { MAX_COMMIT_HELPERS = 8 }; // helpers one commit is split between
+  enum { PARALLEL_COMMIT_PAGES = 1024 }; // smaller dirty sets are committed serially
+  enum { PARALLEL_COMMIT_SHARD = 256 }; // minimum pages handed to one commit worker
+  enum { UFFD_ARM_PAGES = 512 }; // pages armed for userfaultfd tracking at once
+  enum { SOFTDIRTY_MIN_PAGES = 256 }; // smaller regions always take faults
+  enum { SOFTDIRTY_ENTER_PERCENT = 50 }; // dirty share of used pages to go fault-free
+  enum { SOFTDIRTY_LEAVE_PERCENT = 20 }; // dirty share below which faults are cheaper
+  enum { SOFTDIRTY_SWITCH_TXNS = 4 }; // transactions in a row before switching mode
+  enum { PAGE_ENTRY_TARGET = NVTHREAD_PAGE_ENTRY_TARGET }; // page entries kept between transactions
+  enum { PAGE_ENTRY_CHUNK = 65536 }; // page entries past the target counted at once (pageentrychunks)
 };
 
 #endif
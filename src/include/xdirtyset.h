@@ -0,0 +1,185 @@
+// -*- C++ -*-
+#ifndef _XDIRTYSET_H_
+#define _XDIRTYSET_H_
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   xdirtyset.h
+ * @brief  Set of dirty pages of one region, indexed by page number.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "xdefines.h"
+#include "xpageinfo.h"
+
+/* The page entries themselves come from the dense xpageentry array; this
+ * class only keeps a membership bitmap and a page-indexed table of entry
+ * pointers. Insert and lookup are O(1). Iteration is in page order and walks
+ * a summary bitmap (one bit per bitmap word), so its cost follows the
+ * number of dirty pages rather than the size of the region.
+ *
+ * All tables are private, lazily-backed anonymous mappings.
+ */
+class xdirtyset {
+  enum { BITS = sizeof(unsigned long) * 8 };
+
+public:
+  xdirtyset() {
+    _count = 0;
+    _words = 0;
+  }
+
+  void initialize(size_t pages) {
+    _words = (pages + BITS - 1) / BITS;
+    _summaryWords = (_words + BITS - 1) / BITS;
+
+    _bitmap = (unsigned long *)allocate(_words * sizeof(unsigned long));
+    _summary = (unsigned long *)allocate(_summaryWords * sizeof(unsigned long));
+    _entries = (struct xpageinfo **)allocate(pages * sizeof(struct xpageinfo *));
+    _count = 0;
+  }
+
+  class iterator {
+  public:
+    iterator(xdirtyset * set, size_t word)
+      : _set(set), _word(word) {
+      _bits = (word < set->_words) ? set->_bitmap[word] : 0;
+    }
+
+    inline struct xpageinfo * operator*() const {
+      return _set->_entries[_word * BITS + __builtin_ctzl(_bits)];
+    }
+
+    inline iterator& operator++() {
+      _bits &= _bits - 1;
+      if (_bits == 0) {
+        _word = _set->nextWord(_word + 1);
+        _bits = (_word < _set->_words) ? _set->_bitmap[_word] : 0;
+      }
+      return *this;
+    }
+
+    inline bool operator!=(const iterator& other) const {
+      return (_word != other._word || _bits != other._bits);
+    }
+
+  private:
+    xdirtyset * _set;
+    size_t _word;
+    unsigned long _bits;
+  };
+
+  inline iterator begin(void) {
+    return iterator(this, _count ? nextWord(0) : _words);
+  }
+
+  inline iterator end(void) {
+    return iterator(this, _words);
+  }
+
+  inline struct xpageinfo * find(int pageNo) {
+    if (_bitmap[pageNo / BITS] & (1UL << (pageNo % BITS))) {
+      return _entries[pageNo];
+    }
+    return NULL;
+  }
+
+  // Add the entry of a page which is not in the set yet.
+  inline void insert(struct xpageinfo * entry) {
+    size_t pageNo = entry->pageNo;
+    size_t word = pageNo / BITS;
+
+    _entries[pageNo] = entry;
+    _bitmap[word] |= 1UL << (pageNo % BITS);
+    _summary[word / BITS] |= 1UL << (word % BITS);
+    _count++;
+  }
+
+  inline size_t size(void) {
+    return _count;
+  }
+
+  inline bool empty(void) {
+    return (_count == 0);
+  }
+
+  // Only the words that have been used are touched.
+  void clear(void) {
+    if (_count == 0) {
+      return;
+    }
+
+    for (size_t s = 0; s < _summaryWords; s++) {
+      unsigned long bits = _summary[s];
+      while (bits) {
+        _bitmap[s * BITS + __builtin_ctzl(bits)] = 0;
+        bits &= bits - 1;
+      }
+      _summary[s] = 0;
+    }
+    _count = 0;
+  }
+
+private:
+  static void * allocate(size_t size) {
+    void * ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) {
+      fprintf(stderr, "%d fail to allocate dirty set : %s\n", getpid(), strerror(errno));
+      ::abort();
+    }
+    return ptr;
+  }
+
+  // Index of the first non-empty bitmap word at or after "word".
+  inline size_t nextWord(size_t word) {
+    size_t s = word / BITS;
+    if (s >= _summaryWords) {
+      return _words;
+    }
+
+    unsigned long bits = _summary[s] & (~0UL << (word % BITS));
+    while (bits == 0) {
+      if (++s == _summaryWords) {
+        return _words;
+      }
+      bits = _summary[s];
+    }
+    return s * BITS + __builtin_ctzl(bits);
+  }
+
+  size_t _count;
+  size_t _words;
+  size_t _summaryWords;
+
+  // One bit per page.
+  unsigned long * _bitmap;
+
+  // One bit per word of _bitmap.
+  unsigned long * _summary;
+
+  // Entry for every page in the set, indexed by page number.
+  struct xpageinfo ** _entries;
+};
+
+#endif
@@ -0,0 +1,184 @@
+// -*- C++ -*-
+#ifndef _XGROUPCOMMIT_H_
+#define _XGROUPCOMMIT_H_
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   xgroupcommit.h
+ * @brief  One log flush for the commits of several threads.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "xdefines.h"
+#include "prof.h"
+#ifdef NVM_EMULATION
+#include "xnvmemu.h"
+#endif
+
+/* A commit writes its log records into the page cache and takes a ticket
+ * instead of calling fdatasync() on its own log. The ticket is waited for
+ * in the next atomicBegin(), which on the lock paths runs after the token
+ * has been passed on, so the next threads can commit in the meantime.
+ *
+ * The first waiter that finds no flush in progress becomes the leader: it
+ * notes the last ticket handed out and calls syncfs() on the log directory,
+ * which makes the log files of every thread durable at once. Tickets up to
+ * the noted one are then released. Threads arriving during the flush wait
+ * for it and elect the next leader among them.
+ *
+ * The control block is shared by all nvthreads processes; the descriptor
+ * table is shared as well, so the directory is opened once by the master.
+ */
+class xgroupcommit {
+public:
+  xgroupcommit() {
+    _control = NULL;
+    _fd = -1;
+    _pending = false;
+    _ticket = 0;
+  }
+
+  static xgroupcommit& getInstance(void) {
+    static char buf[sizeof(xgroupcommit)];
+    static xgroupcommit * theOneTrueObject = new (buf) xgroupcommit();
+    return *theOneTrueObject;
+  }
+
+  void initialize(const char * logPath) {
+    _control = (struct control *) mmap(NULL, xdefines::PageSize, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    _fd = open(logPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (_control == MAP_FAILED || _fd == -1) {
+      fprintf(stderr, "%d fail to initialize group commit for %s: %s\n", getpid(), logPath,
+              strerror(errno));
+      ::abort();
+    }
+
+    _control->requested = 0;
+    _control->durable = 0;
+    _control->flushing = 0;
+  }
+
+  // The log records of the current commit are written; take a ticket for them.
+  void enqueue(void) {
+    _ticket = __sync_add_and_fetch(&_control->requested, 1);
+    _pending = true;
+  }
+
+  // Wait until the last commit of this thread is durable.
+  void waitPending(void) {
+    if (_pending) {
+      _pending = false;
+      wait(_ticket);
+    }
+  }
+
+  // Wait until every commit so far is durable, e.g. before log space is reused.
+  void drain(void) {
+    _pending = false;
+    wait(_control->requested);
+  }
+
+private:
+  struct control {
+    volatile int requested;
+    volatile int durable;
+    volatile int flushing;
+  };
+
+  // Tickets wrap around, so they are compared by distance.
+  static inline bool covered(int durable, int ticket) {
+    return (int)((unsigned int)durable - (unsigned int)ticket) >= 0;
+  }
+
+  static long futex(volatile int * addr, int op, int val) {
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+  }
+
+  void wait(int ticket) {
+#ifdef ENABLE_PROFILING
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+#endif
+
+    int durable;
+    while (!covered(durable = _control->durable, ticket)) {
+      if (_control->flushing || !__sync_bool_compare_and_swap(&_control->flushing, 0, 1)) {
+        // Another leader is flushing; it moves "durable" when done.
+        futex(&_control->durable, FUTEX_WAIT, durable);
+        continue;
+      }
+
+      if (covered(_control->durable, ticket)) {
+        // Someone may have gone to sleep seeing us as the leader.
+        _control->flushing = 0;
+        futex(&_control->durable, FUTEX_WAKE, INT_MAX);
+        break;
+      }
+      flush();
+    }
+
+#ifdef ENABLE_PROFILING
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ADD_COUNTER(groupwait, (end.tv_sec - begin.tv_sec) * 1000000L + (end.tv_nsec - begin.tv_nsec) / 1000);
+#endif
+  }
+
+  // Called by the leader with "flushing" set.
+  void flush(void) {
+    int durable = _control->durable;
+    int target = _control->requested;
+
+    if (syncfs(_fd) != 0) {
+      perror("syncfs(): ");
+      ::abort();
+    }
+#ifdef NVM_EMULATION
+    xnvmemu::getInstance().flush();
+#endif
+
+    INC_COUNTER(groupflushes);
+    ADD_COUNTER(groupcommits, (unsigned int)target - (unsigned int)durable);
+
+    _control->durable = target;
+    __sync_synchronize();
+    _control->flushing = 0;
+    futex(&_control->durable, FUTEX_WAKE, INT_MAX);
+  }
+
+  struct control * _control;
+  int _fd;
+
+  // Per process: the ticket of the last commit.
+  bool _pending;
+  int _ticket;
+};
+
+#endif
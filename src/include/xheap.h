@@ -119,6 +119,9 @@ public:
 //  fprintf(stderr, "\n%d: allocated %zu bytes, remaining: %zu bytes\n", getpid(), sz, *_remaining);
 
     void * newptr = (void*)*_position;
+#ifdef HEAP_IMAGE
+    parent::setImagePosition(newptr);
+#endif
     //__asm__ __volatile__ ("mfence": : :"memory");
 		
     //fprintf(stderr, "%d: xheapmalloc %p ~ %p. sz: %zu bytes\n", getpid(),p, newptr, sz);
@@ -142,6 +145,16 @@ public:
     parent::initialize();
   }
 
+#ifdef HEAP_IMAGE
+  /// @brief Back the heap with its image file and resume allocating past
+  /// what the image already holds.
+  void attachImage(nvrecovery * recovery) {
+    char * position = (char *)parent::attachImage(recovery, (void *)*_position);
+    *_position = position;
+    *_remaining = _end - position;
+  }
+#endif
+
   /// @brief Call this before every transaction begins.
   void begin(bool cleanup) {
     sanityCheck();
@@ -0,0 +1,97 @@
+// -*- C++ -*-
+#ifndef _XHEAPIMAGE_H_
+#define _XHEAPIMAGE_H_
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   xheapimage.h
+ * @brief  Layout of the heap image file that backs the heap with HEAP_IMAGE.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xdefines.h"
+
+/* With HEAP_IMAGE the shared copy of the heap is the file "heap_image" in
+ * the log path instead of an unlinked temporary file, and the heap is
+ * mapped at HEAP_IMAGE_BASE in every run. A restarted program maps the
+ * image of the crashed run where it was, so pointers into the heap stay
+ * valid, and only pages the image may not hold as last logged are restored
+ * from the log. The file is
+ *
+ *   [ heap pages | header page | one stamp per heap page ]
+ *
+ * A stamp names the log record its page was last committed from. It is
+ * cleared before a commit writes the page and set once the page is
+ * written, so a page whose stamp matches its page lookup info holds
+ * exactly that record. Pages changed in the shared copy without a log
+ * record, as while the program runs a single thread, keep their stamp.
+ *
+ * The image lives in the page cache; the stamps only vouch for it after
+ * the process crashed. After a reboot, told by the boot id, every logged
+ * page is restored.
+ */
+
+#define HEAP_IMAGE_MAGIC 0x4e564845415049ULL
+
+struct heapimageheader {
+  uint64_t magic;
+  uint64_t base;        // address of the heap
+  uint64_t size;        // bytes of heap pages
+  uint64_t position;    // end of the memory handed out by xheap
+  char bootID[64];      // boot the image was last written in
+};
+
+struct heapimagestamp {
+  uint16_t threadID;
+  uint16_t xactID;
+  uint32_t valid;
+  uint64_t memlogOffset;
+};
+
+class xheapimage {
+public:
+  // Id of the running boot, an empty string if it cannot be read.
+  static void readBootID(char * buf, size_t size) {
+    memset(buf, 0, size);
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+    if (fd == -1) {
+      return;
+    }
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n <= 0) {
+      buf[0] = '\0';
+    }
+  }
+
+  // Bytes of the file behind a heap of "size" bytes
+  static size_t fileSize(size_t size) {
+    return size + headerSize(size);
+  }
+
+  // Bytes of the header page and the stamps
+  static size_t headerSize(size_t size) {
+    return xdefines::PageSize + size / xdefines::PageSize * sizeof(struct heapimagestamp);
+  }
+};
+
+#endif
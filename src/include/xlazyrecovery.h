@@ -0,0 +1,522 @@
+// -*- C++ -*-
+#ifndef _XLAZYRECOVERY_H_
+#define _XLAZYRECOVERY_H_
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   xlazyrecovery.h
+ * @brief  Restore the pages of the heap image on first touch.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/falloc.h>
+#include <linux/futex.h>
+#include <linux/userfaultfd.h>
+
+#include "xdefines.h"
+#include "xheapimage.h"
+#include "xreplay.h"
+#include "xworkers.h"
+#include "prof.h"
+
+#ifndef HEAP_IMAGE
+#error "LAZY_RECOVERY restores the heap image, it needs HEAP_IMAGE"
+#endif
+#if defined(DIFF_LOGGING) || defined(CIRCULAR_LOG)
+#error "LAZY_RECOVERY replays per transaction logs of whole pages"
+#endif
+
+/* Instead of restoring every stale page of the heap image before main()
+ * runs, the stale pages are punched out of the image file and the heap is
+ * registered with userfaultfd in missing mode. A handler thread then
+ *
+ *   - serves the first touch of a punched page: it replays the log file
+ *     the page is needed from (xreplay) and copies in every page that file
+ *     restores, so one read serves the neighbours logged with it;
+ *   - prefetches the remaining files in order while no fault is waiting.
+ *
+ * Pages nobody ever wrote, and pages whose record turned out torn, are
+ * filled with zeros. Every restored page gets its stamp back.
+ *
+ * The image must be on tmpfs, the only file system whose shared mappings
+ * take missing faults; elsewhere recovery falls back to restoring eagerly.
+ * Every mapping of the image that touches a punched page has to be
+ * registered, or the kernel fills the page with zeros. Threads are forked
+ * with UFFD_FEATURE_EVENT_FORK: a child keeps the registration under a
+ * userfaultfd of its own, which the handler gets with the fork event and
+ * serves as well. Pages are always filled through the shadow mapping of
+ * the owner, which puts them in the page cache every mapping reads, and
+ * the fault is woken where it was taken. When the owner remaps the heap
+ * (openProtection) the new mapping is registered again (remapped()).
+ *
+ * Without fork events, which need CAP_SYS_PTRACE, the first thread
+ * creation waits for the handler to finish instead (beforeSpawn()).
+ *
+ * The handler is a raw clone() thread, like the xreplay workers.
+ */
+class xlazyrecovery {
+public:
+  // Userfaultfds of forked threads served at once. Threads created while
+  // half of them are in use wait until every page is restored.
+  enum { MaxForks = 128 };
+
+  xlazyrecovery() {
+    _fd = -1;
+    _state = NULL;
+    _stack = NULL;
+  }
+
+  static xlazyrecovery& getInstance(void) {
+    static char buf[sizeof(xlazyrecovery)];
+    static xlazyrecovery * theOneTrueObject = new (buf) xlazyrecovery();
+    return *theOneTrueObject;
+  }
+
+  // Serve the pages of replay that are not replayed yet on demand. heap and
+  // shadow map the image file imageFd; stamps are its page stamps. Returns
+  // false, with nothing changed, if the image cannot be served lazily.
+  bool start(char * heap, char * shadow, int imageFd, xreplay * replay, struct heapimagestamp * stamps) {
+    size_t length = replay->pages() * xdefines::PageSize;
+
+    _forks = true;
+    int fd = openUffd(UFFD_FEATURE_EVENT_FORK);
+    if (fd == -1) {
+      _forks = false;
+      fd = openUffd(0);
+    }
+    if (fd == -1) {
+      return false;
+    }
+    if (!registerRange(fd, heap, length)) {
+      close(fd);
+      return false;
+    }
+    if (!registerRange(fd, shadow, length)) {
+      unregisterRange(fd, heap, length);
+      close(fd);
+      return false;
+    }
+
+    // Drop the stale pages from the image, in runs of consecutive pages.
+    size_t punched = 0;
+    size_t run = 0;
+    for (size_t i = 0; i <= replay->pages(); i++) {
+      if (i < replay->pages() && replay->fileOf(i) != -1 && !replay->getFile(replay->fileOf(i))->replayed) {
+        run++;
+        continue;
+      }
+      if (run == 0) {
+        continue;
+      }
+      if (fallocate(imageFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    (i - run) * xdefines::PageSize, run * xdefines::PageSize) != 0) {
+        if (punched == 0) {
+          lprintf("Cannot punch the heap image, restoring it eagerly: %s\n", strerror(errno));
+          unregisterRange(fd, heap, length);
+          unregisterRange(fd, shadow, length);
+          close(fd);
+          return false;
+        }
+        fprintf(stderr, "%d: failed to punch the heap image: %s\n", getpid(), strerror(errno));
+        ::abort();
+      }
+      punched += run;
+      run = 0;
+    }
+
+    _buffer = (char *)mmap(NULL, xreplay::ChunkSize, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    _present = (unsigned char *)mmap(NULL, replay->pages(), PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    _state = (struct lazystate *)mmap(NULL, sizeof(struct lazystate), PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (_buffer == MAP_FAILED || _present == MAP_FAILED || _state == MAP_FAILED) {
+      fprintf(stderr, "%d: fail to map lazy recovery buffers: %s\n", getpid(), strerror(errno));
+      ::abort();
+    }
+
+    _fd = fd;
+    _owner = syscall(SYS_getpid);
+    _heap = (uintptr_t)heap;
+    _shadow = (uintptr_t)shadow;
+    _length = length;
+    _replay = replay;
+    _stamps = stamps;
+    _nextFile = 0;
+    _forkCount = 0;
+    _pendingCount = 0;
+    _faults = 0;
+    _restoredPages = 0;
+    _zeroPages = 0;
+    _collected = false;
+    memset((void *)_state, 0, sizeof(*_state));
+    if (!xworkers::spawnThread(handlerMain, this, &_stack)) {
+      fprintf(stderr, "%d: fail to start the lazy recovery thread\n", getpid());
+      ::abort();
+    }
+    lprintf("Restoring %zu pages of the heap image on demand\n", punched);
+    return true;
+  }
+
+  // A thread forked now loses the registration unless the handler gets the
+  // fork event; without fork events, or with too many threads to serve,
+  // wait until every page is restored.
+  void beforeSpawn(void) {
+    if (_state != NULL && (!_forks || _state->forks >= MaxForks / 2)) {
+      finish();
+    }
+  }
+
+  // The owner mapped [start, start + size) of the heap anew; register it
+  // again while pages may still be missing.
+  void remapped(void * start, size_t size) {
+    if (_state == NULL || syscall(SYS_getpid) != _owner) {
+      return;
+    }
+    uintptr_t from = ((uintptr_t)start > _heap) ? (uintptr_t)start : _heap;
+    uintptr_t to = ((uintptr_t)start + size < _heap + _length) ? (uintptr_t)start + size : _heap + _length;
+    if (from >= to) {
+      return;
+    }
+
+    // The handler does not close the userfaultfd under the lock.
+    while (__sync_lock_test_and_set(&_state->lock, 1)) {
+      ;
+    }
+    bool registered = _state->closing || registerRange(_fd, (char *)from, to - from);
+    __sync_lock_release(&_state->lock);
+    if (!registered) {
+      // Not touching the heap until the handler is done is as good.
+      finish();
+    }
+  }
+
+  // Wait until every page is restored. The owner then collects what the
+  // handler counted.
+  void finish(void) {
+    if (_state == NULL) {
+      return;
+    }
+    while (!_state->done) {
+      xworkers::rawsyscall(SYS_futex, (long)&_state->done, FUTEX_WAIT, 0, 0);
+    }
+    if (syscall(SYS_getpid) != _owner || _collected) {
+      return;
+    }
+    _collected = true;
+    _replay->release();
+    munmap(_buffer, xreplay::ChunkSize);
+    munmap(_present, _replay->pages());
+
+    ADD_COUNTER(imagepages, _restoredPages);
+    ADD_COUNTER(lazyfaults, _faults);
+    if (_zeroPages != 0) {
+      fprintf(stderr, "%d: %lu pages of the heap image could not be restored\n", getpid(), _zeroPages);
+    }
+    lprintf("Lazy recovery done, %lu faults, %lu pages restored\n", _faults, _restoredPages);
+  }
+
+private:
+  // Flags shared by every thread of the run
+  struct lazystate {
+    volatile int done;          // every page is restored, the handler is gone
+    volatile int lock;          // remapped() against the handler closing
+    volatile int closing;
+    volatile int forks;         // userfaultfds of forked threads served
+  };
+
+  // A fault read from userfaultfd fd, not served yet
+  struct pending {
+    int fd;
+    uintptr_t addr;
+  };
+  enum { MaxPending = 2 * (MaxForks + 1) };
+
+  // A non-blocking userfaultfd with features, -1 if there is none; poll()
+  // only works on a non-blocking one.
+  static int openUffd(uint64_t features) {
+    int fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (fd == -1) {
+      lprintf("No userfaultfd, restoring the heap image eagerly: %s\n", strerror(errno));
+      return -1;
+    }
+    struct uffdio_api api;
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    api.features = features;
+    if (ioctl(fd, UFFDIO_API, &api) != 0) {
+      lprintf("userfaultfd without features %lx: %s\n", (unsigned long)features, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  static bool registerRange(int fd, char * start, size_t length) {
+    struct uffdio_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.range.start = (uintptr_t)start;
+    reg.range.len = length;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(fd, UFFDIO_REGISTER, &reg) != 0) {
+      lprintf("Cannot register the heap image with userfaultfd: %s\n", strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
+  static void unregisterRange(int fd, char * start, size_t length) {
+    struct uffdio_range range;
+    range.start = (uintptr_t)start;
+    range.len = length;
+    ioctl(fd, UFFDIO_UNREGISTER, &range);
+  }
+
+  static int handlerMain(void * arg) {
+    xlazyrecovery * lazy = (xlazyrecovery *)arg;
+
+    // Faults and forks first, then the next file in order.
+    while (true) {
+      bool received = lazy->receive();
+      if (lazy->_pendingCount > 0) {
+        struct pending p = lazy->_pending[--lazy->_pendingCount];
+        lazy->fault(p.fd, p.addr);
+      } else if (lazy->_nextFile < lazy->_replay->numFiles()) {
+        lazy->restoreFile(lazy->_nextFile++);
+      } else if (!received) {
+        break;
+      }
+    }
+
+    // Closing a userfaultfd unregisters its mappings and wakes whoever
+    // still waits on a page nobody wrote.
+    while (__sync_lock_test_and_set(&lazy->_state->lock, 1)) {
+      ;
+    }
+    lazy->_state->closing = 1;
+    __sync_lock_release(&lazy->_state->lock);
+    for (int i = 0; i < lazy->_forkCount; i++) {
+      xworkers::rawsyscall(SYS_close, lazy->_forkFds[i], 0, 0);
+    }
+    xworkers::rawsyscall(SYS_close, lazy->_fd, 0, 0);
+
+    lazy->_state->done = 1;
+    xworkers::rawsyscall(SYS_futex, (long)&lazy->_state->done, FUTEX_WAKE, INT_MAX, 0);
+    return 0;
+  }
+
+  // Read one message of every userfaultfd that has one: forks are taken
+  // on at once, faults are left pending. False if there was none.
+  bool receive(void) {
+    struct pollfd pfds[MaxForks + 1];
+    struct uffd_msg msg;
+    int count = 0;
+
+    pfds[count].fd = _fd;
+    pfds[count].events = POLLIN;
+    pfds[count++].revents = 0;
+    for (int i = 0; i < _forkCount; i++) {
+      pfds[count].fd = _forkFds[i];
+      pfds[count].events = POLLIN;
+      pfds[count++].revents = 0;
+    }
+    if (xworkers::rawsyscall(SYS_poll, (long)pfds, count, 0) <= 0) {
+      return false;
+    }
+
+    bool received = false;
+    for (int i = 0; i < count; i++) {
+      if (!(pfds[i].revents & POLLIN)
+          || xworkers::rawsyscall(SYS_read, pfds[i].fd, (long)&msg, sizeof(msg)) != sizeof(msg)) {
+        continue;
+      }
+      received = true;
+      if (msg.event == UFFD_EVENT_FORK) {
+        forked((int)msg.arg.fork.ufd);
+      } else if (msg.event == UFFD_EVENT_PAGEFAULT) {
+        uintptr_t addr = msg.arg.pagefault.address & ~(uintptr_t)xdefines::PAGE_SIZE_MASK;
+        if (_pendingCount < MaxPending) {
+          _pending[_pendingCount].fd = pfds[i].fd;
+          _pending[_pendingCount++].addr = addr;
+        } else {
+          // The thread faults again.
+          wake(pfds[i].fd, addr);
+        }
+      }
+    }
+    return received;
+  }
+
+  // A thread was forked with the userfaultfd fd for its mappings.
+  void forked(int fd) {
+    // Well before beforeSpawn() counts the threads that exited
+    if (_forkCount >= MaxForks / 4) {
+      reapForks();
+    }
+    if (_forkCount == MaxForks) {
+      // beforeSpawn() keeps it from happening; the thread would see zeros.
+      static const char msg[] = "lazy recovery: too many threads to serve\n";
+      xworkers::rawsyscall(SYS_write, 2, (long)msg, sizeof(msg) - 1);
+      xworkers::rawsyscall(SYS_kill, _owner, SIGABRT, 0);
+      return;
+    }
+    _forkFds[_forkCount++] = fd;
+    _state->forks = _forkCount;
+  }
+
+  // Close the userfaultfds of threads that exited. A zero page for the
+  // buffer, which is never registered, fails with ESRCH only once the
+  // address space of the thread is gone.
+  void reapForks(void) {
+    struct uffdio_zeropage probe;
+    int kept = 0;
+    for (int i = 0; i < _forkCount; i++) {
+      probe.range.start = (uintptr_t)_buffer;
+      probe.range.len = xdefines::PageSize;
+      probe.mode = UFFDIO_ZEROPAGE_MODE_DONTWAKE;
+      probe.zeropage = 0;
+      if (xworkers::rawsyscall(SYS_ioctl, _forkFds[i], UFFDIO_ZEROPAGE, (long)&probe) == -ESRCH) {
+        xworkers::rawsyscall(SYS_close, _forkFds[i], 0, 0);
+        continue;
+      }
+      _forkFds[kept++] = _forkFds[i];
+    }
+    _forkCount = kept;
+    _state->forks = _forkCount;
+  }
+
+  // Restore the page at addr, a fault taken on userfaultfd fd.
+  void fault(int fd, uintptr_t addr) {
+    bool shadow = (addr >= _shadow && addr < _shadow + _length);
+    size_t pageNo = (addr - (shadow ? _shadow : _heap)) / xdefines::PageSize;
+    int f = _replay->fileOf(pageNo);
+    _faults++;
+
+    if (f != -1) {
+      restoreFile(f);
+    } else {
+      fill(pageNo, NULL);
+    }
+
+    // Pages are filled through the shadow mapping of the owner, the fault
+    // may have been taken on another one.
+    wake(fd, addr);
+  }
+
+  static void wake(int fd, uintptr_t addr) {
+    struct uffdio_range range;
+    range.start = addr;
+    range.len = xdefines::PageSize;
+    xworkers::rawsyscall(SYS_ioctl, fd, UFFDIO_WAKE, (long)&range);
+  }
+
+  // Replay file f and fill in every page it is needed for.
+  void restoreFile(size_t f) {
+    struct xreplay::file * file = _replay->getFile(f);
+    if (file->replayed) {
+      return;
+    }
+    _replay->replayOne(file, _buffer);
+
+    for (size_t i = 0; i < file->count; i++) {
+      struct xreplay::need * n = &file->needs[i];
+      if (!_replay->restored(n->pageNo)) {
+        _zeroPages++;
+        fill(n->pageNo, NULL);
+        continue;
+      }
+      if (fill(n->pageNo, _replay->page(n->pageNo))) {
+        struct heapimagestamp * stamp = &_stamps[n->pageNo];
+        stamp->threadID = file->key >> 16;
+        stamp->xactID = file->key & 0xFFFF;
+        stamp->memlogOffset = n->offset + LogDefines::RecordHeaderSize;
+        stamp->valid = 1;
+        _restoredPages++;
+      }
+    }
+  }
+
+  // Copy src, or zeros, into a missing page; false if it was there already.
+  // The copy fails with EAGAIN while a fork waits for its event to be read.
+  bool fill(size_t pageNo, const char * src) {
+    if (_present[pageNo]) {
+      return false;
+    }
+    _present[pageNo] = 1;
+
+    long ret;
+    if (src != NULL) {
+      struct uffdio_copy copy;
+      copy.dst = _shadow + pageNo * xdefines::PageSize;
+      copy.src = (uintptr_t)src;
+      copy.len = xdefines::PageSize;
+      copy.mode = 0;
+      copy.copy = 0;
+      while ((ret = xworkers::rawsyscall(SYS_ioctl, _fd, UFFDIO_COPY, (long)&copy)) == -EAGAIN) {
+        receive();
+      }
+    } else {
+      struct uffdio_zeropage zero;
+      zero.range.start = _shadow + pageNo * xdefines::PageSize;
+      zero.range.len = xdefines::PageSize;
+      zero.mode = 0;
+      zero.zeropage = 0;
+      while ((ret = xworkers::rawsyscall(SYS_ioctl, _fd, UFFDIO_ZEROPAGE, (long)&zero)) == -EAGAIN) {
+        receive();
+      }
+    }
+    return (ret == 0);
+  }
+
+  int _fd;
+  pid_t _owner;                 // process of the handler, not getpid(), which libdthread overrides
+  bool _forks;                  // forked threads are served
+  struct lazystate * _state;
+  char * _stack;
+  char * _buffer;
+  unsigned char * _present;
+
+  uintptr_t _heap;
+  uintptr_t _shadow;
+  size_t _length;
+  xreplay * _replay;
+  struct heapimagestamp * _stamps;
+  size_t _nextFile;
+  int _forkFds[MaxForks];
+  int _forkCount;
+  struct pending _pending[MaxPending];
+  int _pendingCount;
+  bool _collected;
+
+  unsigned long _faults;
+  unsigned long _restoredPages;
+  unsigned long _zeroPages;
+};
+
+#endif
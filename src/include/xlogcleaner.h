@@ -0,0 +1,715 @@
+// -*- C++ -*-
+#ifndef _XLOGCLEANER_H_
+#define _XLOGCLEANER_H_
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   xlogcleaner.h
+ * @brief  Reclaim the log files whose pages were logged again since.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/falloc.h>
+#include <linux/futex.h>
+
+#include "xdefines.h"
+#include "prof.h"
+#include "nvrecovery.h"
+
+#ifdef CIRCULAR_LOG
+#error "LOG_CLEANER reclaims per transaction log files, CIRCULAR_LOG segments reclaim themselves"
+#endif
+
+// Bytes of log the threads may use before they wait for the cleaner.
+#ifndef NVTHREAD_LOG_BUDGET
+#define NVTHREAD_LOG_BUDGET (1024UL * 1048576)
+#endif
+
+/* The log cleaner is a helper process forked by the master. It starts a
+ * round when the logs take half the budget, and the threads that find the
+ * budget exceeded in atomicBegin() wait for it.
+ *
+ * A round folds the pages the lookup info refers to into a base image,
+ * MemLog_base, with one slot per page. A slot is a COPY record of the whole
+ * page tagged with the (threadID, xactID, offset) of the record it was
+ * folded from; recovery reads it when that record is gone. Once the base
+ * image is durable, log files of past epochs that hold nothing else are
+ * unlinked and the dead prefix of the others is punched out.
+ *
+ * The buffered lookup info of a nested section is not folded: its records
+ * stay, with their transaction and the DIFF records they build on. Nothing
+ * is reclaimed unless a whole scan ran between two commits, so a record
+ * logged meanwhile cannot build on one the scan did not see; if commits
+ * keep coming, the round holds them back during its last scan.
+ *
+ * The helper has its own descriptor table and calls no intercepted
+ * function: the library malloc() would hand it memory of the threads.
+ */
+class xlogcleaner {
+public:
+  static const unsigned long Budget = NVTHREAD_LOG_BUDGET;
+  static const unsigned long LowWater = NVTHREAD_LOG_BUDGET / 2;
+  enum { MaxFiles = 16384 };
+  enum { Interval = 100 };      // milliseconds between checks while idle
+  enum { StalledChecks = 10 };  // checks between rounds that reclaimed nothing
+  enum { ScanAttempts = 3 };
+
+  xlogcleaner() {
+    _control = NULL;
+    _helper = 0;
+    _lookup = NULL;
+    _lookupTmp = NULL;
+    _pages = 0;
+  }
+
+  static xlogcleaner& getInstance(void) {
+    static char buf[sizeof(xlogcleaner)];
+    static xlogcleaner * theOneTrueObject = new (buf) xlogcleaner();
+    return *theOneTrueObject;
+  }
+
+  // The page lookup info of the heap, whose records are logged.
+  void setLookup(struct lookupinfo * lookup, struct lookupinfo * lookupTmp, unsigned long pages) {
+    _lookup = lookup;
+    _lookupTmp = lookupTmp;
+    _pages = pages;
+  }
+
+  // Start the helper process; called by the master once the lookup info is set.
+  void initialize(const char * memLogPath) {
+    strcpy(_path, memLogPath);
+    _control = (struct control *) mmap(NULL, xdefines::PageSize, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    _foreign = (ino_t *) mmap(NULL, MaxFiles * sizeof(ino_t), PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (_control == MAP_FAILED || _foreign == MAP_FAILED) {
+      fprintf(stderr, "%d fail to initialize the log cleaner: %s\n", getpid(), strerror(errno));
+      ::abort();
+    }
+    memset((void *)_control, 0, sizeof(*_control));
+
+    // The logs of a crashed run are left to recovery.
+    _foreignCount = 0;
+    if (!listFiles(true)) {
+      fprintf(stderr, "%d: %s holds too many logs, the log cleaner is off\n", getpid(), _path);
+      _control->stalled = 1;
+      return;
+    }
+
+    pid_t master = syscall(SYS_getpid);
+    pid_t pid = syscall(SYS_clone, SIGCHLD, (void *)0);
+    if (pid == -1) {
+      perror("clone(): ");
+      ::abort();
+    }
+    if (pid == 0) {
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      if (getppid() != master) {
+        _exit(0);
+      }
+      run();
+      _exit(0);
+    }
+    _helper = pid;
+  }
+
+  // Stop the helper; called by the master.
+  void finalize(void) {
+    if (_helper == 0 || syscall(SYS_getpid) == _helper) {
+      return;
+    }
+    _control->exiting = 1;
+    kick();
+    waitpid(_helper, NULL, 0);
+    _helper = 0;
+  }
+
+  // A commit starts logging; it waits while a round holds commits back.
+  void enter(void) {
+    if (_control == NULL) {
+      return;
+    }
+    while (true) {
+      while (_control->holding) {
+        futex(&_control->holding, FUTEX_WAIT, 1, NULL);
+      }
+      __sync_add_and_fetch(&_control->begins, 1);
+      if (!_control->holding) {
+        return;
+      }
+      // Raced with the round: back out as if done.
+      __sync_add_and_fetch(&_control->ends, 1);
+    }
+  }
+
+  // The commit is done: it appended "bytes" to the logs and logged pages
+  // below "pageLimit".
+  void account(unsigned long bytes, unsigned long pageLimit) {
+    if (_control == NULL) {
+      return;
+    }
+    unsigned long limit;
+    while ((limit = _control->pageLimit) < pageLimit) {
+      __sync_bool_compare_and_swap(&_control->pageLimit, limit, pageLimit);
+    }
+    __sync_add_and_fetch(&_control->ends, 1);
+    // Estimated in blocks, a round measures it again.
+    bytes = (bytes + LogDefines::PAGE_SIZE_MASK) & ~(unsigned long)LogDefines::PAGE_SIZE_MASK;
+    unsigned long usage = __sync_add_and_fetch(&_control->usage, bytes);
+    if (usage >= LowWater && _control->sleeping && !_control->stalled) {
+      kick();
+    }
+  }
+
+  // Wait while the logs exceed the budget, until a round brings them back
+  // or shows that the live pages alone exceed it.
+  void throttle(void) {
+    if (_control == NULL || _control->usage <= Budget || _control->stalled) {
+      return;
+    }
+#ifdef ENABLE_PROFILING
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+#endif
+
+    while (_control->usage > Budget && !_control->stalled && !_control->exiting) {
+      int round = _control->round;
+      kick();
+      struct timespec timeout = { 0, Interval * 1000000L };
+      futex(&_control->round, FUTEX_WAIT, round, &timeout);
+    }
+
+#ifdef ENABLE_PROFILING
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ADD_COUNTER(cleanwait, (end.tv_sec - begin.tv_sec) * 1000000L + (end.tv_nsec - begin.tv_nsec) / 1000);
+#endif
+  }
+
+private:
+  struct control {
+    volatile unsigned long usage;   // bytes of log, measured by the last round
+    volatile unsigned long begins;  // commits begun
+    volatile unsigned long ends;    // commits done
+    volatile unsigned long pageLimit; // no page above was logged
+    volatile int kick;
+    volatile int holding;           // commits wait for the scan
+    volatile int round;
+    volatile int sleeping;
+    volatile int stalled;           // the last round reclaimed nothing
+    volatile int exiting;
+  };
+
+  // A log file as seen at the start of a round
+  struct logfile {
+    int threadID;
+    unsigned long xactID;
+    unsigned long size;
+    unsigned long keep;             // bytes from here on stay
+    unsigned long blocks;
+    int fd;
+    char name[32];
+  };
+
+  // The record a base image slot was folded from
+  struct foldtag {
+    unsigned long memlogOffset;
+    unsigned short threadID;
+    unsigned short xactID;
+  };
+
+  struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+  };
+
+  static long futex(volatile int * addr, int op, int val, struct timespec * timeout) {
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+  }
+
+  void kick(void) {
+    __sync_add_and_fetch(&_control->kick, 1);
+    futex(&_control->kick, FUTEX_WAKE, INT_MAX, NULL);
+  }
+
+  /* ---------------- The helper process ---------------- */
+
+  void run(void) {
+    char fn[FILENAME_MAX];
+    sprintf(fn, "%sMemLog_base", _path);
+    _dirFd = open(_path, O_RDONLY | O_DIRECTORY);
+    _baseFd = open(fn, O_RDWR | O_CREAT, 0644);
+    _files = (struct logfile *) mmap(NULL, MaxFiles * sizeof(struct logfile), PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    _hash = (int *) mmap(NULL, 2 * MaxFiles * sizeof(int), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    _tags = (struct foldtag *) mmap(NULL, _pages * sizeof(struct foldtag), PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (_dirFd == -1 || _baseFd == -1 || _files == MAP_FAILED || _hash == MAP_FAILED || _tags == MAP_FAILED) {
+      fprintf(stderr, "%d: the log cleaner cannot start: %s\n", getpid(), strerror(errno));
+      _control->stalled = 1;
+      return;
+    }
+
+    int idle = 0;
+    while (!_control->exiting) {
+      int kick = _control->kick;
+      _control->sleeping = 1;
+      struct timespec timeout = { 0, Interval * 1000000L };
+      futex(&_control->kick, FUTEX_WAIT, kick, &timeout);
+      _control->sleeping = 0;
+      if (_control->exiting) {
+        break;
+      }
+
+      // A stalled cleaner only retries now and then.
+      idle++;
+      if (_control->usage < LowWater || (_control->stalled && idle < StalledChecks)) {
+        continue;
+      }
+      idle = 0;
+      clean();
+    }
+  }
+
+  // One round; wakes the threads throttled on it.
+  void clean(void) {
+    unsigned long before = 0;
+    unsigned long reclaimed = 0;
+    unsigned long epoch = GET_METACOUNTER(globalTransactionCount);
+
+    // Only a scan no commit ran into sees every record a commit can still
+    // build on; the copies made by the others are kept all the same. The
+    // last attempt holds commits back.
+    bool consistent = false;
+    for (int attempt = 0; attempt < ScanAttempts && !consistent; attempt++) {
+      if (attempt > 0) {
+        closeFiles();
+      }
+      if (attempt == ScanAttempts - 1) {
+        _control->holding = 1;
+        __sync_synchronize();
+      }
+      unsigned long begins = quiesce();
+      if (!listFiles(false)) {
+        fprintf(stderr, "%d: %s holds more than %d logs, the log cleaner skips them\n",
+                getpid(), _path, (int)MaxFiles);
+        finishRound(false);
+        return;
+      }
+      scan();
+      consistent = (begins == _control->begins && begins == _control->ends);
+    }
+    if (_control->holding) {
+      _control->holding = 0;
+      futex(&_control->holding, FUTEX_WAKE, INT_MAX, NULL);
+    }
+    if (!consistent) {
+      closeFiles();
+      finishRound(false);
+      return;
+    }
+
+    for (int i = 0; i < _fileCount; i++) {
+      struct logfile * file = &_files[i];
+      before += file->blocks;
+      if (file->keep == file->size && file->xactID + 1 < epoch) {
+        // A past epoch is not appended to any more.
+        if (unlinkat(_dirFd, file->name, 0) == 0) {
+          reclaimed += file->blocks;
+        }
+      } else if ((file->keep & ~LogDefines::PAGE_SIZE_MASK) > 0) {
+        fallocate(fileFd(file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0,
+                  file->keep & ~LogDefines::PAGE_SIZE_MASK);
+        struct stat st;
+        if (fstat(fileFd(file), &st) == 0 && (unsigned long)st.st_blocks * 512 < file->blocks) {
+          reclaimed += file->blocks - st.st_blocks * 512;
+        }
+      }
+    }
+    closeFiles();
+
+    INC_COUNTER(cleanrounds);
+    ADD_COUNTER(cleanreclaimed, reclaimed);
+    lprintf("log cleaner: %lu of %lu bytes reclaimed\n", reclaimed, before);
+    finishRound(reclaimed > 0);
+  }
+
+  // Wait for the commit in progress, if any; returns the commits begun.
+  unsigned long quiesce(void) {
+    for (int wait = 0; wait < 1000 || _control->holding; wait++) {
+      unsigned long begins = _control->begins;
+      if (begins == _control->ends) {
+        return begins;
+      }
+      struct timespec pause = { 0, 100000 };
+      nanosleep(&pause, NULL);
+    }
+    return _control->begins;
+  }
+
+  // Pin or fold the records of the lookup info into the base image.
+  void scan(void) {
+    unsigned long pages = _control->pageLimit;
+    if (pages > _pages) {
+      pages = _pages;
+    }
+
+    // Buffered lookup info first: what moves on to _lookup is seen there.
+    for (unsigned long pageNo = 0; pageNo < pages; pageNo++) {
+      struct lookupinfo info;
+      if (readLookup(&_lookupTmp[pageNo], &info) && info.dirtied) {
+        pinRecord(info.threadID, info.xactID, info.memlogOffset, 0);
+      }
+    }
+
+    bool folded = false;
+    for (unsigned long pageNo = 0; pageNo < pages; pageNo++) {
+      struct lookupinfo info;
+      if (!readLookup(&_lookup[pageNo], &info) || !info.dirtied) {
+        continue;
+      }
+      struct foldtag * tag = &_tags[pageNo];
+      if (tag->threadID == info.threadID && tag->xactID == info.xactID && tag->memlogOffset == info.memlogOffset) {
+        continue;
+      }
+      struct logfile * file = findFile(info.threadID, info.xactID);
+      if (file == NULL) {
+        continue;
+      }
+      // Records that stay need no copy, only the records they depend on.
+      if (info.memlogOffset - LogDefines::RecordHeaderSize >= file->keep) {
+        pinRecord(info.threadID, info.xactID, info.memlogOffset, 0);
+        continue;
+      }
+      if (foldPage(pageNo, &info)) {
+        folded = true;
+      } else {
+        pinRecord(info.threadID, info.xactID, info.memlogOffset, 0);
+      }
+    }
+
+    // The copies must be durable before the records they came from go.
+    if (folded && fdatasync(_baseFd) != 0) {
+      perror("fdatasync(): ");
+      ::abort();
+    }
+  }
+
+  void closeFiles(void) {
+    for (int i = 0; i < _fileCount; i++) {
+      if (_files[i].fd != -1) {
+        close(_files[i].fd);
+        _files[i].fd = -1;
+      }
+    }
+  }
+
+  void finishRound(bool progress) {
+    struct stat st;
+    unsigned long usage = 0;
+
+    // Measured again: threads went on logging during the round.
+    if (listFiles(false)) {
+      for (int i = 0; i < _fileCount; i++) {
+        usage += _files[i].blocks;
+      }
+    }
+    if (fstat(_baseFd, &st) == 0) {
+      usage += st.st_blocks * 512;
+    }
+
+    if (!progress && usage > LowWater && !_control->stalled) {
+      fprintf(stderr, "%d: the live log data of %lu bytes does not fit NVTHREAD_LOG_BUDGET\n",
+              getpid(), usage);
+    }
+    _control->usage = usage;
+    _control->stalled = !progress && usage > LowWater;
+    __sync_add_and_fetch(&_control->round, 1);
+    futex(&_control->round, FUTEX_WAKE, INT_MAX, NULL);
+  }
+
+  // Collect the log files; with "foreign", note the ones of a crashed run.
+  bool listFiles(bool foreign) {
+    char buf[16384];
+    int dirFd = open(_path, O_RDONLY | O_DIRECTORY);
+    if (dirFd == -1) {
+      return !foreign;
+    }
+
+    _fileCount = 0;
+    if (!foreign) {
+      memset(_hash, -1, 2 * MaxFiles * sizeof(int));
+    }
+    bool fits = true;
+    long n;
+    while (fits && (n = syscall(SYS_getdents64, dirFd, buf, sizeof(buf))) > 0) {
+      for (long pos = 0; pos < n; ) {
+        struct linux_dirent64 * ent = (struct linux_dirent64 *)(buf + pos);
+        pos += ent->d_reclen;
+
+        int threadID;
+        unsigned long xactID;
+        char rest;
+        if (sscanf(ent->d_name, "MemLog_%d_%lu%c", &threadID, &xactID, &rest) != 2) {
+          continue;
+        }
+        if (foreign) {
+          if (_foreignCount == MaxFiles) {
+            fits = false;
+            break;
+          }
+          _foreign[_foreignCount++] = ent->d_ino;
+          continue;
+        }
+        if (isForeign(ent->d_ino)) {
+          continue;
+        }
+        if (_fileCount == MaxFiles) {
+          fits = false;
+          break;
+        }
+
+        struct stat st;
+        if (fstatat(dirFd, ent->d_name, &st, 0) != 0) {
+          continue;
+        }
+        struct logfile * file = &_files[_fileCount];
+        file->threadID = threadID;
+        file->xactID = xactID;
+        file->size = st.st_size;
+        file->keep = st.st_size;
+        file->blocks = st.st_blocks * 512;
+        file->fd = -1;
+        snprintf(file->name, sizeof(file->name), "%s", ent->d_name);
+        addFile(_fileCount++);
+      }
+    }
+    close(dirFd);
+    return fits;
+  }
+
+  bool isForeign(ino_t ino) {
+    for (int i = 0; i < _foreignCount; i++) {
+      if (_foreign[i] == ino) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Files are found by the 16 bit xactID of the lookup info.
+  static unsigned int hashFile(int threadID, unsigned short xactID) {
+    return ((unsigned int)threadID * 2654435761U ^ xactID) % (2 * MaxFiles);
+  }
+
+  void addFile(int index) {
+    struct logfile * file = &_files[index];
+    unsigned int slot = hashFile(file->threadID, file->xactID);
+    while (_hash[slot] != -1) {
+      struct logfile * other = &_files[_hash[slot]];
+      if (other->threadID == file->threadID && (unsigned short)other->xactID == (unsigned short)file->xactID) {
+        // Epochs 64K apart share their lookup name; neither is touched.
+        other->keep = 0;
+        file->keep = 0;
+        return;
+      }
+      slot = (slot + 1) % (2 * MaxFiles);
+    }
+    _hash[slot] = index;
+  }
+
+  struct logfile * findFile(int threadID, unsigned short xactID) {
+    unsigned int slot = hashFile(threadID, xactID);
+    while (_hash[slot] != -1) {
+      struct logfile * file = &_files[_hash[slot]];
+      if (file->threadID == threadID && (unsigned short)file->xactID == xactID) {
+        return file;
+      }
+      slot = (slot + 1) % (2 * MaxFiles);
+    }
+    return NULL;
+  }
+
+  int fileFd(struct logfile * file) {
+    if (file->fd == -1) {
+      file->fd = openat(_dirFd, file->name, O_RDWR);
+    }
+    return file->fd;
+  }
+
+  // Lookup info is updated by field, read it until two copies agree.
+  static bool readLookup(struct lookupinfo * shared, struct lookupinfo * info) {
+    for (int retry = 0; retry < 8; retry++) {
+      struct lookupinfo again;
+      memcpy(info, (void *)shared, sizeof(*info));
+      __sync_synchronize();
+      memcpy(&again, (void *)shared, sizeof(again));
+      if (memcmp(info, &again, sizeof(again)) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Keep the record, its transaction and the records a DIFF record builds on.
+  void pinRecord(int threadID, unsigned short xactID, unsigned long memlogOffset, int depth) {
+    struct logfile * file = findFile(threadID, xactID);
+    if (file == NULL || memlogOffset < LogDefines::RecordHeaderSize) {
+      return;
+    }
+    unsigned long offset = memlogOffset - LogDefines::RecordHeaderSize;
+    if (offset >= file->size) {
+      return;
+    }
+
+    char buf[sizeof(struct LogRecordHeader) + sizeof(struct LogDiffHeader)];
+    struct LogRecordHeader * header = (struct LogRecordHeader *)buf;
+    if (fileFd(file) == -1 || pread(file->fd, buf, sizeof(buf), offset) != (ssize_t)sizeof(buf)
+        || header->magic != LOG_RECORD_MAGIC || header->offset != offset || header->link > offset) {
+      file->keep = 0;
+      return;
+    }
+    if (header->link < file->keep) {
+      file->keep = header->link;
+    }
+
+#ifdef DIFF_LOGGING
+    struct LogDiffHeader * diff = (struct LogDiffHeader *)(header + 1);
+    if (header->type == LOG_RECORD_DIFF && diff->prevThreadID != 0 && depth < LogDefines::DiffChainLimit) {
+      pinRecord(diff->prevThreadID, diff->prevXactID, diff->prevOffset, depth + 1);
+    }
+#endif
+  }
+
+  // Copy the page as logged at "info" into its base image slot.
+  bool foldPage(int pageNo, struct lookupinfo * info) {
+    char buf[LogDefines::PageRecordSize];
+    struct LogRecordHeader * header = (struct LogRecordHeader *)buf;
+
+    if (!readPage(buf + LogDefines::RecordHeaderSize, info->threadID, info->xactID, pageNo,
+                  info->memlogOffset, 0)) {
+      return false;
+    }
+
+    memset(header, 0, sizeof(*header));
+    header->magic = LOG_RECORD_MAGIC;
+    header->type = LOG_RECORD_COPY;
+    header->offset = nvrecovery::BaseSlotOffset(pageNo);
+    header->length = LogDefines::PageRecordSize;
+    header->xactID = info->xactID;
+    header->link = info->memlogOffset;
+    header->pageNo = pageNo;
+    header->threadID = info->threadID;
+    header->count = LOG_RECORD_PAGE;
+    header->crc = crc32c::compute(buf, LogDefines::PageRecordSize);
+
+    if (pwrite(_baseFd, buf, sizeof(buf), header->offset) != (ssize_t)sizeof(buf)) {
+      perror("pwrite (base image): ");
+      ::abort();
+    }
+    _tags[pageNo].memlogOffset = info->memlogOffset;
+    _tags[pageNo].threadID = info->threadID;
+    _tags[pageNo].xactID = info->xactID;
+    INC_COUNTER(cleanfolded);
+    return true;
+  }
+
+  // Rebuild the whole page logged at memlogOffset into image.
+  bool readPage(char * image, int threadID, unsigned short xactID, int pageNo, unsigned long memlogOffset, int depth) {
+    char buf[LogDefines::PageRecordSize];
+    struct LogRecordHeader * header = (struct LogRecordHeader *)buf;
+    struct logfile * file = findFile(threadID, xactID);
+
+    if (file == NULL || fileFd(file) == -1 || memlogOffset < LogDefines::RecordHeaderSize
+        || !nvrecovery::ReadLogRecord(file->fd, memlogOffset - LogDefines::RecordHeaderSize, 0, buf, sizeof(buf))
+        || header->pageNo != pageNo || (unsigned short)header->xactID != xactID) {
+      // Folded in an earlier round?
+      struct foldtag * tag = &_tags[pageNo];
+      if (tag->threadID == threadID && tag->xactID == xactID && tag->memlogOffset == memlogOffset
+          && nvrecovery::ReadBaseSlot(_baseFd, buf, threadID, xactID, pageNo, memlogOffset)) {
+        memcpy(image, buf + LogDefines::RecordHeaderSize, LogDefines::PageSize);
+        return true;
+      }
+      return false;
+    }
+
+    switch (header->type) {
+    case LOG_RECORD_PAGE:
+      memcpy(image, buf + LogDefines::RecordHeaderSize, LogDefines::PageSize);
+      return true;
+    case LOG_RECORD_ZERO:
+    case LOG_RECORD_LZ:
+      return nvrecovery::UnpackLoggedPage(image, buf, header->type, pageNo, 0, LogDefines::PageSize)
+             == LogDefines::PageSize;
+#ifdef DIFF_LOGGING
+    case LOG_RECORD_DIFF: {
+      struct LogDiffHeader * diff = (struct LogDiffHeader *)(buf + LogDefines::RecordHeaderSize);
+      if (depth >= LogDefines::DiffChainLimit) {
+        return false;
+      }
+      if (diff->prevThreadID == 0) {
+        memset(image, 0, LogDefines::PageSize);
+      } else if (!readPage(image, diff->prevThreadID, diff->prevXactID, pageNo, diff->prevOffset, depth + 1)) {
+        return false;
+      }
+      return nvrecovery::ApplyDiffExtents(image, buf, 0, LogDefines::PageSize);
+    }
+#endif
+    default:
+      return false;
+    }
+  }
+
+  struct control * _control;
+  pid_t _helper;
+  char _path[FILENAME_MAX];
+  struct lookupinfo * _lookup;
+  struct lookupinfo * _lookupTmp;
+  unsigned long _pages;
+
+  // Log files of a crashed run, by inode
+  ino_t * _foreign;
+  int _foreignCount;
+
+  // Helper process only
+  int _dirFd;
+  int _baseFd;
+  struct logfile * _files;
+  int _fileCount;
+  int * _hash;
+  struct foldtag * _tags;
+};
+
+#endif
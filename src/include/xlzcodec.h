@@ -0,0 +1,215 @@
+// -*- C++ -*-
+#ifndef _XLZCODEC_H_
+#define _XLZCODEC_H_
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   xlzcodec.h
+ * @brief  A small LZ77 block codec for log page images.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* The compressed block is a list of sequences. Each one starts with a token
+ * byte: the high nibble is the number of literals, the low nibble the match
+ * length minus MinMatch; a nibble of 15 is continued by bytes added to it
+ * until one is below 255. Then come the literals, a 2 byte little endian
+ * distance back into the output and the extra match length bytes. The last
+ * sequence only has literals and ends the block.
+ *
+ * Matches are found through a hash of the next 4 bytes that keeps the last
+ * position seen, a single probe per position. Blocks are at most MaxInput
+ * bytes, so positions and distances fit in 16 bits.
+ */
+class xlzcodec {
+public:
+  enum { MaxInput = 65535 };
+
+  // Compress "length" bytes of src into dst. Returns the compressed size,
+  // 0 if it would not fit into "capacity" bytes.
+  static size_t compress(const void* src, size_t length, void* dst, size_t capacity) {
+    const unsigned char* in = (const unsigned char*)src;
+    unsigned char* out = (unsigned char*)dst;
+    unsigned char* outEnd = out + capacity;
+    uint16_t table[HashSize];
+    size_t anchor = 0;
+    size_t pos = 0;
+
+    if (length > MaxInput) {
+      return 0;
+    }
+    memset(table, 0, sizeof(table));
+
+    while (pos + MinMatch <= length) {
+      uint32_t hash = hash4(in + pos);
+      size_t ref = table[hash];
+      table[hash] = pos + 1;   // 0 is an empty slot
+      if (ref == 0 || load32(in + ref - 1) != load32(in + pos)) {
+        pos++;
+        continue;
+      }
+      ref--;
+
+      size_t match = MinMatch;
+      while (pos + match < length && in[ref + match] == in[pos + match]) {
+        match++;
+      }
+      out = putSequence(out, outEnd, in + anchor, pos - anchor, pos - ref, match);
+      if (out == NULL) {
+        return 0;
+      }
+      pos += match;
+      anchor = pos;
+    }
+
+    out = putSequence(out, outEnd, in + anchor, length - anchor, 0, 0);
+    if (out == NULL) {
+      return 0;
+    }
+    return out - (unsigned char*)dst;
+  }
+
+  // Decompress a block into exactly "length" bytes of dst. Returns false if
+  // the block is malformed or does not decode to "length" bytes.
+  static bool decompress(const void* src, size_t size, void* dst, size_t length) {
+    const unsigned char* in = (const unsigned char*)src;
+    const unsigned char* inEnd = in + size;
+    unsigned char* out = (unsigned char*)dst;
+    unsigned char* outEnd = out + length;
+
+    while (in < inEnd) {
+      unsigned token = *in++;
+      size_t literals = token >> 4;
+      if (literals == 15 && !getLength(&in, inEnd, &literals)) {
+        return false;
+      }
+      if (literals > (size_t)(inEnd - in) || literals > (size_t)(outEnd - out)) {
+        return false;
+      }
+      memcpy(out, in, literals);
+      in += literals;
+      out += literals;
+
+      if (in == inEnd) {
+        break;         // the last sequence
+      }
+      if (inEnd - in < 2) {
+        return false;
+      }
+      size_t distance = in[0] | (in[1] << 8);
+      in += 2;
+      size_t match = token & 15;
+      if (match == 15 && !getLength(&in, inEnd, &match)) {
+        return false;
+      }
+      match += MinMatch;
+      if (distance == 0 || distance > (size_t)(out - (unsigned char*)dst) || match > (size_t)(outEnd - out)) {
+        return false;
+      }
+
+      const unsigned char* ref = out - distance;
+      if (distance >= match) {
+        memcpy(out, ref, match);
+        out += match;
+      } else {
+        // Overlapping copy: repeats the last "distance" bytes.
+        while (match--) {
+          *out++ = *ref++;
+        }
+      }
+    }
+    return out == outEnd;
+  }
+
+private:
+  enum { MinMatch = 4 };
+  enum { HashBits = 12 };
+  enum { HashSize = 1 << HashBits };
+
+  static inline uint32_t load32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  static inline uint32_t hash4(const unsigned char* p) {
+    return (load32(p) * 2654435761U) >> (32 - HashBits);
+  }
+
+  // A nibble of 15 continued by bytes; NULL if out of room.
+  static unsigned char* putLength(unsigned char* out, unsigned char* outEnd, size_t value) {
+    for (value -= 15; ; value -= 255) {
+      if (out == outEnd) {
+        return NULL;
+      }
+      if (value < 255) {
+        *out++ = value;
+        return out;
+      }
+      *out++ = 255;
+    }
+  }
+
+  static bool getLength(const unsigned char** in, const unsigned char* inEnd, size_t* value) {
+    unsigned char byte;
+    do {
+      if (*in == inEnd) {
+        return false;
+      }
+      byte = *(*in)++;
+      *value += byte;
+    } while (byte == 255);
+    return true;
+  }
+
+  // Write the literals and the match (none if "match" is 0).
+  static unsigned char* putSequence(unsigned char* out, unsigned char* outEnd, const unsigned char* literals,
+                                    size_t count, size_t distance, size_t match) {
+    size_t extra = match ? match - MinMatch : 0;
+    if (out == outEnd) {
+      return NULL;
+    }
+    unsigned char* token = out++;
+    *token = ((count < 15 ? count : 15) << 4) | (extra < 15 ? extra : 15);
+
+    if (count >= 15 && (out = putLength(out, outEnd, count)) == NULL) {
+      return NULL;
+    }
+    if ((size_t)(outEnd - out) < count) {
+      return NULL;
+    }
+    memcpy(out, literals, count);
+    out += count;
+
+    if (match) {
+      if (outEnd - out < 2) {
+        return NULL;
+      }
+      *out++ = distance & 0xff;
+      *out++ = distance >> 8;
+      if (extra >= 15 && (out = putLength(out, outEnd, extra)) == NULL) {
+        return NULL;
+      }
+    }
+    return out;
+  }
+};
+
+#endif
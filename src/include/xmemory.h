@@ -153,6 +153,12 @@ public:
         _pheap.createDependenceInfo();
     }   
 
+#ifdef HEAP_IMAGE
+    static void attachHeapImage(nvrecovery *recovery){
+        _pheap.attachImage(recovery);
+    }
+#endif
+
     static void commitCacheBuffer(void){
         _globals.commitCacheBuffer();
         _pheap.commitCacheBuffer();
@@ -214,6 +220,10 @@ public:
         // Reset global and heap protection.
         _globals.begin(cleanup);
         _pheap.begin(cleanup);
+
+        // Both dirty sets are empty now, so their page entries can go.
+        if ( cleanup )
+            xpageentry::getInstance().cleanup();
     }
 
     static void mem_write(void *dest, void *val) {
@@ -237,6 +247,8 @@ public:
     }
 
     static inline void commit(bool update) {
+        // Variables named in this transaction first
+        _localNvRecovery->SyncVarMap();
         _pheap.checkandcommit(update, _localMemoryLog);
         _globals.checkandcommit(update, _localMemoryLog);
     }
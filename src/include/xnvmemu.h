@@ -0,0 +1,193 @@
+// -*- C++ -*-
+#ifndef _XNVMEMU_H_
+#define _XNVMEMU_H_
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   xnvmemu.h
+ * @brief  Emulated NVM latency and bandwidth for the log device.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define XNVMEMU_TSC
+#endif
+
+#include "xdefines.h"
+#include "prof.h"
+
+/* The logger charges every write to the log device, and every point where
+ * it makes the log durable, with the cost of an NVM device. This stands in
+ * for the dummy_nvmfs kernel module on any file system. The costs are read
+ * from the environment when the master starts:
+ *
+ *   NVTHREAD_NVM_WRITE_NS         latency of a write, as wr_delay_ns_fixed
+ *   NVTHREAD_NVM_WRITE_NS_PER_KB  latency per KB written, as wr_delay_ns_per_kb
+ *   NVTHREAD_NVM_WRITE_MBPS       write bandwidth of the device, 0 for none
+ *   NVTHREAD_NVM_FLUSH_NS         cost of a flush that makes the log durable
+ *
+ * Latencies are paid by the writing thread alone. The bandwidth is one
+ * budget for all nvthreads processes: a write reserves the next stretch of
+ * device time for its bytes and waits until that stretch ends, so writers
+ * queue behind each other as on a real device.
+ *
+ * Delays are spun on the TSC, calibrated against CLOCK_MONOTONIC once; a
+ * sleep cannot wait for the few hundred nanoseconds eval.py sweeps.
+ */
+class xnvmemu {
+public:
+  enum { CalibrationNs = 10000000 };
+
+  xnvmemu() {
+    _enabled = false;
+    _control = NULL;
+  }
+
+  static xnvmemu& getInstance(void) {
+    static char buf[sizeof(xnvmemu)];
+    static xnvmemu * theOneTrueObject = new (buf) xnvmemu();
+    return *theOneTrueObject;
+  }
+
+  // Read the costs and calibrate; called by the master before any thread.
+  void initialize(void) {
+    _writeNs = readSetting("NVTHREAD_NVM_WRITE_NS");
+    _writeNsPerKB = readSetting("NVTHREAD_NVM_WRITE_NS_PER_KB");
+    _writeMBps = readSetting("NVTHREAD_NVM_WRITE_MBPS");
+    _flushNs = readSetting("NVTHREAD_NVM_FLUSH_NS");
+    _enabled = (_writeNs || _writeNsPerKB || _writeMBps || _flushNs);
+    if (!_enabled) {
+      return;
+    }
+
+    _control = (struct control *) mmap(NULL, xdefines::PageSize, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (_control == MAP_FAILED) {
+      fprintf(stderr, "%d fail to initialize NVM emulation: %s\n", getpid(), strerror(errno));
+      ::abort();
+    }
+    _control->busyUntil = 0;
+    calibrate();
+
+    fprintf(stderr, "NVM emulation: write %lu ns + %lu ns/KB, %lu MB/s, flush %lu ns\n",
+            _writeNs, _writeNsPerKB, _writeMBps, _flushNs);
+  }
+
+  // A write of "bytes" to the log device.
+  inline void write(unsigned long bytes) {
+    if (!_enabled || bytes == 0) {
+      return;
+    }
+    uint64_t begin = now();
+    uint64_t until = begin + _writeNs + bytes * _writeNsPerKB / 1024;
+
+    if (_writeMBps != 0) {
+      // 1 MB/s moves a byte every 1000 ns.
+      uint64_t busy = bytes * 1000 / _writeMBps;
+      uint64_t reserved, end;
+      do {
+        reserved = _control->busyUntil;
+        end = ((reserved < begin) ? begin : reserved) + busy;
+      } while (!__sync_bool_compare_and_swap(&_control->busyUntil, reserved, end));
+      if (end + _writeNs > until) {
+        until = end + _writeNs;
+      }
+    }
+    spinUntil(until);
+    ADD_COUNTER(nvmdelay, now() - begin);
+  }
+
+  // A flush of what was written to the log device.
+  inline void flush(void) {
+    if (!_enabled || _flushNs == 0) {
+      return;
+    }
+    uint64_t begin = now();
+    spinUntil(begin + _flushNs);
+    ADD_COUNTER(nvmdelay, now() - begin);
+  }
+
+private:
+  struct control {
+    volatile uint64_t busyUntil;  // CLOCK_MONOTONIC ns the device is reserved to
+  };
+
+  static unsigned long readSetting(const char * name) {
+    const char * value = getenv(name);
+    return (value != NULL) ? strtoul(value, NULL, 10) : 0;
+  }
+
+  static inline uint64_t monotonic(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  // CLOCK_MONOTONIC ns, read from the TSC
+  inline uint64_t now(void) {
+#ifdef XNVMEMU_TSC
+    return _baseNs + (int64_t)((int64_t)(__rdtsc() - _baseTicks) / _ticksPerNs);
+#else
+    return monotonic();
+#endif
+  }
+
+  inline void spinUntil(uint64_t until) {
+    while (now() < until) {
+#ifdef XNVMEMU_TSC
+      _mm_pause();
+#endif
+    }
+  }
+
+  void calibrate(void) {
+#ifdef XNVMEMU_TSC
+    uint64_t ns0 = monotonic();
+    uint64_t ticks0 = __rdtsc();
+    uint64_t ns1;
+    while ((ns1 = monotonic()) - ns0 < CalibrationNs) {
+      _mm_pause();
+    }
+    uint64_t ticks1 = __rdtsc();
+    _ticksPerNs = (double)(ticks1 - ticks0) / (double)(ns1 - ns0);
+    _baseTicks = ticks1;
+    _baseNs = ns1;
+#endif
+  }
+
+  bool _enabled;
+  struct control * _control;
+  unsigned long _writeNs;
+  unsigned long _writeNsPerKB;
+  unsigned long _writeMBps;
+  unsigned long _flushNs;
+  double _ticksPerNs;
+  uint64_t _baseTicks;
+  uint64_t _baseNs;
+};
+
+#endif
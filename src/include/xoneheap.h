@@ -63,6 +63,10 @@ public:
         getHeap()->finalize();
     }
     void begin(bool cleanup) {
+#ifdef SOFTDIRTY_TRACKING
+        // Soft-dirty scans stop at the end of the allocated heap.
+        getHeap()->setUsedEnd(getHeap()->getend());
+#endif
         getHeap()->begin(cleanup);
     }
 
@@ -77,6 +81,9 @@ public:
 #endif
 
     void checkandcommit(bool update, MemoryLog *localMemoryLog) {
+#ifdef SOFTDIRTY_TRACKING
+        getHeap()->setUsedEnd(getHeap()->getend());
+#endif
         getHeap()->checkandcommit(update, localMemoryLog);
     }
 
@@ -132,6 +139,12 @@ public:
         getHeap()->createDependenceInfo();
     }
 
+#ifdef HEAP_IMAGE
+    void attachImage(nvrecovery *recovery){
+        getHeap()->attachImage(recovery);
+    }
+#endif
+
     void commitCacheBuffer(void){
         getHeap()->commitCacheBuffer();
     }
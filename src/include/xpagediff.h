@@ -0,0 +1,405 @@
+// -*- C++ -*-
+#ifndef _XPAGEDIFF_H_
+#define _XPAGEDIFF_H_
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   xpagediff.h
+ * @brief  Page diff-and-merge and compare kernels, selected by CPUID at runtime.
+ */
+
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XPAGEDIFF_X86
+#endif
+
+#include "xdefines.h"
+
+/* A merge writes every byte of "local" that differs from "twin" into "dest",
+ * and leaves the other bytes of "dest" alone. All three pointers are page
+ * aligned. The scalar kernel is only used where no SIMD kernel is available.
+ *
+ * Commits are serialized by the token, so the blend kernels may rewrite
+ * unchanged bytes of a vector with the value they just read from "dest";
+ * vectors without any difference are never stored.
+ *
+ * An equality kernel tells whether two pages are identical. It stops at the
+ * first differing vector.
+ *
+ * A mask kernel sets bit i of the MaskWords words of "mask" iff byte i of
+ * the two pages differs, for diff logging to find the modified runs.
+ */
+class xpagediff {
+public:
+  enum kernel {
+    KERNEL_SCALAR = 0,
+    KERNEL_SSE2,
+    KERNEL_AVX2,
+    KERNEL_AVX512,
+    KERNEL_NUM
+  };
+
+  typedef void (*mergeFunc)(const void * local, const void * twin, void * dest);
+  typedef bool (*equalFunc)(const void * page, const void * other);
+  typedef void (*maskFunc)(const void * page, const void * other, uint64_t * mask);
+
+  enum { MaskWords = xdefines::PageSize / 64 };
+
+  xpagediff() {
+    _kernel = best();
+    _merge = getKernel(_kernel);
+    _equal = getEqualKernel(_kernel);
+    _mask = getMaskKernel(_kernel);
+  }
+
+  static xpagediff& getInstance(void) {
+    static char buf[sizeof(xpagediff)];
+    static xpagediff * theOneTrueObject = new (buf) xpagediff();
+    return *theOneTrueObject;
+  }
+
+  // Write the bytes of local that differ from twin into dest.
+  inline void merge(const void * local, const void * twin, void * dest) {
+    _merge(local, twin, dest);
+  }
+
+  // Whether the two pages hold the same bytes.
+  inline bool equal(const void * page, const void * other) {
+    return _equal(page, other);
+  }
+
+  // One bit per byte of the pages, set where they differ.
+  inline void diffMask(const void * page, const void * other, uint64_t * mask) {
+    _mask(page, other, mask);
+  }
+
+  kernel current(void) {
+    return _kernel;
+  }
+
+  static const char * kernelName(kernel k) {
+    static const char * names[KERNEL_NUM] = { "scalar", "sse2", "avx2", "avx512" };
+    return names[k];
+  }
+
+  static bool supported(kernel k) {
+#ifdef XPAGEDIFF_X86
+    __builtin_cpu_init();
+    switch (k) {
+    case KERNEL_SCALAR:
+      return true;
+    case KERNEL_SSE2:
+      return __builtin_cpu_supports("sse2");
+    case KERNEL_AVX2:
+      return __builtin_cpu_supports("avx2");
+    case KERNEL_AVX512:
+      return __builtin_cpu_supports("avx512bw");
+    default:
+      return false;
+    }
+#else
+    return (k == KERNEL_SCALAR);
+#endif
+  }
+
+  // The kernel for k, or NULL if this cpu cannot run it.
+  static mergeFunc getKernel(kernel k) {
+    if (!supported(k)) {
+      return NULL;
+    }
+    switch (k) {
+#ifdef XPAGEDIFF_X86
+    case KERNEL_SSE2:
+      return mergeSSE2;
+    case KERNEL_AVX2:
+      return mergeAVX2;
+    case KERNEL_AVX512:
+      return mergeAVX512;
+#endif
+    default:
+      return mergeScalar;
+    }
+  }
+
+  // The equality kernel for k, or NULL if this cpu cannot run it.
+  static equalFunc getEqualKernel(kernel k) {
+    if (!supported(k)) {
+      return NULL;
+    }
+    switch (k) {
+#ifdef XPAGEDIFF_X86
+    case KERNEL_SSE2:
+      return equalSSE2;
+    case KERNEL_AVX2:
+      return equalAVX2;
+    case KERNEL_AVX512:
+      return equalAVX512;
+#endif
+    default:
+      return equalScalar;
+    }
+  }
+
+  // The mask kernel for k, or NULL if this cpu cannot run it.
+  static maskFunc getMaskKernel(kernel k) {
+    if (!supported(k)) {
+      return NULL;
+    }
+    switch (k) {
+#ifdef XPAGEDIFF_X86
+    case KERNEL_SSE2:
+      return maskSSE2;
+    case KERNEL_AVX2:
+      return maskAVX2;
+    case KERNEL_AVX512:
+      return maskAVX512;
+#endif
+    default:
+      return maskScalar;
+    }
+  }
+
+private:
+  static kernel best(void) {
+    for (int k = KERNEL_NUM - 1; k > KERNEL_SCALAR; k--) {
+      if (supported((kernel)k)) {
+        return (kernel)k;
+      }
+    }
+    return KERNEL_SCALAR;
+  }
+
+  static void mergeScalar(const void * local, const void * twin, void * dest) {
+    const uint64_t * mylocal = (const uint64_t *)local;
+    const uint64_t * mytwin = (const uint64_t *)twin;
+    uint64_t * mydest = (uint64_t *)dest;
+
+    for (size_t i = 0; i < xdefines::PageSize / sizeof(uint64_t); i++) {
+      uint64_t diff = mylocal[i] ^ mytwin[i];
+      if (diff == 0) {
+        continue;
+      }
+
+      // Spread every non-zero byte of diff into a 0xff byte mask.
+      uint64_t mask = diff | (diff >> 4);
+      mask |= mask >> 2;
+      mask |= mask >> 1;
+      mask = (mask & 0x0101010101010101ULL) * 0xff;
+
+      mydest[i] = (mydest[i] & ~mask) | (mylocal[i] & mask);
+    }
+  }
+
+  static bool equalScalar(const void * page, const void * other) {
+    const uint64_t * mypage = (const uint64_t *)page;
+    const uint64_t * myother = (const uint64_t *)other;
+
+    for (size_t i = 0; i < xdefines::PageSize / sizeof(uint64_t); i += 4) {
+      uint64_t diff = (mypage[i] ^ myother[i]) | (mypage[i + 1] ^ myother[i + 1])
+                      | (mypage[i + 2] ^ myother[i + 2]) | (mypage[i + 3] ^ myother[i + 3]);
+      if (diff != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static void maskScalar(const void * page, const void * other, uint64_t * mask) {
+    const uint64_t * mypage = (const uint64_t *)page;
+    const uint64_t * myother = (const uint64_t *)other;
+
+    for (size_t w = 0; w < MaskWords; w++) {
+      uint64_t bits = 0;
+      for (size_t j = 0; j < 8; j++) {
+        uint64_t diff = mypage[w * 8 + j] ^ myother[w * 8 + j];
+        if (diff == 0) {
+          continue;
+        }
+        // One bit per non-zero byte of diff.
+        diff |= diff >> 4;
+        diff |= diff >> 2;
+        diff |= diff >> 1;
+        diff &= 0x0101010101010101ULL;
+        bits |= ((diff * 0x0102040810204080ULL) >> 56) << (j * 8);
+      }
+      mask[w] = bits;
+    }
+  }
+
+#ifdef XPAGEDIFF_X86
+  __attribute__((target("sse2")))
+  static void mergeSSE2(const void * local, const void * twin, void * dest) {
+    const __m128i * localbuf = (const __m128i *)local;
+    const __m128i * twinbuf = (const __m128i *)twin;
+    __m128i * destbuf = (__m128i *)dest;
+
+    for (size_t i = 0; i < xdefines::PageSize / sizeof(__m128i); i++) {
+      __m128i localChunk = _mm_load_si128(&localbuf[i]);
+      __m128i eqChunk = _mm_cmpeq_epi8(localChunk, _mm_load_si128(&twinbuf[i]));
+
+      if (_mm_movemask_epi8(eqChunk) == 0xFFFF) {
+        continue;
+      }
+
+      // Keep dest where equal, take local where different.
+      __m128i destChunk = _mm_load_si128(&destbuf[i]);
+      destChunk = _mm_or_si128(_mm_and_si128(eqChunk, destChunk),
+                               _mm_andnot_si128(eqChunk, localChunk));
+      _mm_store_si128(&destbuf[i], destChunk);
+    }
+  }
+
+  __attribute__((target("avx2")))
+  static void mergeAVX2(const void * local, const void * twin, void * dest) {
+    const __m256i * localbuf = (const __m256i *)local;
+    const __m256i * twinbuf = (const __m256i *)twin;
+    __m256i * destbuf = (__m256i *)dest;
+
+    for (size_t i = 0; i < xdefines::PageSize / sizeof(__m256i); i++) {
+      __m256i localChunk = _mm256_load_si256(&localbuf[i]);
+      __m256i eqChunk = _mm256_cmpeq_epi8(localChunk, _mm256_load_si256(&twinbuf[i]));
+
+      if ((unsigned)_mm256_movemask_epi8(eqChunk) == 0xFFFFFFFFU) {
+        continue;
+      }
+
+      __m256i destChunk = _mm256_load_si256(&destbuf[i]);
+      _mm256_store_si256(&destbuf[i], _mm256_blendv_epi8(localChunk, destChunk, eqChunk));
+    }
+  }
+
+  // AVX-512BW has a real byte-masked store, so only changed bytes are written.
+  __attribute__((target("avx512f,avx512bw")))
+  static void mergeAVX512(const void * local, const void * twin, void * dest) {
+    const char * localbuf = (const char *)local;
+    const char * twinbuf = (const char *)twin;
+    char * destbuf = (char *)dest;
+
+    for (size_t i = 0; i < xdefines::PageSize; i += 64) {
+      __m512i localChunk = _mm512_load_si512((const void *)&localbuf[i]);
+      __mmask64 neq = _mm512_cmpneq_epi8_mask(localChunk, _mm512_load_si512((const void *)&twinbuf[i]));
+
+      if (neq) {
+        _mm512_mask_storeu_epi8(&destbuf[i], neq, localChunk);
+      }
+    }
+  }
+
+  // The equality kernels check a cache line per iteration.
+  __attribute__((target("sse2")))
+  static bool equalSSE2(const void * page, const void * other) {
+    const __m128i * pagebuf = (const __m128i *)page;
+    const __m128i * otherbuf = (const __m128i *)other;
+
+    for (size_t i = 0; i < xdefines::PageSize / sizeof(__m128i); i += 4) {
+      __m128i diff = _mm_or_si128(
+          _mm_or_si128(_mm_xor_si128(_mm_load_si128(&pagebuf[i]), _mm_load_si128(&otherbuf[i])),
+                       _mm_xor_si128(_mm_load_si128(&pagebuf[i + 1]), _mm_load_si128(&otherbuf[i + 1]))),
+          _mm_or_si128(_mm_xor_si128(_mm_load_si128(&pagebuf[i + 2]), _mm_load_si128(&otherbuf[i + 2])),
+                       _mm_xor_si128(_mm_load_si128(&pagebuf[i + 3]), _mm_load_si128(&otherbuf[i + 3]))));
+
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  __attribute__((target("avx2")))
+  static bool equalAVX2(const void * page, const void * other) {
+    const __m256i * pagebuf = (const __m256i *)page;
+    const __m256i * otherbuf = (const __m256i *)other;
+
+    for (size_t i = 0; i < xdefines::PageSize / sizeof(__m256i); i += 2) {
+      __m256i diff = _mm256_or_si256(
+          _mm256_xor_si256(_mm256_load_si256(&pagebuf[i]), _mm256_load_si256(&otherbuf[i])),
+          _mm256_xor_si256(_mm256_load_si256(&pagebuf[i + 1]), _mm256_load_si256(&otherbuf[i + 1])));
+
+      if (!_mm256_testz_si256(diff, diff)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  __attribute__((target("avx512f,avx512bw")))
+  static bool equalAVX512(const void * page, const void * other) {
+    const char * pagebuf = (const char *)page;
+    const char * otherbuf = (const char *)other;
+
+    for (size_t i = 0; i < xdefines::PageSize; i += 64) {
+      if (_mm512_cmpneq_epi64_mask(_mm512_load_si512((const void *)&pagebuf[i]),
+                                   _mm512_load_si512((const void *)&otherbuf[i]))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // The mask kernels produce one 64-bit word per cache line.
+  __attribute__((target("sse2")))
+  static void maskSSE2(const void * page, const void * other, uint64_t * mask) {
+    const __m128i * pagebuf = (const __m128i *)page;
+    const __m128i * otherbuf = (const __m128i *)other;
+
+    for (size_t w = 0; w < MaskWords; w++) {
+      uint64_t bits = 0;
+      for (size_t j = 0; j < 4; j++) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_load_si128(&pagebuf[w * 4 + j]), _mm_load_si128(&otherbuf[w * 4 + j]));
+        bits |= (uint64_t)(~_mm_movemask_epi8(eq) & 0xFFFF) << (j * 16);
+      }
+      mask[w] = bits;
+    }
+  }
+
+  __attribute__((target("avx2")))
+  static void maskAVX2(const void * page, const void * other, uint64_t * mask) {
+    const __m256i * pagebuf = (const __m256i *)page;
+    const __m256i * otherbuf = (const __m256i *)other;
+
+    for (size_t w = 0; w < MaskWords; w++) {
+      __m256i eq0 = _mm256_cmpeq_epi8(_mm256_load_si256(&pagebuf[w * 2]), _mm256_load_si256(&otherbuf[w * 2]));
+      __m256i eq1 = _mm256_cmpeq_epi8(_mm256_load_si256(&pagebuf[w * 2 + 1]), _mm256_load_si256(&otherbuf[w * 2 + 1]));
+      uint64_t bits = (uint64_t)(unsigned)_mm256_movemask_epi8(eq0) | ((uint64_t)(unsigned)_mm256_movemask_epi8(eq1) << 32);
+      mask[w] = ~bits;
+    }
+  }
+
+  __attribute__((target("avx512f,avx512bw")))
+  static void maskAVX512(const void * page, const void * other, uint64_t * mask) {
+    const char * pagebuf = (const char *)page;
+    const char * otherbuf = (const char *)other;
+
+    for (size_t w = 0; w < MaskWords; w++) {
+      mask[w] = _mm512_cmpneq_epi8_mask(_mm512_load_si512((const void *)&pagebuf[w * 64]),
+                                        _mm512_load_si512((const void *)&otherbuf[w * 64]));
+    }
+  }
+#endif
+
+  kernel _kernel;
+  mergeFunc _merge;
+  equalFunc _equal;
+  maskFunc _mask;
+};
+
+#endif
@@ -32,29 +32,31 @@
 #endif
 
 #include <stdlib.h>
+#include <sys/mman.h>
 
 #include "xdefines.h"
 #include "xpageinfo.h"
 
 /* This class is used to manage the page entries.
  * Page fault handler will ask for one page entry here.
- * Normally, we will keep 256 pages entries. If the page entry 
- * is not enough, then we can allocate 64 more, but those will be
- * freed in atomicEnd() to avoid unnecessary memory blowup.
+ * The entries for every page of the heap and globals are reserved up front
+ * with MAP_NORESERVE, so an entry costs memory only once it is used and
+ * alloc() never maps or prints: it runs in the fault path. Entries up to
+ * PAGE_ENTRY_TARGET are kept for the next transaction, the ones beyond it
+ * are released again in cleanup(), on the owner, to avoid memory blowup.
  * Since one process will have one own copy of this and it is served
  * for one process only, memory can be allocated from private heap.
  */
 class xpageentry {
 	enum {
-		PAGE_ENTRY_NUM = 800000
-//		PAGE_ENTRY_NUM = 2000000
+		// Every page of the heap and globals dirty at once.
+		MAX_ENTRIES = (xdefines::PROTECTEDHEAP_SIZE + xdefines::MAX_GLOBALS_SIZE) / xdefines::PageSize
 	};
-//    unsigned long long PAGE_ENTRY_NUM;
 public:
 	xpageentry() {
 		_start = NULL;
 		_cur = 0;
-		_total = 0;
+		_warned = false;
 	}
 
 	static xpageentry& getInstance(void) {
@@ -64,63 +66,66 @@ public:
 	}
 
 	void initialize(void) {
-		void * start;
-		struct xpageinfo * cur;
-		int i = 0;
-		unsigned long pagestart;
-
-//  	PAGE_ENTRY_NUM = 0xffffff;
-//        PAGE_ENTRY_NUM = 0xfffffff; // hang
-		// We don't need to allocate all pages, only the difference between newnum and oldnum.
-		start = mmap(NULL, PAGE_ENTRY_NUM * sizeof(xpageinfo), PROT_READ
-				| PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-		if (start == NULL) {
+		void * start = mmap(NULL, MAX_ENTRIES * sizeof(struct xpageinfo), PROT_READ
+				| PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (start == MAP_FAILED) {
 			fprintf(stderr, "%d fail to allocate page entries : %s\n",
 					getpid(), strerror(errno));
 			::abort();
 		}
 
 		// start to initialize it.
-		_cur = 0;
-		_total = PAGE_ENTRY_NUM;
 		_start = (struct xpageinfo *) start;
-		return;
+		_cur = 0;
+		_warned = false;
 	}
 
 	struct xpageinfo * alloc(void) {
-		struct xpageinfo * entry = NULL;
-		if (_cur < _total) {
-			entry = &_start[_cur];
-			_cur++;
-		} else {
-			// There is no enough entry now, re-allocate new entries now.
-			fprintf(stderr,
-					"NO enough page entry, now _cur %llux, _total %llux!!!\n", _cur,
-					_total);
+		// Cannot happen: a page has one entry per transaction.
+		if (_cur >= MAX_ENTRIES) {
 			::abort();
 		}
-		return entry;
+		return &_start[_cur++];
 	}
 
-    void cleanup(void) {
+	// Release the entries of the last transaction.
+	void cleanup(void) {
+		if (_cur > xdefines::PAGE_ENTRY_TARGET) {
+			if (!_warned) {
+				fprintf(stderr, "%d: more than %d dirty pages in one transaction, page entries are growing\n",
+						getpid(), (int)xdefines::PAGE_ENTRY_TARGET);
+				_warned = true;
+			}
+
+			// Whole pages of entries past the target go back to the kernel.
+			uintptr_t from = ((uintptr_t)&_start[xdefines::PAGE_ENTRY_TARGET] + xdefines::PageSize - 1)
+					& ~(uintptr_t)(xdefines::PageSize - 1);
+			uintptr_t to = (uintptr_t)&_start[_cur];
+			if (to > from) {
+				madvise((void *)from, to - from, MADV_DONTNEED);
+			}
+			ADD_COUNTER(pageentrychunks, (_cur - xdefines::PAGE_ENTRY_TARGET + xdefines::PAGE_ENTRY_CHUNK - 1)
+					/ xdefines::PAGE_ENTRY_CHUNK);
+		}
 		_cur = 0;
 	}
 
-    unsigned long long getCur(void) {
-        return _cur;
-    }
+	unsigned long long getCur(void) {
+		return _cur;
+	}
+
+	unsigned long long getPAGE_ENTRY_NUM(void){
+		return xdefines::PAGE_ENTRY_TARGET;
+	}
 
-    unsigned long long getPAGE_ENTRY_NUM(void){
-        return PAGE_ENTRY_NUM;
-    }
 private:
-	// How many entries in total.
-    unsigned long long _total;
+	struct xpageinfo * _start;
 
 	// Current index of entry that need to be allocated.
 	unsigned long long _cur;
 
-	struct xpageinfo * _start;
+	// Whether growing past the target has been reported.
+	bool _warned;
 };
 
 #endif
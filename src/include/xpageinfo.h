@@ -13,6 +13,10 @@ struct xpageinfo {
 	bool isShared;
     bool isLogged;
 	bool release;
+	// Left byte-identical to what it was committed against.
+	bool isSilent;
+	// Committed by a commit helper; the owner still updates the frame.
+	bool needsUpdate;
 };
 
 #endif /* __XPAGEINFO_H__ */
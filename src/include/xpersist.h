@@ -60,7 +60,6 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <xmmintrin.h>
 
 #include "xatomic.h"
 #include "heaplayers/ansiwrapper.h"
@@ -74,6 +73,19 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "debug.h"
 
 #include "xpageentry.h"
+#include "xdirtyset.h"
+#include "xworkers.h"
+#include "xuffd.h"
+
+#if defined(UFFD_TRACKING) && defined(LAZY_COMMIT)
+#error "UFFD_TRACKING does not support LAZY_COMMIT"
+#endif
+#include "xsoftdirty.h"
+
+#if defined(SOFTDIRTY_TRACKING) && (defined(LAZY_COMMIT) || defined(UFFD_TRACKING))
+#error "SOFTDIRTY_TRACKING does not support LAZY_COMMIT or UFFD_TRACKING"
+#endif
+#include "xpagediff.h"
 
 #include "logger.h"
 
@@ -84,6 +96,27 @@ int madvise(caddr_t addr, size_t len, int advice);
 
 #include "nvrecovery.h"
 
+#ifdef HEAP_IMAGE
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "xheapimage.h"
+
+#ifdef LAZY_COMMIT
+#error "HEAP_IMAGE does not support LAZY_COMMIT"
+#endif
+#ifdef X86_32BIT
+#error "HEAP_IMAGE needs a 64-bit address space"
+#endif
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+#endif
+
+#ifdef LOG_CLEANER
+#include "xlogcleaner.h"
+#endif
+
 /**
  * @class xpersist
  * @brief Makes a range of memory persistent and consistent.
@@ -117,6 +150,11 @@ class xpersist {
     // Get a temporary file name (which had better not be NFS-mounted...).
     char _backingFname[FILENAME_MAX];
     sprintf(_backingFname, "/tmp/nvthreadsMXXXXXX");
+#ifdef UFFD_TRACKING
+    // Write-protect tracking requires a shmem backing file.
+    _backingFd = memfd_create("nvthreadsM", 0);
+    if (_backingFd == -1)
+#endif
     _backingFd = mkstemp(_backingFname);
     if (_backingFd == -1) {
       fprintf(stderr, "Failed to make persistent file.\n");
@@ -180,19 +218,72 @@ class xpersist {
     // The transient map is private and optionally fixed at the desired start address for globals.
     // In order to get the same copy with _persistentMemory for those constructor stuff,
     // we will set to MAP_PRIVATE at first, then memory protection will be opened in initialize().
-    _transientMemory = (Type*)mmap(_startaddr, size(),
-                                   PROT_READ | PROT_WRITE, MAP_SHARED | (_startaddr != NULL ? MAP_FIXED : 0),
+    void* start = _startaddr;
+    int fixed = (_startaddr != NULL ? MAP_FIXED : 0);
+#ifdef HEAP_IMAGE
+    // The heap image is mapped where the heap was in the crashed run.
+    if (_isHeap) {
+      start = (void*)xdefines::HEAP_IMAGE_BASE;
+      fixed = MAP_FIXED_NOREPLACE;
+    }
+    _imageHeader = NULL;
+    _imageStamps = NULL;
+    _imageLogged = NULL;
+#endif
+    _transientMemory = (Type*)mmap(start, size(),
+                                   PROT_READ | PROT_WRITE, MAP_SHARED | fixed,
                                    _backingFd, 0);
 
     if (_transientMemory == MAP_FAILED) {
       fprintf(stderr, "arguments = %p, %ld, %d, %d, %d\n",
-              _startaddr, size(), PROT_READ | PROT_WRITE, MAP_SHARED | (_startaddr != NULL ? MAP_FIXED : 0), _backingFd);
+              start, size(), PROT_READ | PROT_WRITE, MAP_SHARED | fixed, _backingFd);
       perror("Transient memory creation:");
       ::abort();
     }
+#ifdef HEAP_IMAGE
+    // Kernels before 4.17 take MAP_FIXED_NOREPLACE as a hint.
+    if (_isHeap && (void*)_transientMemory != start) {
+      fprintf(stderr, "Heap image base %p is taken, the heap was mapped at %p\n", start, _transientMemory);
+      ::abort();
+    }
+#endif
 
     _isProtected = false;
 
+#ifdef PARALLEL_COMMIT
+    _commitPages = NULL;
+    _deferUpdates = false;
+#endif
+
+#ifdef UFFD_TRACKING
+    _uffdTracking = false;
+    _armedChunks = (unsigned char*)mmap(NULL, TotalPageNums / xdefines::UFFD_ARM_PAGES + 1,
+                                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    _trackedCount = 0;
+    _trackedPages = (struct trackedpage*)mmap(NULL, TotalPageNums * sizeof(struct trackedpage),
+                                              PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (_armedChunks == MAP_FAILED || _trackedPages == MAP_FAILED) {
+      fprintf(stderr, "xpersist: mmap error with %s\n", strerror(errno));
+      ::abort();
+    }
+#endif
+
+#ifdef SOFTDIRTY_TRACKING
+    _softDirty = false;
+    _softStarted = false;
+    _switchVotes = 0;
+    _softPages = 0;
+    _usedPages = (_startsize + xdefines::PageSize - 1) / xdefines::PageSize;
+    _softState = (struct softstate*)mmap(NULL, sizeof(struct softstate),
+                                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    _pageStamps = (volatile unsigned long*)mmap(NULL, TotalPageNums * sizeof(unsigned long),
+                                                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (_softState == MAP_FAILED || _pageStamps == MAP_FAILED) {
+      fprintf(stderr, "xpersist: mmap error with %s\n", strerror(errno));
+      ::abort();
+    }
+#endif
+
     DEBUG("xpersist intialize: transient = %p, persistent = %p, size = %x", _transientMemory, _persistentMemory, size());
 
     // We are trying to use page's version number to speedup the commit phase.
@@ -237,16 +328,26 @@ class xpersist {
                                                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
 #endif
 
-    lprintf("initialized xpersist, dirtyListPages: %p, is_Heap: %d\n", &_dirtiedPagesList, _isHeap);
+    _dirtiedPages.initialize(TotalPageNums);
+
+#ifndef LAZY_COMMIT
+    _retainedCount = 0;
+    _retainedVersions = (unsigned long*)mmap(NULL, TotalPageNums * sizeof(unsigned long), PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    _retainedPages = (int*)mmap(NULL, TotalPageNums * sizeof(int), PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (_retainedVersions == MAP_FAILED || _retainedPages == MAP_FAILED) {
+      fprintf(stderr, "xpersist: mmap error with %s\n", strerror(errno));
+      ::abort();
+    }
+#endif
+
+    lprintf("initialized xpersist, dirtyPages: %p, is_Heap: %d\n", &_dirtiedPages, _isHeap);
   }
 
   void initialize() {
-    // A string of one bits.
-    allones = _mm_setzero_si128();
-    allones = _mm_cmpeq_epi32(allones, allones);
-
     // Clean the ownership.
-    _dirtiedPagesList.clear();
+    _dirtiedPages.clear();
   }
 
   void finalize() {
@@ -288,6 +389,10 @@ class xpersist {
       fprintf(stderr, "start %p size %ld!!!\n", start, size);
       exit(-1);
     }
+#ifdef LAZY_RECOVERY
+    // The new mapping has to take the faults of pages not restored yet
+    xlazyrecovery::getInstance().remapped(start, size);
+#endif
     return (area);
   }
 
@@ -303,6 +408,9 @@ class xpersist {
       fprintf(stderr, "Weird, %d remove protect failed!!!\n", getpid());
       exit(-1);
     }
+#ifdef LAZY_RECOVERY
+    xlazyrecovery::getInstance().remapped(start, size);
+#endif
     return (area);
   }
 
@@ -353,6 +461,16 @@ class xpersist {
 #else
     writeProtect(base(), size());
     _isProtected = true;
+#ifdef UFFD_TRACKING
+    startTracking();
+#endif
+    forgetRetained();
+#ifdef SOFTDIRTY_TRACKING
+    // Every region starts with fault-based tracking.
+    _softDirty = false;
+    _softPages = 0;
+    _switchVotes = 0;
+#endif
 #endif
 
 
@@ -371,6 +489,20 @@ class xpersist {
   }
 
   void closeProtection() {
+#ifdef UFFD_TRACKING
+    if (_uffdTracking) {
+      xuffd::getInstance().unregisterRange(base());
+      _uffdTracking = false;
+    }
+#endif
+#ifdef SOFTDIRTY_TRACKING
+    _softDirty = false;
+    _softPages = 0;
+#endif
+#ifndef LAZY_COMMIT
+    // Remapping drops all private copies.
+    forgetRetained();
+#endif
     removeProtect(base(), size());
     _isProtected = false;
   }
@@ -414,6 +546,105 @@ class xpersist {
     return fd;
   }
 
+#ifdef HEAP_IMAGE
+  // Back the heap with the image file in the log path, see xheapimage.h.
+  // After a crash the image of the crashed run is mapped instead and
+  // brought up to date from the log. Returns the end of the memory handed
+  // out by xheap, "position" for a new image.
+  void* attachImage(nvrecovery* recovery, void* position) {
+    char fn[FILENAME_MAX];
+    char bootID[sizeof(_imageHeader->bootID)];
+    size_t length = xheapimage::fileSize(size());
+    struct heapimageheader header;
+
+    sprintf(fn, "%sheap_image", logPath);
+    int fd = open(fn, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+      fprintf(stderr, "Failed to open heap image %s: %s\n", fn, strerror(errno));
+      ::abort();
+    }
+
+    struct stat st;
+    bool reuse = recovery->isCrashed() && fstat(fd, &st) == 0 && (size_t)st.st_size == length
+                 && pread(fd, &header, sizeof(header), size()) == sizeof(header)
+                 && header.magic == HEAP_IMAGE_MAGIC && header.base == (uint64_t)base()
+                 && header.size == size();
+    if (!reuse) {
+      if (recovery->isCrashed()) {
+        fprintf(stderr, "%s does not hold this heap, starting a new image\n", fn);
+      }
+      // Start from what the heap holds so far.
+      if (ftruncate(fd, 0) != 0 || ftruncate(fd, length) != 0
+          || pwrite(fd, _persistentMemory, (char*)position - (char*)base(), 0) < 0) {
+        fprintf(stderr, "Failed to size heap image %s: %s\n", fn, strerror(errno));
+        ::abort();
+      }
+    }
+
+    _imageHeader = (struct heapimageheader*)mmap(NULL, xheapimage::headerSize(size()), PROT_READ | PROT_WRITE,
+                                                 MAP_SHARED, fd, size());
+    _imageLogged = (unsigned long*)mmap(NULL, TotalPageNums * sizeof(unsigned long), PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (_imageHeader == MAP_FAILED || _imageLogged == MAP_FAILED
+        || mmap(_persistentMemory, size(), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(_transientMemory, size(), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+      fprintf(stderr, "Failed to map heap image %s: %s\n", fn, strerror(errno));
+      ::abort();
+    }
+    _imageStamps = (struct heapimagestamp*)((char*)_imageHeader + xdefines::PageSize);
+    close(_backingFd);
+    _backingFd = fd;
+
+    xheapimage::readBootID(bootID, sizeof(bootID));
+    if (reuse) {
+      recovery->RestoreHeapImage((char*)base(), (char*)_persistentMemory, fd, _imageStamps,
+                                 bootID[0] != '\0' && strcmp(bootID, _imageHeader->bootID) == 0);
+      if ((char*)base() + _imageHeader->position > (char*)position) {
+        position = (char*)base() + _imageHeader->position;
+      }
+    }
+
+    _imageHeader->magic = HEAP_IMAGE_MAGIC;
+    _imageHeader->base = (uint64_t)base();
+    _imageHeader->size = size();
+    _imageHeader->position = (char*)position - (char*)base();
+    memcpy(_imageHeader->bootID, bootID, sizeof(bootID));
+    lprintf("Heap image %s attached, %s, position %p\n", fn, reuse ? "restored" : "new", position);
+    return position;
+  }
+
+  // Record the end of the memory handed out by xheap.
+  inline void setImagePosition(void* position) {
+    if (_imageHeader != NULL) {
+      _imageHeader->position = (char*)position - (char*)base();
+    }
+  }
+
+  // Pages the commit is about to write no longer hold what their stamps name.
+  void clearImageStamps(void) {
+    for (xdirtyset::iterator i = _dirtiedPages.begin(); i != _dirtiedPages.end(); ++i) {
+      if (!(*i)->isSilent) {
+        _imageStamps[(*i)->pageNo].valid = 0;
+      }
+    }
+  }
+
+  // Stamp the written pages that were logged by this commit.
+  void stampImagePages(int threadID, unsigned short xactID) {
+    for (xdirtyset::iterator i = _dirtiedPages.begin(); i != _dirtiedPages.end(); ++i) {
+      int pageNo = (*i)->pageNo;
+      if (_imageLogged[pageNo] != 0) {
+        struct heapimagestamp* stamp = &_imageStamps[pageNo];
+        stamp->threadID = threadID;
+        stamp->xactID = xactID;
+        stamp->memlogOffset = _imageLogged[pageNo];
+        stamp->valid = 1;
+        _imageLogged[pageNo] = 0;
+      }
+    }
+  }
+#endif
+
   // Create a quick reference to lookup the buffered pageInfo when commit the tmp pageInfo
   void createPageNoTmp(void) {
     if (!logPath) {
@@ -501,6 +732,12 @@ class xpersist {
 
     // Create a quick reference to lookup the buffered pageInfo when commit the tmp pageInfo
     createPageNoTmp();
+
+#ifdef LOG_CLEANER
+    if (_isHeap) {
+      xlogcleaner::getInstance().setLookup(_pageLookup, _pageLookupTmp, TotalPageNums);
+    }
+#endif
   }
 
   // Create page dependence info to store which thread last touched a page
@@ -678,7 +915,22 @@ class xpersist {
 #else
     unsigned long* pageStart = (unsigned long*)((intptr_t)_transientMemory + (unsigned long)xdefines::PageSize * pageNo);
 #endif
-    struct xpageinfo* curr = NULL;
+
+#ifdef UFFD_TRACKING
+    // Writes into an armed chunk only get here for a page kept read-only
+    // with a retained copy, see updatePage(). Anywhere else, arm the chunk
+    // and let the write fault again through the userfaultfd.
+    if (_uffdTracking) {
+      if (!_armedChunks[pageNo / xdefines::UFFD_ARM_PAGES]) {
+        armChunk(pageNo);
+        return;
+      }
+      INC_COUNTER(faults);
+      recordDirtyPage(pageNo, pageStart);
+      mprotectWrite(pageStart, pageNo);
+      return;
+    }
+#endif
 
 #ifdef LAZY_COMMIT
     // Check the access type of this page.
@@ -713,32 +965,70 @@ class xpersist {
     mprotectWrite(pageStart, pageNo);
 #endif
 
-    // Now one more user are using this page.
-    xatomic::increment((unsigned long*)&_pageUsers[pageNo]);
+    INC_COUNTER(faults);
+    recordDirtyPage(pageNo, pageStart);
+  }
+
+  // Add a page that is about to be written to the dirty set.
+  inline struct xpageinfo* recordDirtyPage(int pageNo, unsigned long* pageStart) {
+    struct xpageinfo* curr = NULL;
+
+    // A page faulting again in the same transaction keeps its entry.
+    curr = _dirtiedPages.find(pageNo);
+    bool isNew = (curr == NULL);
+
+    if (isNew) {
+      // Now one more user are using this page.
+      xatomic::increment((unsigned long*)&_pageUsers[pageNo]);
 
-    // Add this page to the dirty set.
-    curr = xpageentry::getInstance().alloc();
+      curr = xpageentry::getInstance().alloc();
+    }
+
+    setPageInfo(curr, pageNo, pageStart, _persistentVersions[pageNo]);
+
+#ifndef LAZY_COMMIT
+    // Users were counted before the version was read, so a copy that is
+    // still current now stays a valid base for the commit. This runs on the
+    // faulting thread: with UFFD_TRACKING retained pages are read-only and
+    // fault through handleWrite(), never through the handler thread.
+    if (isNew && _retainedVersions[pageNo] != 0) {
+      if (_retainedVersions[pageNo] != curr->version + 1) {
+        madvise(pageStart, xdefines::PageSize, MADV_DONTNEED);
+        INC_COUNTER(retaindrops);
+      }
+      _retainedVersions[pageNo] = 0;
+    }
+#endif
+
+    INC_COUNTER(dirtypage_inserted);
+
+    // Then add current page to dirty set.
+    if (isNew) {
+      _dirtiedPages.insert(curr);
+    }
+    return curr;
+  }
+
+
+  inline void setPageInfo(struct xpageinfo* curr, int pageNo, void* pageStart, int version) {
     curr->pageNo = pageNo;
-    curr->pageStart = (void*)pageStart;
+    curr->pageStart = pageStart;
     curr->isUpdated = 0;
     curr->isLogged = 0;
+    curr->isSilent = false;
+    curr->needsUpdate = false;
     curr->diriedBy = getpid();
 #ifndef LAZY_COMMIT
     curr->release = true;
 #endif
-    curr->version = _persistentVersions[pageNo];
-
-    INC_COUNTER(faults);
-    INC_COUNTER(dirtypage_inserted);
-
-    // Then add current page to dirty list.
-    _dirtiedPagesList.insert(std::pair<int, void*>(pageNo, curr));
-    return;
+    curr->version = version;
   }
 
-
   bool nop() {
-    return (_dirtiedPagesList.empty());
+#ifdef UFFD_TRACKING
+    takeTrackedPages();
+#endif
+    return (_dirtiedPages.empty());
   }
 
   /// @brief Commit dirtied pages before open protection
@@ -748,61 +1038,24 @@ class xpersist {
 
   /// @brief Start a transaction.
   inline void begin(bool cleanup) {
+#ifdef SOFTDIRTY_TRACKING
+    size_t dirtied = _dirtiedPages.size();
+#endif
+
     // Update all pages related in this dirty page list
     updateAll(cleanup);
-  }
 
-#ifndef SSE_SUPPORT
-  inline void commitWord(char* src, char* twin, char* dest) {
-    for (int i = 0; i < sizeof(long long); i++) {
-      if (src[i] != twin[i]) {
-        TRACE("%d: Write %d-th byte.  src: %p, twin: %p, dest: %p\n", getpid(), i, src[i], twin[i], dest[i]);
-        dest[i] = src[i];
-      }
+#ifdef SOFTDIRTY_TRACKING
+    if (_isProtected) {
+      chooseTracking(dirtied);
     }
-  }
 #endif
+  }
+
   // Write those difference between local and twin to the destination.
   inline void writePageDiffs(const void* local, const void* twin,
                              void* dest, int pageno) {
-
-#ifdef SSE_SUPPORT
-    // Now we are using the SSE3 instructions to speedup the commits.
-    __m128i* localbuf = (__m128i*)local;
-    __m128i* twinbuf = (__m128i*)twin;
-    __m128i* destbuf = (__m128i*)dest;
-    // Some vectorizing pragamata here; not sure if gcc implements them.
-#pragma vector always
-    for (int i = 0; i < xdefines::PageSize / sizeof(__m128i); i++) {
-
-      __m128i localChunk, twinChunk, destChunk;
-
-      localChunk = _mm_load_si128(&localbuf[i]);
-      twinChunk = _mm_load_si128(&twinbuf[i]);
-
-      // Compare the local and twin byte-wise.
-      __m128i eqChunk = _mm_cmpeq_epi8(localChunk, twinChunk);
-
-      // Invert the bits by XORing them with ones.
-      __m128i neqChunk = _mm_xor_si128(allones, eqChunk);
-
-      // Write local pieces into destbuf everywhere diffs.
-      _mm_maskmoveu_si128(localChunk, neqChunk, (char*)&destbuf[i]);
-    }
-#else
-    /* If hardware can't support SSE3 instructions, use slow commits as following. */
-    long long* mylocal = (long long*)local;
-    long long* mytwin = (long long*)twin;
-    long long* mydest = (long long*)dest;
-
-    for (int i = 0; i < xdefines::PageSize / sizeof(long long); i++) {
-      if (mylocal[i] != mytwin[i]) {
-        commitWord((char*)&mylocal[i], (char*)&mytwin[i], (char*)&mydest[i]);
-      }
-    }
-
-
-#endif
+    xpagediff::getInstance().merge(local, twin, dest);
   }
 
   /* For page density profiling */
@@ -847,6 +1100,7 @@ class xpersist {
     assert(index != 0);
 
     shareinfo->bitmapIndex = index;
+    shareinfo->twinEpoch = xbitmap::getInstance().epoch();
 
     //Create the "shared-twin-page" for them
     twin = (unsigned long*)xbitmap::getInstance().getAddress(index);
@@ -981,12 +1235,23 @@ class xpersist {
       endpage = _ownedblockinfo[i * 2 + 1];
 
       if (release) {
+        // Private copies are released once per run of owned pages.
+        int runStart = -1;
         for (j = startpage; j < endpage; j++) {
-          int accessType = _pageInfo[j];
           if (_pageOwner[j] == getpid()) {
-            commitOwnedPage(j, true);
+            commitOwnedPage(j, false);
+            setSharedPage(j);
+            if (runStart < 0) {
+              runStart = j;
+            }
+          } else if (runStart >= 0) {
+            releaseRange(runStart, j);
+            runStart = -1;
           }
         }
+        if (runStart >= 0) {
+          releaseRange(runStart, endpage);
+        }
       } else {
         // We do not release the private copy when one thread is exit in order to improve the performance.
         for (j = startpage; j < endpage; j++) {
@@ -1001,9 +1266,19 @@ class xpersist {
   }
 #endif
 
+  // Drop the private copies of [startPage, endPage); nothing if startPage is negative.
+  inline void releaseRange(int startPage, int endPage) {
+    if (startPage < 0) {
+      return;
+    }
+    madvise(getPageStart(startPage), (size_t)(endPage - startPage) * xdefines::PageSize, MADV_DONTNEED);
+    INC_COUNTER(updatecalls);
+    ADD_COUNTER(updatepages, endPage - startPage);
+  }
+
   // Get the start address of specified page.
   inline void* getPageStart(int pageNo) {
-    return ((void*)((intptr_t)base() + pageNo * xdefines::PageSize));
+    return ((void*)((intptr_t)base() + (size_t)pageNo * xdefines::PageSize));
   }
 
   // Print all the dirty pages so far to stdout
@@ -1012,8 +1287,8 @@ class xpersist {
     int pageNo;
     int cnt = 0;
     printf("-----------%d dump dirtied pages-------------\n", getpid());
-    for (dirtyListType::iterator i = _dirtiedPagesList.begin(); i != _dirtiedPagesList.end(); ++i) {
-      pageinfo = (struct xpageinfo*)i->second;
+    for (xdirtyset::iterator i = _dirtiedPages.begin(); i != _dirtiedPages.end(); ++i) {
+      pageinfo = *i;
       pageNo = pageinfo->pageNo;
       printf("%d: pid %d, page %d with addr %p dirtied by %d\n", cnt, getpid(), pageNo, pageinfo->pageStart, pageinfo->diriedBy);
       cnt++;
@@ -1038,6 +1313,42 @@ class xpersist {
     return num_buffered_pages;
   }
 
+#ifdef CIRCULAR_LOG
+  // Whether the page lookup info still refers to a logged page image.
+  static bool isLiveRecord(void* owner, int threadID, int pageNo, unsigned long offset) {
+    xpersist* heap = (xpersist*)owner;
+    struct lookupinfo* info = &heap->_pageLookup[pageNo];
+    struct lookupinfo* tmp = &heap->_pageLookupTmp[pageNo];
+
+    return ((info->dirtied && info->threadID == threadID && info->memlogOffset == offset)
+            || (tmp->dirtied && tmp->threadID == threadID && tmp->memlogOffset == offset));
+  }
+
+  // A logged page image was copied forward in the log segment.
+  static void moveRecord(void* owner, int threadID, int pageNo, unsigned long from, unsigned long to) {
+    xpersist* heap = (xpersist*)owner;
+    struct lookupinfo* info = &heap->_pageLookup[pageNo];
+    struct lookupinfo* tmp = &heap->_pageLookupTmp[pageNo];
+
+    if (info->threadID == threadID && info->memlogOffset == from) {
+      info->memlogOffset = to;
+    }
+    if (tmp->threadID == threadID && tmp->memlogOffset == from) {
+      tmp->memlogOffset = to;
+    }
+  }
+#endif
+
+#ifdef DIFF_LOGGING
+  // Where the page was logged last: buffered lookup info is newer.
+  inline struct lookupinfo* lastLookUpInfo(int pageNo) {
+    if (_pageLookupTmp[pageNo].dirtied) {
+      return &_pageLookupTmp[pageNo];
+    }
+    return &_pageLookup[pageNo];
+  }
+#endif
+
   // Record the page lookup info for the recovery code to use, called by checkandcommit()
   void recordLookUpInfo(int pageNo, unsigned short globalXactID, unsigned short threadID, unsigned long offset, bool dirtied) {
     // No other thread has touched this page, safe to record pageInfo
@@ -1125,7 +1436,17 @@ class xpersist {
 
     INC_COUNTER(commit);
 
-    if (_dirtiedPagesList.size() == 0) {
+#ifdef SOFTDIRTY_TRACKING
+    if (_softStarted) {
+      collectSoftDirtyPages();
+    }
+#endif
+
+#ifdef UFFD_TRACKING
+    takeTrackedPages();
+#endif
+
+    if (_dirtiedPages.size() == 0) {
       return;
     }
 
@@ -1140,6 +1461,10 @@ class xpersist {
     lprintf("globalXactID %lu, GET_METACOUNTER(globalTransactionCount): %lu\n",
             globalXactID, GET_METACOUNTER(globalTransactionCount));
 
+#ifndef LAZY_COMMIT
+    findSilentPages(update);
+#endif
+
 #ifdef ENABLE_PROFILING
     clock_t start_time = clock(), diff;
 #endif
@@ -1148,14 +1473,26 @@ class xpersist {
     // Log pages if it's heap data
     if (_isHeap) {
 
+#ifdef CIRCULAR_LOG
+      // Records referenced by the page lookup info survive wrap-around.
+      localMemoryLog->SetRecordOwner(isLiveRecord, moveRecord, this);
+#endif
+
+#ifdef LOG_CLEANER
+      xlogcleaner::getInstance().enter();
+#endif
+
       // Open a new log file if we have dirtied pages
-      localMemoryLog->OpenMemoryLog(_dirtiedPagesList.size(), _isHeap, globalXactID);
+      localMemoryLog->OpenMemoryLog(_dirtiedPages.size(), _isHeap, globalXactID);
 
       // Loop through all dirty pages and log them to the backend device
       int page_count = 0;
-      for (dirtyListType::iterator i = _dirtiedPagesList.begin(); i != _dirtiedPagesList.end(); ++i) {
+#ifdef LOG_CLEANER
+      unsigned long page_limit = 0;
+#endif
+      for (xdirtyset::iterator i = _dirtiedPages.begin(); i != _dirtiedPages.end(); ++i) {
         bool needsModify = false;
-        pageinfo = (struct xpageinfo*)i->second;
+        pageinfo = *i;
         pageNo = pageinfo->pageNo;
         shareinfo = &_pageUsers[pageNo];
         share = (unsigned long*)((intptr_t)_persistentMemory + xdefines::PageSize * pageNo);
@@ -1172,10 +1509,14 @@ class xpersist {
           }
         }
 
-        // Perform actual logging
-        if (needsModify) {
+        // Perform actual logging, pages left unchanged have nothing to log.
+        if (needsModify && !pageinfo->isSilent) {
 
-          unsigned long* twin = (unsigned long*)xbitmap::getInstance().getAddress(shareinfo->bitmapIndex);
+          // Bytes equal to the reference are logged with their shared value.
+          unsigned long* twin = commitReference(pageinfo, share);
+          if (twin == NULL) {
+            twin = share;
+          }
 
 #ifdef PAGE_DENSITY
           // Profile dirty page density
@@ -1183,21 +1524,37 @@ class xpersist {
 #endif
 
 #ifdef DIFF_LOGGING
-          // Log diffs in dirty page
-          localMemoryLog->AppendDiffsToMemoryLog(local, twin, pageNo, globalXactID, localMemoryLog->threadID, _pageLookupTmp);
-//        memlogOffset = localMemoryLog->_mempages_offset - logged_bytes;
+          // Log the modified runs on top of what was logged for the page before
+          struct lookupinfo* prev = lastLookUpInfo(pageNo);
+          int chain = localMemoryLog->AppendDiffMemoryLog(local, twin, share, pageNo,
+                                                          prev->dirtied ? prev->threadID : 0, prev->xactID,
+                                                          prev->memlogOffset, prev->dirtied ? prev->chain : 0);
 #else
           // Log whole page
           localMemoryLog->AppendMemoryLog(local, twin, share, pageNo);
-          memlogOffset = lseek(localMemoryLog->_mempages_fd, 0, SEEK_CUR) - LogDefines::PageSize;
 #endif
+          memlogOffset = localMemoryLog->LastRecordOffset();
+
           // Record page lookup info for recovery
           recordLookUpInfo(pageNo, globalXactID, localMemoryLog->threadID, memlogOffset, true);
+#ifdef HEAP_IMAGE
+          if (_imageLogged != NULL) {
+            _imageLogged[pageNo] = memlogOffset;
+          }
+#endif
+#ifdef DIFF_LOGGING
+          _pageLookupTmp[pageNo].chain = chain;
+#endif
 
           // Record data dependency
           recordDependence(pageNo, localMemoryLog->threadID, pageinfo->pageStart);
 
           page_count++;
+#ifdef LOG_CLEANER
+          if ((unsigned long)pageNo >= page_limit) {
+            page_limit = pageNo + 1;
+          }
+#endif
 
 #ifdef PAGE_DENSITY
           // Counter sanity checks
@@ -1209,18 +1566,23 @@ class xpersist {
         }
       }
 
-      // Flush log
-      localMemoryLog->MakeDurable(localMemoryLog->_mempages_ptr, localMemoryLog->_mempages_filesize);
-
       // Write an end of log
       localMemoryLog->WriteEndOfLog();
 
-      // Flush end of log
+      // Flush the transaction; its COMMIT record tells whether it is complete
       localMemoryLog->MakeDurable(localMemoryLog->_mempages_ptr, localMemoryLog->_mempages_filesize);
 
+#ifdef LOG_CLEANER
+      unsigned long logged = localMemoryLog->TransactionBytes();
+#endif
+
       // Close log
       localMemoryLog->CloseMemoryLog();
 
+#ifdef LOG_CLEANER
+      xlogcleaner::getInstance().account(logged, page_limit);
+#endif
+
       STOP_TIMER(logging);
 
 #ifdef ENABLE_PROFILING
@@ -1229,169 +1591,458 @@ class xpersist {
       ADD_COUNTER(logtimer, (double)diff);
     } // end of logging for data on heap
 
+#ifdef SOFTDIRTY_TRACKING
+    // Pages committed now are stamped, see softBegin().
+    _commitStamp = xatomic::increment_and_return(&_softState->started) + 1;
+#endif
+
+#ifdef HEAP_IMAGE
+    if (_imageStamps != NULL) {
+      clearImageStamps();
+    }
+#endif
+
+    commitDirtyPages(update, mypid);
+
+#ifdef HEAP_IMAGE
+    if (_imageStamps != NULL) {
+      stampImagePages(localMemoryLog->threadID, globalXactID);
+    }
+#endif
+
+#ifdef SOFTDIRTY_TRACKING
+    xatomic::increment(&_softState->done);
+#endif
+  }
+
+  // Commit every page of the dirty set to the shared mapping.
+  inline void commitDirtyPages(bool update, int mypid) {
+    struct xpageinfo* pageinfo = NULL;
+    struct commitstats stats = { 0, 0, 0 };
+
+#ifdef PARALLEL_COMMIT
+    // Large write sets are split by page range between helper threads.
+    if (_dirtiedPages.size() >= xdefines::PARALLEL_COMMIT_PAGES
+        && parallelCommit(update, mypid, &stats)) {
+      ADD_COUNTER(slowpage, stats.slowpages);
+      ADD_COUNTER(dirtypage_modified, stats.modified);
+      ADD_COUNTER(silentpages, stats.silent);
+      return;
+    }
+#endif
+
     // Check all pages in the dirty list
-    for (dirtyListType::iterator i = _dirtiedPagesList.begin(); i != _dirtiedPagesList.end(); ++i) {
-      bool isModified = false;
-      pageinfo = (struct xpageinfo*)i->second;
-      pageNo = pageinfo->pageNo;
+    for (xdirtyset::iterator i = _dirtiedPages.begin(); i != _dirtiedPages.end(); ++i) {
+      pageinfo = *i;
+
+      // When there are multiple writers on the page and the twin page is not created.
+      // Unchanged pages leave the shared copy alone and need no twin.
+      if (!pageinfo->isSilent && needsTwin(pageinfo->pageNo)) {
+        createTwinPage(pageinfo->pageNo);
+      }
 
-      // Get the shareinfo and persistent address.
-      shareinfo = &_pageUsers[pageNo];
-      share = (unsigned long*)((intptr_t)_persistentMemory + xdefines::PageSize * pageNo);
-      local = (unsigned long*)pageinfo->pageStart;
+      commitPage(pageinfo, update, mypid, &stats);
+    }
+
+    ADD_COUNTER(slowpage, stats.slowpages);
+    ADD_COUNTER(dirtypage_modified, stats.modified);
+    ADD_COUNTER(silentpages, stats.silent);
+  }
+
+  // What a dirty page is committed against: the shared page while nobody
+  // else committed it since it was faulted in, the twin otherwise. NULL if
+  // there is no twin.
+  inline unsigned long* commitReference(struct xpageinfo* pageinfo, unsigned long* share) {
+    struct shareinfo* shareinfo = &_pageUsers[pageinfo->pageNo];
+
+    if (pageinfo->version == _persistentVersions[pageinfo->pageNo]) {
+      return share;
+    }
+    if (!hasTwin(pageinfo->pageNo)) {
+      return NULL;
+    }
+    return (unsigned long*)xbitmap::getInstance().getAddress(shareinfo->bitmapIndex);
+  }
 
-      // When there are multiple writers on the page and the twin page is not created (bitmapIndex = 0).
-      if (shareinfo->users > 1 && shareinfo->bitmapIndex == 0) {
-        createTwinPage(pageNo);
+#ifndef LAZY_COMMIT
+  // Mark the pages this commit would write but that are still identical to
+  // their reference, like values stored back unchanged or pages touched by
+  // read(). They are neither logged nor committed.
+  void findSilentPages(bool update) {
+    for (xdirtyset::iterator i = _dirtiedPages.begin(); i != _dirtiedPages.end(); ++i) {
+      struct xpageinfo* pageinfo = *i;
+      int pageNo = pageinfo->pageNo;
+
+      pageinfo->isSilent = false;
+      if (pageinfo->isUpdated) {
+        continue;
+      }
+      // The early commit only writes pages somebody else committed.
+      if (update && pageinfo->version == _persistentVersions[pageNo]) {
+        continue;
       }
 
-      TRACE("%d: commits local modification to shared mapping, xact %d, pageNo %d\n", getpid(), _trans, pageNo);
+      unsigned long* share = (unsigned long*)((intptr_t)_persistentMemory + xdefines::PageSize * pageNo);
+      unsigned long* reference = commitReference(pageinfo, share);
+      if (reference != NULL && xpagediff::getInstance().equal(pageinfo->pageStart, reference)) {
+        pageinfo->isSilent = true;
+      }
+    }
+  }
+#endif
 
-      lprintf("commits local modification to shared mapping, xact %d, pageNo %d, pageAddr: %p\n", _trans, pageNo,pageinfo->pageStart);
+  // Whether the page has a twin handed out since the last cleanup.
+  inline bool hasTwin(int pageNo) {
+    struct shareinfo* shareinfo = &_pageUsers[pageNo];
+    return (shareinfo->bitmapIndex != 0 && shareinfo->twinEpoch == xbitmap::getInstance().epoch());
+  }
 
-#ifdef LAZY_COMMIT
-      // update is true before entering into the critical sections.
-      // do the least upates if possible.
-      if (update) {
+  // Whether a twin has to be saved before this page is committed.
+  inline bool needsTwin(int pageNo) {
+    struct shareinfo* shareinfo = &_pageUsers[pageNo];
 
-        // Current page is older than the version of shared mapping, then commit local modifications.
-        if (pageinfo->version != _persistentVersions[pageNo]) {
-          unsigned long* twin = (unsigned long*)xbitmap::getInstance().getAddress(shareinfo->bitmapIndex);
-          assert(shareinfo->bitmapIndex != 0);
-          assert(xbitmap::getInstance().getVersion(shareinfo->bitmapIndex) != _persistentVersions[pageNo]);
+    if (hasTwin(pageNo)) {
+      return false;
+    }
+#ifdef SOFTDIRTY_TRACKING
+    // Soft-dirty writers are not counted in users; they may be writing
+    // any page of the region.
+    return (shareinfo->users > 1 || _softState->active > 0);
+#else
+    return (shareinfo->users > 1);
+#endif
+  }
 
-          recordPageChanges(pageNo);
-          INC_COUNTER(slowpage);
+  // Per-commit counters, summed locally so that commit workers do not
+  // race on the shared statistics.
+  struct commitstats {
+    unsigned long slowpages;
+    unsigned long modified;
+    unsigned long silent;
+  };
 
-          // Use the slower page commit, comparing to "twin".
-          writePageDiffs(local, twin, share, pageNo);
-          setSharedPage(pageNo);
+  // Commit one dirty page to the shared mapping. The twin page must already
+  // exist when other threads are writing the same page.
+  inline void commitPage(struct xpageinfo* pageinfo, bool update, int mypid, struct commitstats* stats) {
+    bool isModified = false;
+    int pageNo = pageinfo->pageNo;
 
-          // Update this page since it may affect results of next transaction.
-          updatePage(pageinfo->pageStart, 1, true);
-          pageinfo->isUpdated = true;
-          isModified = true;
-        }
-      } else {
-        // Only do commits when the page have not been updated.
-        if (!pageinfo->isUpdated) {
-          // When there are multiple writes on this pae, the page cannot be owned.
-          // When this page is not owned, then we do commit.
-          if (shareinfo->users != 1 || _pageOwner[pageNo] != mypid) {
-            pageinfo->release = true;
-
-            // If the version is the same as shared, use memcpy to commit.
-            if (pageinfo->version == _persistentVersions[pageNo]) {
-              memcpy(share, local, xdefines::PageSize);
-            } else {
-              // slow commits
-              unsigned long* twin = (unsigned long*)xbitmap::getInstance().getAddress(shareinfo->bitmapIndex);
-              assert(shareinfo->bitmapIndex != 0);
-
-              recordPageChanges(pageNo);
-              INC_COUNTER(slowpage);
-              // Use the slower page commit, comparing to "twin".
-              setSharedPage(pageNo);
-              writePageDiffs(local, twin, share, pageNo);
-            }
+    // Get the shareinfo and persistent address.
+    struct shareinfo* shareinfo = &_pageUsers[pageNo];
+    unsigned long* share = (unsigned long*)((intptr_t)_persistentMemory + xdefines::PageSize * pageNo);
+    unsigned long* local = (unsigned long*)pageinfo->pageStart;
+
+    TRACE("%d: commits local modification to shared mapping, xact %d, pageNo %d\n", getpid(), _trans, pageNo);
+
+    lprintf("commits local modification to shared mapping, xact %d, pageNo %d, pageAddr: %p\n", _trans, pageNo,pageinfo->pageStart);
+
+#ifdef LAZY_COMMIT
+    // update is true before entering into the critical sections.
+    // do the least upates if possible.
+    if (update) {
+
+      // Current page is older than the version of shared mapping, then commit local modifications.
+      if (pageinfo->version != _persistentVersions[pageNo]) {
+        unsigned long* twin = (unsigned long*)xbitmap::getInstance().getAddress(shareinfo->bitmapIndex);
+        assert(shareinfo->bitmapIndex != 0);
+        assert(xbitmap::getInstance().getVersion(shareinfo->bitmapIndex) != _persistentVersions[pageNo]);
+
+        recordPageChanges(pageNo);
+        stats->slowpages++;
+
+        // Use the slower page commit, comparing to "twin".
+        writePageDiffs(local, twin, share, pageNo);
+        setSharedPage(pageNo);
+
+        // Update this page since it may affect results of next transaction.
+        refreshPage(pageinfo);
+        pageinfo->isUpdated = true;
+        isModified = true;
+      }
+    } else {
+      // Only do commits when the page have not been updated.
+      if (!pageinfo->isUpdated) {
+        // When there are multiple writes on this pae, the page cannot be owned.
+        // When this page is not owned, then we do commit.
+        if (shareinfo->users != 1 || _pageOwner[pageNo] != mypid) {
+          pageinfo->release = true;
 
-            isModified = true;
+          // If the version is the same as shared, use memcpy to commit.
+          if (pageinfo->version == _persistentVersions[pageNo]) {
+            memcpy(share, local, xdefines::PageSize);
           } else {
-            // Only one user on it and pageOwner is myself.
-            pageinfo->release = false;
+            // slow commits
+            unsigned long* twin = (unsigned long*)xbitmap::getInstance().getAddress(shareinfo->bitmapIndex);
+            assert(shareinfo->bitmapIndex != 0);
 
-            // Now there is one less user on this page.
-            shareinfo->users--;
+            recordPageChanges(pageNo);
+            stats->slowpages++;
+            // Use the slower page commit, comparing to "twin".
+            setSharedPage(pageNo);
+            writePageDiffs(local, twin, share, pageNo);
           }
+
+          isModified = true;
+        } else {
+          // Only one user on it and pageOwner is myself.
+          pageinfo->release = false;
+
+          // Now there is one less user on this page.
+          shareinfo->users--;
         }
       }
+    }
 #else
-      /// If we are not defining "LAZY_COMMIT", then all local modifications has
-      //  to be committed to the shared mapping.
-      if (update) {
-        if (pageinfo->version != _persistentVersions[pageNo]) {
-          TRACE("%d: updating pageNo %d\n", getpid(), pageNo);
+    /// If we are not defining "LAZY_COMMIT", then all local modifications has
+    //  to be committed to the shared mapping.
+    if (update) {
+      if (pageinfo->version != _persistentVersions[pageNo]) {
+        TRACE("%d: updating pageNo %d\n", getpid(), pageNo);
 
+        if (!pageinfo->isSilent) {
           unsigned long* twin = (unsigned long*)xbitmap::getInstance().getAddress(shareinfo->bitmapIndex);
           assert(shareinfo->bitmapIndex != 0);
           assert(xbitmap::getInstance().getVersion(shareinfo->bitmapIndex) != _persistentVersions[pageNo]);
 
           recordPageChanges(pageNo);
-          INC_COUNTER(slowpage);
+          stats->slowpages++;
 
           // Use the slower page commit, comparing to "twin".
           writePageDiffs(local, twin, share, pageNo);
-
-          // Now we need to update this page since it may affect results of next transaction.
-          updatePage(pageinfo->pageStart, 1, true);
-          pageinfo->isUpdated = true;
-          isModified = true;
         }
-      } else {
-        TRACE("%d: writing pageNo %d\n", getpid(), pageNo);
 
-        if (!pageinfo->isUpdated) {
+        // Now we need to update this page since it may affect results of next transaction.
+        refreshPage(pageinfo);
+        pageinfo->isUpdated = true;
+        isModified = true;
+      }
+    } else {
+      TRACE("%d: writing pageNo %d\n", getpid(), pageNo);
 
-          if (pageinfo->version == _persistentVersions[pageNo]) {
-            TRACE("%d: memcpy pageNo %d\n", getpid(), pageNo);
-            memcpy(share, local, xdefines::PageSize);
-          } else {
-            unsigned long* twin = (unsigned long*)xbitmap::getInstance().getAddress(shareinfo->bitmapIndex);
-            assert(shareinfo->bitmapIndex != 0);
+      if (!pageinfo->isUpdated) {
 
-            recordPageChanges(pageNo);
-            INC_COUNTER(slowpage);
-            // Use the slower page commit, comparing to "twin".
-            writePageDiffs(local, twin, share, pageNo);
+        if (pageinfo->isSilent) {
+          TRACE("%d: unchanged pageNo %d\n", getpid(), pageNo);
+        } else if (pageinfo->version == _persistentVersions[pageNo]) {
+          TRACE("%d: memcpy pageNo %d\n", getpid(), pageNo);
+          memcpy(share, local, xdefines::PageSize);
+        } else {
+          unsigned long* twin = (unsigned long*)xbitmap::getInstance().getAddress(shareinfo->bitmapIndex);
+          assert(shareinfo->bitmapIndex != 0);
 
-            TRACE("%d: writePageDiffs %d\n", getpid(), pageNo);
+          recordPageChanges(pageNo);
+          stats->slowpages++;
+          // Use the slower page commit, comparing to "twin".
+          writePageDiffs(local, twin, share, pageNo);
+
+          TRACE("%d: writePageDiffs %d\n", getpid(), pageNo);
 
-          }
-          isModified = true;
         }
+        isModified = true;
       }
+    }
 #endif
 
-      if (isModified) {
-        if (shareinfo->users == 1) {
-          // If I am the only user, release the share information.
-          shareinfo->bitmapIndex = 0;
+    if (isModified) {
+#ifdef SOFTDIRTY_TRACKING
+      // The twin stays while soft-dirty transactions may still need it.
+      if (shareinfo->users == 1 && _softState->active == 0) {
+#else
+      if (shareinfo->users == 1) {
+#endif
+        // If I am the only user, release the share information.
+        if (hasTwin(pageNo)) {
+          xbitmap::getInstance().put(shareinfo->bitmapIndex);
         }
+        shareinfo->bitmapIndex = 0;
+      }
 
-        // Now there is one less user on this page.
-        shareinfo->users--;
+      // Now there is one less user on this page.
+      shareinfo->users--;
 
-        INC_COUNTER(dirtypage_modified);
+      if (pageinfo->isSilent) {
+        // The shared copy did not change, neither does its version.
+        stats->silent++;
+        return;
+      }
+
+      stats->modified++;
 
-        // Update the version number.
-        _persistentVersions[pageNo]++;
+      // Update the version number.
+      _persistentVersions[pageNo]++;
+#ifdef SOFTDIRTY_TRACKING
+      _pageStamps[pageNo] = _commitStamp;
+#endif
+    }
+  }
+
+  // Update the frame of a page committed with update. Helper threads leave
+  // it to the owner: madvise, mprotect and the userfaultfd set errno, and
+  // re-arming aborts with stdio on failure.
+  inline void refreshPage(struct xpageinfo* pageinfo) {
+#ifdef PARALLEL_COMMIT
+    if (_deferUpdates) {
+      pageinfo->needsUpdate = true;
+      return;
+    }
+#endif
+    updatePage(pageinfo->pageStart, 1, true);
+  }
+
+#ifdef PARALLEL_COMMIT
+  struct commitjob {
+    xpersist* heap;
+    struct xpageinfo** pages;
+    size_t bounds[xdefines::MAX_COMMIT_HELPERS + 2];
+    bool update;
+    int mypid;
+    struct commitstats stats[xdefines::MAX_COMMIT_HELPERS + 1];
+  };
+
+  static void commitShard(void* arg, int shard) {
+    struct commitjob* job = (struct commitjob*)arg;
+    struct commitstats* stats = &job->stats[shard];
+
+    for (size_t i = job->bounds[shard]; i < job->bounds[shard + 1]; i++) {
+      job->heap->commitPage(job->pages[i], job->update, job->mypid, stats);
+    }
+  }
+
+  // Commit the dirty list with the help of the per-process workers.
+  // Returns false when there is nobody to share the work with.
+  bool parallelCommit(bool update, int mypid, struct commitstats* total) {
+    size_t count = _dirtiedPages.size();
+    int shards = count / xdefines::PARALLEL_COMMIT_SHARD;
+
+    if (shards > xdefines::MAX_COMMIT_HELPERS + 1) {
+      shards = xdefines::MAX_COMMIT_HELPERS + 1;
+    }
+    if (shards < 2 || (shards = xworkers::getInstance().available(shards)) < 2) {
+      return false;
+    }
+
+    if (_commitPages == NULL) {
+      _commitPages = (struct xpageinfo**)mmap(NULL, TotalPageNums * sizeof(struct xpageinfo*),
+                                              PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (_commitPages == MAP_FAILED) {
+        _commitPages = NULL;
+        return false;
+      }
+    }
+
+    // Twin pages are handed out by a shared cursor, so create them serially
+    // while flattening the list into page order.
+    size_t n = 0;
+    for (xdirtyset::iterator i = _dirtiedPages.begin(); i != _dirtiedPages.end(); ++i) {
+      struct xpageinfo* pageinfo = *i;
+
+      if (!pageinfo->isSilent && needsTwin(pageinfo->pageNo)) {
+        createTwinPage(pageinfo->pageNo);
+      }
+      _commitPages[n++] = pageinfo;
+    }
+    xbitmap::getInstance().mapChunks();
+
+    struct commitjob job;
+    job.heap = this;
+    job.pages = _commitPages;
+    job.update = update;
+    job.mypid = mypid;
+
+    // Split by page range; the dirty set holds each page once.
+    job.bounds[0] = 0;
+    for (int s = 1; s < shards; s++) {
+      job.bounds[s] = count * s / shards;
+      job.stats[s - 1].slowpages = job.stats[s - 1].modified = job.stats[s - 1].silent = 0;
+    }
+    job.bounds[shards] = count;
+    job.stats[shards - 1].slowpages = job.stats[shards - 1].modified = job.stats[shards - 1].silent = 0;
+
+    _deferUpdates = true;
+    xworkers::getInstance().run(commitShard, &job, shards);
+    _deferUpdates = false;
+
+    // Update the frames the helpers committed, a run of pages at a time.
+    for (size_t i = 0; i < count;) {
+      if (!_commitPages[i]->needsUpdate) {
+        i++;
+        continue;
+      }
+      size_t end = i + 1;
+      while (end < count && _commitPages[end]->needsUpdate
+             && _commitPages[end]->pageNo == _commitPages[end - 1]->pageNo + 1) {
+        end++;
+      }
+      for (size_t j = i; j < end; j++) {
+        _commitPages[j]->needsUpdate = false;
       }
+      updatePage(_commitPages[i]->pageStart, end - i, true);
+      i = end;
+    }
 
+    for (int s = 0; s < shards; s++) {
+      total->slowpages += job.stats[s].slowpages;
+      total->modified += job.stats[s].modified;
+      total->silent += job.stats[s].silent;
     }
+
+    INC_COUNTER(parallelcommit);
+    return true;
   }
+#endif
 
   /// @brief Update every page frame from the backing file if necessary.
   void updateAll(bool cleanup) {
     struct xpageinfo* pageinfo;
     int pageNo = 0;
 
+#ifdef UFFD_TRACKING
+    takeTrackedPages();
+    if (_uffdTracking) {
+      checkTracking();
+    }
+#endif
+
+#ifndef LAZY_COMMIT
+    refreshRetained();
+#endif
+
     // Dump in-updated page frame for safety!!!
-    dirtyListType::iterator i;
-    for (i = _dirtiedPagesList.begin(); i != _dirtiedPagesList.end(); ++i) {
-      pageinfo = (struct xpageinfo*)i->second;
+    // The set is in page order, so runs of neighbouring pages are
+    // released and protected with one call each.
+    int runStart = -1;
+    int runEnd = -1;
+    bool runRelease = false;
+    for (xdirtyset::iterator i = _dirtiedPages.begin(); i != _dirtiedPages.end(); ++i) {
+      pageinfo = *i;
       pageNo = pageinfo->pageNo;
 
       // Since some page frame has been updated in check phase,
       // Now we don't need to work on these pages anymore.
-      if (!pageinfo->isUpdated) {
-        TRACE("%d: updating pageNo: %d\n", getpid(), pageNo);
-        updatePage(pageinfo->pageStart, 1, pageinfo->release);
+      if (pageinfo->isUpdated) {
+        continue;
       }
+
+      TRACE("%d: updating pageNo: %d\n", getpid(), pageNo);
+      bool release = pageinfo->release;
+#ifndef LAZY_COMMIT
+      if (release && retainPage(pageinfo)) {
+        release = false;
+      }
+#endif
+      if (pageNo != runEnd || release != runRelease) {
+        updateRange(runStart, runEnd, runRelease);
+        runStart = pageNo;
+        runRelease = release;
+      }
+      runEnd = pageNo + 1;
     }
-    // Now there is no need to use dirtiedPagesList any more
+    updateRange(runStart, runEnd, runRelease);
+
+    // Now there is no need to use dirtiedPagesList any more.
+    // The entries themselves are shared with the other region, see xmemory::begin().
     if (cleanup) {
-      _dirtiedPagesList.clear();
-      xpageentry::getInstance().cleanup();
+      _dirtiedPages.clear();
     }
   }
 
@@ -1408,26 +2059,359 @@ class xpersist {
     return (size_t)addr % (size_t)xdefines::PageSize;
   }
 
- private:
-  // The objects are pairs, mapping void * pointers to sizes.
-  typedef std::pair<int, void*> objType;
-  typedef HL::STLAllocator<objType, privateheap> dirtyListTypeAllocator;
-  typedef std::less<int> localComparator;
-  typedef std::multimap<int, void*, localComparator, dirtyListTypeAllocator> dirtyListType;
+#ifdef UFFD_TRACKING
+  // Switch this region to userfaultfd tracking after openProtection.
+  // The region stays read-only; chunks are armed on their first write.
+  void startTracking(void) {
+    _uffdTracking = false;
+    _uffdPid = syscall(SYS_getpid);
+    if (!xuffd::getInstance().attach()
+        || !xuffd::getInstance().registerRange(base(), size(), trackWrite, this)) {
+      // Fall back to SIGSEGV and mprotect.
+      return;
+    }
+    memset(_armedChunks, 0, TotalPageNums / xdefines::UFFD_ARM_PAGES + 1);
+    _uffdTracking = true;
+  }
+
+  // Write-protect a whole chunk and make it writable at the mprotect level.
+  void armChunk(int pageNo) {
+    int chunk = pageNo / xdefines::UFFD_ARM_PAGES;
+    size_t offset = (size_t)chunk * xdefines::UFFD_ARM_PAGES * xdefines::PageSize;
+    size_t length = xdefines::UFFD_ARM_PAGES * xdefines::PageSize;
+    char* start = (char*)base() + offset;
+
+    if (offset + length > size()) {
+      length = size() - offset;
+    }
+
+    if (_armedChunks[chunk] || !xuffd::getInstance().protect(start, length, true)) {
+      fprintf(stderr, "%d: failed to arm write tracking at %p\n", getpid(), start);
+      ::abort();
+    }
+    if (mprotect(start, length, PROT_READ | PROT_WRITE)) {
+      perror("mprotect() in armChunk");
+      exit(-1);
+    }
+    _armedChunks[chunk] = 1;
+    INC_COUNTER(trackarms);
+  }
+
+  // Runs on the userfaultfd handler thread while the writer is blocked, so
+  // it only does what must happen before the write goes on: count the user
+  // and note the version the page starts from. The owner adds the page to
+  // the dirty set in takeTrackedPages(). Pages with a retained copy never
+  // get here, see handleWrite().
+  static void trackWrite(void* owner, void* addr) {
+    xpersist* region = (xpersist*)owner;
+    int pageNo = region->computePage((size_t)addr - (size_t)region->base());
+    INC_COUNTER(faults);
 
+    if (region->_dirtiedPages.find(pageNo) == NULL) {
+      xatomic::increment((unsigned long*)&region->_pageUsers[pageNo]);
+    }
+    struct trackedpage* tracked = &region->_trackedPages[region->_trackedCount];
+    tracked->pageNo = pageNo;
+    tracked->version = region->_persistentVersions[pageNo];
+    xatomic::memoryBarrier();
+    region->_trackedCount++;
+  }
+
+  // Add the pages the handler thread saw written to the dirty set. The
+  // handler only runs while this thread is blocked in a fault.
+  void takeTrackedPages(void) {
+    size_t count = _trackedCount;
+    for (size_t i = 0; i < count; i++) {
+      int pageNo = _trackedPages[i].pageNo;
+      struct xpageinfo* curr = _dirtiedPages.find(pageNo);
+      bool isNew = (curr == NULL);
+
+      if (isNew) {
+        curr = xpageentry::getInstance().alloc();
+      }
+      setPageInfo(curr, pageNo, getPageStart(pageNo), _trackedPages[i].version);
+      INC_COUNTER(dirtypage_inserted);
+      if (isNew) {
+        _dirtiedPages.insert(curr);
+      }
+    }
+    _trackedCount = 0;
+  }
+
+  // Called before dirty pages are re-armed.
+  void checkTracking(void) {
+    if (_uffdPid != syscall(SYS_getpid)) {
+      // A forked child has lost the protection of its parent. Arming a
+      // chunk would make its retained copies writable unchecked.
+      dropRetained();
+      mprotect(base(), size(), PROT_READ);
+      startTracking();
+      if (!_uffdTracking) {
+        fprintf(stderr, "%d: failed to restart write tracking\n", getpid());
+        ::abort();
+      }
+    }
+  }
+#endif
+
+#ifdef SOFTDIRTY_TRACKING
+  // The heap reports how far it has been allocated, see xmemory.
+  inline void setUsedEnd(void* end) {
+    _usedPages = ((intptr_t)end - (intptr_t)base() + xdefines::PageSize - 1) / xdefines::PageSize;
+  }
+
+  // Pick the tracking mode for the next transaction. A region switches after
+  // SOFTDIRTY_SWITCH_TXNS transactions in a row favour the other mode.
+  void chooseTracking(size_t dirtied) {
+    bool vote;
+    if (_softDirty) {
+      vote = (dirtied * 100 < _usedPages * xdefines::SOFTDIRTY_LEAVE_PERCENT);
+    } else {
+      vote = (_usedPages >= xdefines::SOFTDIRTY_MIN_PAGES
+              && dirtied * 100 >= _usedPages * xdefines::SOFTDIRTY_ENTER_PERCENT);
+    }
+    _switchVotes = vote ? _switchVotes + 1 : 0;
+
+    if (_switchVotes >= xdefines::SOFTDIRTY_SWITCH_TXNS) {
+      _switchVotes = 0;
+      if (_softDirty) {
+        leaveSoftDirty();
+      } else if (xsoftdirty::getInstance().available() && extendSoftDirty()) {
+        dropRetained();
+        _softDirty = true;
+        INC_COUNTER(softdirtyswitch);
+      }
+    }
+
+    if (_softDirty) {
+      // Newly allocated pages keep faulting if they cannot be added.
+      extendSoftDirty();
+      softBegin();
+    }
+  }
+
+  // Make the used pages writable, so that only writes beyond them fault.
+  // Writable private mappings are charged up front, hence not the whole region.
+  bool extendSoftDirty(void) {
+    if (_usedPages > _softPages) {
+      if (mprotect((char*)base() + _softPages * xdefines::PageSize,
+                   (_usedPages - _softPages) * xdefines::PageSize, PROT_READ | PROT_WRITE)) {
+        return false;
+      }
+      _softPages = _usedPages;
+    }
+    return (_softPages > 0);
+  }
+
+  void leaveSoftDirty(void) {
+    // Private copies were dropped by updateAll, so the pages can be
+    // write-protected in one go.
+    if (mprotect(base(), _softPages * xdefines::PageSize, PROT_READ)) {
+      perror("mprotect() in leaveSoftDirty");
+      exit(-1);
+    }
+    _softDirty = false;
+    _softPages = 0;
+    INC_COUNTER(softdirtyswitch);
+  }
+
+  // Start a fault-free transaction. Writes are not seen until the commit,
+  // so other processes keep twins of every page they commit meanwhile
+  // (see needsTwin), and the pages committed after this point are told
+  // apart by their stamps.
+  void softBegin(void) {
+    xatomic::increment(&_softState->active);
+
+    // A commit in flight may still write pages we are about to read.
+    unsigned long started;
+    while ((started = _softState->started) != _softState->done) {
+      sched_yield();
+    }
+    _beginStamp = started;
+
+    if (!xsoftdirty::getInstance().clear()) {
+      // Fall back to faults for this and later transactions.
+      xatomic::decrement(&_softState->active);
+      leaveSoftDirty();
+      return;
+    }
+    _softStarted = true;
+  }
+
+  struct softcollector {
+    xpersist* region;
+    void operator()(size_t page) {
+      region->recordSoftDirtyPage(page);
+    }
+  };
+
+  // Build the dirty set from the soft-dirty bits of the used pages.
+  void collectSoftDirtyPages(void) {
+    struct softcollector collect;
+    collect.region = this;
+
+    _softStarted = false;
+    if (!xsoftdirty::getInstance().scan(base(), _softPages, collect)) {
+      fprintf(stderr, "%d: failed to read soft-dirty bits: %s\n", getpid(), strerror(errno));
+      ::abort();
+    }
+
+    // Commits are serialized by the token, so nobody has to keep twins
+    // for us from here on.
+    xatomic::decrement(&_softState->active);
+    INC_COUNTER(softdirtyscans);
+  }
+
+  inline void recordSoftDirtyPage(int pageNo) {
+    unsigned long* pageStart = (unsigned long*)((intptr_t)base() + (size_t)pageNo * xdefines::PageSize);
+    struct xpageinfo* pageinfo = recordDirtyPage(pageNo, pageStart);
+
+    // Somebody committed the page during our transaction, maybe after our
+    // first write to it: merge against the twin instead of copying.
+    if (_pageStamps[pageNo] > _beginStamp) {
+      pageinfo->version = _persistentVersions[pageNo] - 1;
+    }
+    INC_COUNTER(softdirtypages);
+  }
+#endif
+
+#ifndef LAZY_COMMIT
+  // A page we copied to the shared mapping as a whole is identical to it
+  // until somebody else commits the page. Its private copy is then kept,
+  // read-only, instead of being dropped and faulted in again.
+  inline bool retainPage(struct xpageinfo* pageinfo) {
+    int pageNo = pageinfo->pageNo;
+
+#ifdef SOFTDIRTY_TRACKING
+    // Soft-dirty writes are not seen in time to check the copy.
+    if (_softDirty) {
+      return false;
+    }
+#endif
+    // commitPage bumped the version once, after a plain copy, or left an
+    // unchanged page alone and nobody committed it since.
+    if (pageinfo->isSilent) {
+      if (_persistentVersions[pageNo] != (unsigned long)pageinfo->version) {
+        return false;
+      }
+    } else if (_persistentVersions[pageNo] != (unsigned long)pageinfo->version + 1) {
+      return false;
+    }
+
+    _retainedVersions[pageNo] = _persistentVersions[pageNo] + 1;
+    _retainedPages[_retainedCount++] = pageNo;
+    INC_COUNTER(retainedpages);
+    return true;
+  }
+
+  // Drop the retained copies of pages committed by others since.
+  void refreshRetained(void) {
+    size_t kept = 0;
+    int runStart = -1;
+    int runEnd = -1;
+
+    for (size_t i = 0; i < _retainedCount; i++) {
+      int pageNo = _retainedPages[i];
+
+      // Written again in the last transaction; it is in the dirty set.
+      if (_retainedVersions[pageNo] == 0) {
+        continue;
+      }
+
+      if (_retainedVersions[pageNo] == _persistentVersions[pageNo] + 1) {
+        _retainedPages[kept++] = pageNo;
+        continue;
+      }
+
+      _retainedVersions[pageNo] = 0;
+      INC_COUNTER(retaindrops);
+      if (pageNo != runEnd) {
+        releaseRange(runStart, runEnd);
+        runStart = pageNo;
+      }
+      runEnd = pageNo + 1;
+    }
+    releaseRange(runStart, runEnd);
+    _retainedCount = kept;
+  }
+
+  // Drop every retained copy.
+  void dropRetained(void) {
+    for (size_t i = 0; i < _retainedCount; i++) {
+      _retainedVersions[_retainedPages[i]] = 0;
+    }
+    for (size_t i = 0; i < _retainedCount; i++) {
+      releaseRange(_retainedPages[i], _retainedPages[i] + 1);
+    }
+    _retainedCount = 0;
+  }
+
+  // The mapping was replaced, so there is nothing left to drop.
+  void forgetRetained(void) {
+    for (size_t i = 0; i < _retainedCount; i++) {
+      _retainedVersions[_retainedPages[i]] = 0;
+    }
+    _retainedCount = 0;
+  }
+#endif
+
+ private:
 
   inline size_t computePage(size_t index) {
     return (index * sizeof(Type)) / xdefines::PageSize;
   }
 
+  // Update the pages [startPage, endPage); nothing if startPage is negative.
+  inline void updateRange(int startPage, int endPage, bool release) {
+    if (startPage >= 0) {
+      updatePage((char*)base() + (size_t)startPage * xdefines::PageSize, endPage - startPage, release);
+    }
+  }
+
   /// @brief Update the given page frame from the backing file.
   void updatePage(void* local, size_t pages, bool release) {
+    ADD_COUNTER(updatepages, pages);
     if (release) {
       madvise(local, xdefines::PageSize * pages, MADV_DONTNEED);
+      INC_COUNTER(updatecalls);
+    }
+
+#ifdef SOFTDIRTY_TRACKING
+    if (_softDirty) {
+      // Soft-dirty pages stay writable; only the part beyond them is protected.
+      char* softEnd = (char*)base() + _softPages * xdefines::PageSize;
+      if ((char*)local + xdefines::PageSize * pages <= softEnd) {
+        return;
+      }
+      if ((char*)local < softEnd) {
+        pages -= (softEnd - (char*)local) / xdefines::PageSize;
+        local = softEnd;
+      }
     }
+#endif
+
+#ifdef UFFD_TRACKING
+    if (_uffdTracking) {
+      if (!release) {
+        // A retained copy has to be checked by the writer before it is
+        // written, so it faults through mprotect instead, see handleWrite().
+        mprotect(local, xdefines::PageSize * pages, PROT_READ);
+        INC_COUNTER(updatecalls);
+        return;
+      }
+      // The pages stay writable at the mprotect level; re-arm the userfaultfd.
+      if (!xuffd::getInstance().protect(local, xdefines::PageSize * pages, true)) {
+        fprintf(stderr, "%d: failed to re-arm write tracking at %p\n", getpid(), local);
+        ::abort();
+      }
+      INC_COUNTER(updatecalls);
+      return;
+    }
+#endif
 
     // Set this page to PROT_READ again.
     mprotect(local, xdefines::PageSize * pages, PROT_READ);
+    INC_COUNTER(updatecalls);
     //  mprotect(local, xdefines::PageSize, PROT_NONE);
   }
 
@@ -1440,8 +2424,8 @@ class xpersist {
   /// The size of the region.
   const size_t _startsize;
 
-  /// A map of dirtied pages.
-  dirtyListType _dirtiedPagesList;
+  /// The set of dirtied pages.
+  xdirtyset _dirtiedPages;
 
   /// The file descriptor for the backing store.
   int _backingFd;
@@ -1474,16 +2458,43 @@ class xpersist {
 
   volatile unsigned long* _pageOwner;
 #endif
-  /// Local version numbers for each page.
-  __m128i allones;
-
   struct shareinfo {
     volatile unsigned short users;
-    volatile unsigned short bitmapIndex;
+    volatile unsigned int bitmapIndex;
+    // An index from an older bitmap epoch is stale; it may be handed out again.
+    volatile int twinEpoch;
   };
 
   struct shareinfo* _pageUsers;
 
+#ifdef SOFTDIRTY_TRACKING
+  // Shared by all processes of a region.
+  struct softstate {
+    volatile unsigned long active;  // soft-dirty transactions in flight
+    volatile unsigned long started; // commits started
+    volatile unsigned long done;    // commits finished
+  };
+  struct softstate* _softState;
+
+  // Stamp of the last commit of every page.
+  volatile unsigned long* _pageStamps;
+  unsigned long _commitStamp;
+  unsigned long _beginStamp;
+
+  bool _softDirty;
+  bool _softStarted;
+  int _switchVotes;
+  size_t _usedPages;
+  size_t _softPages; // tracked by soft-dirty bits, from the start of the region
+#endif
+
+#ifndef LAZY_COMMIT
+  // Version + 1 of every retained private copy, 0 for none.
+  unsigned long* _retainedVersions;
+  int* _retainedPages;
+  size_t _retainedCount;
+#endif
+
   /// The length of the version array.
   enum {TotalPageNums = sizeof(Type) * NElts / xdefines::PageSize };
 
@@ -1499,6 +2510,15 @@ class xpersist {
 
   char* logPath;
 
+#ifdef HEAP_IMAGE
+  // Header and stamps of the heap image, NULL until it is attached
+  struct heapimageheader* _imageHeader;
+  struct heapimagestamp* _imageStamps;
+
+  // Offset of the record each page was logged at by the running commit, 0 if it was not
+  unsigned long* _imageLogged;
+#endif
+
   // Page lookup metadata for recovery
   struct lookupinfo* _pageLookup;
   int _lookupFd;
@@ -1517,6 +2537,31 @@ class xpersist {
   int* _pageNoTmp;
   int _pageNoTmpFd;
 
+#ifdef PARALLEL_COMMIT
+  // Dirty pages flattened in page order for the commit workers.
+  struct xpageinfo** _commitPages;
+
+  // Set while helpers commit; frames are updated by the owner afterwards.
+  bool _deferUpdates;
+#endif
+
+#ifdef UFFD_TRACKING
+  // Whether this process tracks writes to the region through userfaultfd.
+  bool _uffdTracking;
+  pid_t _uffdPid;
+
+  // Chunks whose pages are write-protected by userfaultfd.
+  unsigned char* _armedChunks;
+
+  // Pages written since the owner last took them, one entry per first write.
+  struct trackedpage {
+    int pageNo;
+    int version;
+  };
+  struct trackedpage* _trackedPages;
+  volatile size_t _trackedCount;
+#endif
+
 };
 
 #endif
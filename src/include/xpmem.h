@@ -0,0 +1,183 @@
+// -*- C++ -*-
+#ifndef _XPMEM_H_
+#define _XPMEM_H_
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   xpmem.h
+ * @brief  Cache line write-back for logs mapped from persistent memory.
+ */
+
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define XPMEM_X86
+#endif
+
+/* Stores to a DAX mapping are persistent once their cache lines are written
+ * back and the write-backs are fenced. flush() writes back every line of a
+ * range with the best instruction this cpu has, by CPUID:
+ *
+ *   clwb        writes the line back and may keep it cached
+ *   clflushopt  writes it back and evicts it
+ *   clflush     the same, but ordered against every other clflush
+ *
+ * clwb and clflushopt are only ordered by a fence, so a transaction issues
+ * its write-backs as its records are copied and ends with one fence().
+ * clflush is ordered already, the fence is then cheap.
+ */
+class xpmem {
+public:
+  enum kernel {
+    FLUSH_NONE = 0,
+    FLUSH_CLFLUSH,
+    FLUSH_CLFLUSHOPT,
+    FLUSH_CLWB,
+    FLUSH_NUM
+  };
+
+  enum { LineSize = 64 };
+
+  // CPUID feature bits: leaf 1 EDX, leaf 7 EBX
+  enum {
+    CPUID_CLFSH = 1U << 19,
+    CPUID_CLFLUSHOPT = 1U << 23,
+    CPUID_CLWB = 1U << 24
+  };
+
+  typedef void (*flushFunc)(const char * line, const char * end);
+
+  xpmem() {
+    _kernel = best();
+    _flush = getKernel(_kernel);
+  }
+
+  static xpmem& getInstance(void) {
+    static char buf[sizeof(xpmem)];
+    static xpmem * theOneTrueObject = new (buf) xpmem();
+    return *theOneTrueObject;
+  }
+
+  // Write back the cache lines of [addr, addr + length); returns their number.
+  inline unsigned long flush(const void * addr, unsigned long length) {
+    const char * line = (const char *)((uintptr_t)addr & ~(uintptr_t)(LineSize - 1));
+    const char * end = (const char *)addr + length;
+    if (length == 0 || _flush == NULL) {
+      return 0;
+    }
+    _flush(line, end);
+    return (end - line + LineSize - 1) / LineSize;
+  }
+
+  // Order every write-back issued so far before the stores that follow.
+  static inline void fence(void) {
+#ifdef XPMEM_X86
+    _mm_sfence();
+#else
+    __sync_synchronize();
+#endif
+  }
+
+  kernel current(void) {
+    return _kernel;
+  }
+
+  static const char * kernelName(kernel k) {
+    static const char * names[FLUSH_NUM] = { "none", "clflush", "clflushopt", "clwb" };
+    return names[k];
+  }
+
+  static bool supported(kernel k) {
+#ifdef XPMEM_X86
+    unsigned int eax, ebx, ecx, edx;
+    switch (k) {
+    case FLUSH_CLFLUSH:
+      return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & CPUID_CLFSH);
+    case FLUSH_CLFLUSHOPT:
+      return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & CPUID_CLFLUSHOPT);
+    case FLUSH_CLWB:
+      return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & CPUID_CLWB);
+    default:
+      return false;
+    }
+#else
+    return false;
+#endif
+  }
+
+  // The kernel for k, or NULL if this cpu cannot run it.
+  static flushFunc getKernel(kernel k) {
+    if (!supported(k)) {
+      return NULL;
+    }
+    switch (k) {
+#ifdef XPMEM_X86
+    case FLUSH_CLFLUSH:
+      return flushCLFLUSH;
+    case FLUSH_CLFLUSHOPT:
+      return flushCLFLUSHOPT;
+    case FLUSH_CLWB:
+      return flushCLWB;
+#endif
+    default:
+      return NULL;
+    }
+  }
+
+  static kernel best(void) {
+    for (int k = FLUSH_NUM - 1; k > FLUSH_NONE; k--) {
+      if (supported((kernel)k)) {
+        return (kernel)k;
+      }
+    }
+    return FLUSH_NONE;
+  }
+
+private:
+#ifdef XPMEM_X86
+  __attribute__((target("sse2")))
+  static void flushCLFLUSH(const char * line, const char * end) {
+    for (; line < end; line += LineSize) {
+      _mm_clflush(line);
+    }
+  }
+
+  __attribute__((target("clflushopt")))
+  static void flushCLFLUSHOPT(const char * line, const char * end) {
+    for (; line < end; line += LineSize) {
+      _mm_clflushopt((void *)line);
+    }
+  }
+
+  __attribute__((target("clwb")))
+  static void flushCLWB(const char * line, const char * end) {
+    for (; line < end; line += LineSize) {
+      _mm_clwb((void *)line);
+    }
+  }
+#endif
+
+  kernel _kernel;
+  flushFunc _flush;
+};
+
+#endif
@@ -0,0 +1,418 @@
+// -*- C++ -*-
+#ifndef _XREPLAY_H_
+#define _XREPLAY_H_
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   xreplay.h
+ * @brief  Parallel replay of the page logs of a crashed run.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "crc32c.h"
+#include "logger.h"
+#include "prof.h"
+#include "xlzcodec.h"
+#include "xworkers.h"
+
+/* Restoring a variable page by page reads every page with its own open and
+ * pread, and checks its transaction on the way. The replay instead restores
+ * every dirtied page of the heap up front, into an image of the heap:
+ *
+ *   1. the page lookup info is turned into a list of the records needed
+ *      from each log file, in file order;
+ *   2. the files are shared out among the xworkers helpers. A worker reads
+ *      its file front to back in ChunkSize reads, checks the checksum of
+ *      every record and the COMMIT record of every transaction, and unpacks
+ *      the needed PAGE, ZERO and LZ records into the image;
+ *   3. a page counts as restored once the COMMIT record of its transaction
+ *      has been found intact, the same rule nvrecovery applies.
+ *
+ * Pages the replay could not restore, DIFF records and pages whose log file
+ * was reclaimed by the log cleaner, are left to the page by page path.
+ *
+ * Workers are raw clone() threads: they read with raw system calls into
+ * buffers set up in advance and never allocate. After prepare() a file can
+ * also be replayed on its own with replayOne(), as lazy recovery does.
+ */
+class xreplay {
+public:
+  enum { ChunkSize = 4 * 1024 * 1024 };
+
+  xreplay() {
+    _image = NULL;
+    _restored = NULL;
+    _pages = 0;
+    _fileOf = NULL;
+    _files = NULL;
+    _numFiles = 0;
+  }
+
+  ~xreplay() {
+    release();
+    delete[] _files;
+  }
+
+  // Give back the image; nothing counts as restored afterwards.
+  void release(void) {
+    if (_image != NULL) {
+      munmap(_image, _pages * LogDefines::PageSize);
+      munmap(_restored, _pages);
+      munmap(_fileOf, _pages * sizeof(int));
+      _image = NULL;
+      _restored = NULL;
+      _fileOf = NULL;
+    }
+  }
+
+  // A record needed from a log file
+  struct need {
+    unsigned long offset;   // of the record header
+    int pageNo;
+    bool decoded;
+  };
+
+  struct file {
+    char path[FILENAME_MAX];
+    long key;               // threadID << 16 | xactID
+    struct need * needs;    // by offset
+    size_t count;
+    bool replayed;
+    unsigned long pages;    // restored
+    unsigned long bytes;    // read
+  };
+
+  // Whether the replay restored pageNo.
+  inline bool restored(int pageNo) {
+    return _restored != NULL && pageNo >= 0 && (size_t)pageNo < _pages && _restored[pageNo];
+  }
+
+  // The restored image of pageNo.
+  inline const char * page(int pageNo) {
+    return _image + (size_t)pageNo * LogDefines::PageSize;
+  }
+
+  // Ask for the image of pageNo logged by threadID in xactID at memlogOffset.
+  void addPage(int threadID, unsigned short xactID, int pageNo, unsigned long memlogOffset) {
+    long key = ((long)threadID << 16) | xactID;
+    struct need n;
+    n.offset = memlogOffset - LogDefines::RecordHeaderSize;
+    n.pageNo = pageNo;
+    n.decoded = false;
+    _needs[key].push_back(n);
+    if ((size_t)pageNo >= _pages) {
+      _pages = pageNo + 1;
+    }
+  }
+
+  // Set up the image and the list of files for the logs in memLogPath;
+  // false if there is nothing to replay or no memory for it.
+  bool prepare(const char * memLogPath) {
+    if (_needs.empty()) {
+      return false;
+    }
+
+    _image = (char *)mmap(NULL, _pages * LogDefines::PageSize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    _restored = (unsigned char *)mmap(NULL, _pages, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    _fileOf = (int *)mmap(NULL, _pages * sizeof(int), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (_image == MAP_FAILED || _restored == MAP_FAILED || _fileOf == MAP_FAILED) {
+      lprintf("Unable to map the replay image, recovering page by page\n");
+      _image = NULL;
+      _restored = NULL;
+      _fileOf = NULL;
+      return false;
+    }
+    memset(_fileOf, 0xFF, _pages * sizeof(int));
+
+    _numFiles = _needs.size();
+    _files = new struct file[_numFiles];
+    size_t f = 0;
+    for (std::map<long, std::vector<struct need> >::iterator it = _needs.begin(); it != _needs.end(); ++it, f++) {
+      sprintf(_files[f].path, "%sMemLog_%ld_%ld", memLogPath, it->first >> 16, it->first & 0xFFFF);
+      std::sort(it->second.begin(), it->second.end(), needBefore);
+      _files[f].key = it->first;
+      _files[f].needs = &it->second[0];
+      _files[f].count = it->second.size();
+      _files[f].replayed = false;
+      _files[f].pages = 0;
+      _files[f].bytes = 0;
+      for (size_t i = 0; i < _files[f].count; i++) {
+        _fileOf[_files[f].needs[i].pageNo] = f;
+      }
+    }
+
+    // Set up the checksum tables here, workers cannot run static initializers.
+    crc32c::compute(_image, 0);
+    return true;
+  }
+
+  // Restore every page asked for from the logs in memLogPath.
+  void run(const char * memLogPath) {
+    if (!prepare(memLogPath)) {
+      return;
+    }
+
+    int workers = xworkers::getInstance().available(_numFiles < xdefines::MAX_HELPER_THREADS + 1
+                                                    ? _numFiles : xdefines::MAX_HELPER_THREADS + 1);
+    _buffers = (char *)mmap(NULL, (size_t)workers * ChunkSize, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (_buffers == MAP_FAILED) {
+      lprintf("Unable to map the replay buffers, recovering page by page\n");
+      return;
+    }
+
+    _nextFile = 0;
+    xworkers::getInstance().run(replayShard, this, workers);
+    munmap(_buffers, (size_t)workers * ChunkSize);
+
+    unsigned long pages = 0;
+    unsigned long bytes = 0;
+    for (size_t f = 0; f < _numFiles; f++) {
+      pages += _files[f].pages;
+      bytes += _files[f].bytes;
+    }
+    ADD_COUNTER(replaypages, pages);
+    ADD_COUNTER(replaybytes, bytes);
+    lprintf("Replayed %lu pages from %zu logs with %d workers, read %lu bytes\n", pages, _numFiles, workers, bytes);
+  }
+
+  // Files of the replay, once prepared
+  inline size_t numFiles(void) {
+    return _numFiles;
+  }
+
+  inline struct file * getFile(size_t f) {
+    return &_files[f];
+  }
+
+  // The file pageNo is needed from, -1 if it is not.
+  inline int fileOf(int pageNo) {
+    return (_fileOf != NULL && pageNo >= 0 && (size_t)pageNo < _pages) ? _fileOf[pageNo] : -1;
+  }
+
+  // Pages past the last one asked for are not needed.
+  inline size_t pages(void) {
+    return _pages;
+  }
+
+  // Replay a single file with buf of ChunkSize bytes; may run on a raw thread.
+  void replayOne(struct file * file, char * buf) {
+    if (!file->replayed) {
+      replayFile(file, buf);
+      file->replayed = true;
+    }
+  }
+
+private:
+
+  // The transaction a worker is scanning
+  struct txnstate {
+    bool open;
+    unsigned long offset;   // of its TXN record
+    uint64_t xactID;
+    uint32_t sum;
+    uint32_t pages;
+    size_t first;           // first need of the transaction
+  };
+
+  static bool needBefore(const struct need & a, const struct need & b) {
+    return a.offset < b.offset;
+  }
+
+  static void replayShard(void * arg, int shard) {
+    xreplay * replay = (xreplay *)arg;
+    char * buf = replay->_buffers + (size_t)shard * ChunkSize;
+    size_t f;
+
+    while ((f = __sync_fetch_and_add(&replay->_nextFile, 1)) < replay->_numFiles) {
+      replay->replayOne(&replay->_files[f], buf);
+    }
+  }
+
+  // Read a log file front to back and unpack the needed records.
+  void replayFile(struct file * file, char * buf) {
+    long fd = xworkers::rawsyscall(SYS_openat, AT_FDCWD, (long)file->path, O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+
+    struct txnstate txn;
+    txn.open = false;
+    size_t next = 0;
+    unsigned long pos = 0;
+
+    // Past the last needed record only its COMMIT record is still of interest.
+    while (next < file->count || txn.open) {
+      long n = xworkers::rawsyscall(SYS_pread64, fd, (long)buf, ChunkSize, pos);
+      if (n <= 0) {
+        break;
+      }
+      file->bytes += n;
+
+      unsigned long at = 0;
+      while (at + LogDefines::RecordHeaderSize <= (unsigned long)n) {
+        struct LogRecordHeader * header = (struct LogRecordHeader *)(buf + at);
+        unsigned long offset = pos + at;
+
+        // Records are 8 byte aligned; look for the next one after garbage,
+        // a torn write or a hole punched by the log cleaner.
+        if (header->magic != LOG_RECORD_MAGIC || header->offset != offset
+            || header->length < LogDefines::RecordHeaderSize || header->length > LogDefines::PageRecordSize
+            || (header->length & 7) != 0) {
+          txn.open = false;
+          at += 8;
+          continue;
+        }
+        if (at + header->length > (unsigned long)n) {
+          break;
+        }
+
+        while (next < file->count && file->needs[next].offset < offset) {
+          next++;
+        }
+        scanRecord(file, header, offset, &txn, next);
+        if (next < file->count && file->needs[next].offset == offset) {
+          next++;
+        }
+        at += header->length;
+      }
+
+      // A record cut short by the end of the file.
+      if (at == 0) {
+        break;
+      }
+      pos += at;
+    }
+
+    xworkers::rawsyscall(SYS_close, fd, 0, 0);
+  }
+
+  // Follow the transaction and unpack the record if it is needed.
+  void scanRecord(struct file * file, struct LogRecordHeader * header, unsigned long offset,
+                  struct txnstate * txn, size_t next) {
+    uint32_t crc = header->crc;
+    header->crc = 0;
+    bool valid = (crc32c::compute(header, header->length) == crc);
+    header->crc = crc;
+
+    if (!valid) {
+      txn->open = false;
+      return;
+    }
+
+    switch (header->type) {
+    case LOG_RECORD_TXN:
+      txn->open = true;
+      txn->offset = offset;
+      txn->xactID = header->xactID;
+      txn->sum = crc32c::extend(0, &header->crc, sizeof(header->crc));
+      txn->pages = 0;
+      txn->first = next;
+      return;
+
+    case LOG_RECORD_COMMIT:
+      if (txn->open && header->xactID == txn->xactID && header->link == txn->offset
+          && header->count == txn->pages && header->sum == txn->sum) {
+        for (size_t i = txn->first; i < next; i++) {
+          if (file->needs[i].decoded) {
+            _restored[file->needs[i].pageNo] = 1;
+            file->pages++;
+          }
+        }
+      }
+      txn->open = false;
+      return;
+
+    case LOG_RECORD_PAGE:
+    case LOG_RECORD_DIFF:
+    case LOG_RECORD_ZERO:
+    case LOG_RECORD_LZ:
+      if (!txn->open || header->xactID != txn->xactID || header->link != txn->offset) {
+        txn->open = false;
+        return;
+      }
+      txn->sum = crc32c::extend(txn->sum, &header->crc, sizeof(header->crc));
+      txn->pages++;
+      if (next < file->count && file->needs[next].offset == offset && file->needs[next].pageNo == header->pageNo) {
+        file->needs[next].decoded = unpack(header);
+      }
+      return;
+
+    case LOG_RECORD_PAD:
+      return;
+
+    default:
+      txn->open = false;
+      return;
+    }
+  }
+
+  // Unpack the page image of a record into the image; DIFF records are not.
+  bool unpack(struct LogRecordHeader * header) {
+    char * body = (char *)header + LogDefines::RecordHeaderSize;
+    char * dest = _image + (size_t)header->pageNo * LogDefines::PageSize;
+
+    if (header->type == LOG_RECORD_PAGE) {
+      if (header->length != LogDefines::PageRecordSize) {
+        return false;
+      }
+      memcpy(dest, body, LogDefines::PageSize);
+      return true;
+    }
+    if (header->type != LOG_RECORD_ZERO && header->type != LOG_RECORD_LZ) {
+      return false;
+    }
+
+    struct LogPackHeader * pack = (struct LogPackHeader *)body;
+    if (pack->rawSize != LogDefines::PageSize
+        || LogDefines::RecordHeaderSize + sizeof(*pack) + pack->packedSize > header->length) {
+      return false;
+    }
+    // The image starts out zero.
+    if (header->type == LOG_RECORD_ZERO) {
+      return true;
+    }
+    return xlzcodec::decompress(pack + 1, pack->packedSize, dest, LogDefines::PageSize);
+  }
+
+  char * _image;
+  unsigned char * _restored;
+  int * _fileOf;
+  size_t _pages;
+
+  std::map<long, std::vector<struct need> > _needs;
+  struct file * _files;
+  size_t _numFiles;
+  volatile size_t _nextFile;
+  char * _buffers;
+};
+
+#endif
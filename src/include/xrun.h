@@ -73,6 +73,14 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "xbitmap.h"
 
+#ifdef GROUP_COMMIT
+#include "xgroupcommit.h"
+#endif
+
+#ifdef LOG_CLEANER
+#include "xlogcleaner.h"
+#endif
+
 #include "prof.h"
 
 #include "debug.h"
@@ -140,6 +148,11 @@ public:
             xthread::_localNvRecovery.initialize(true);
             xmemory::setThreadRecovery(&xthread::_localNvRecovery);
             
+#ifdef NVM_EMULATION
+            // The emulated device is shared by every thread
+            xnvmemu::getInstance().initialize();
+#endif
+
             // Initialize memory log
             xthread::_localMemoryLog.initialize(xthread::_localNvRecovery.nvid);
             xmemory::setThreadMemoryLog(&xthread::_localMemoryLog);                       
@@ -149,6 +162,19 @@ public:
             xmemory::createLookupInfo();
             xmemory::createDependenceInfo();
 
+#ifdef HEAP_IMAGE
+            // Map the heap of the crashed run back, needs the page lookup info
+            xmemory::attachHeapImage(&xthread::_localNvRecovery);
+#endif
+
+#ifdef GROUP_COMMIT
+            xgroupcommit::getInstance().initialize(xthread::_localNvRecovery.GetLogPath());
+#endif
+
+#ifdef LOG_CLEANER
+            xlogcleaner::getInstance().initialize(xthread::_localNvRecovery.memLogPath);
+#endif
+
             lprintf("xrun initialized\n");
         } else {
             fprintf(stderr, "xrun reinitialized");
@@ -182,6 +208,12 @@ public:
         return logPath;
     }
     static void finalize(void) {
+#ifdef GROUP_COMMIT
+        xgroupcommit::getInstance().waitPending();
+#endif
+#ifdef LOG_CLEANER
+        xlogcleaner::getInstance().finalize();
+#endif
         xmemory::finalize();
         xthread::_localMemoryLog.finalize();
         xthread::_localNvRecovery.finalize();
@@ -248,6 +280,12 @@ public:
 #endif
         
         atomicEnd(false);
+
+#ifdef GROUP_COMMIT
+        xgroupcommit::getInstance().waitPending();
+#endif
+        commitUnlockedCache();
+
         // Remove current thread and decrease the fence
         determ::getInstance().deregisterThread(_thread_index);
 
@@ -257,6 +295,10 @@ public:
         // Finalize varmap log
         xmemory::_localNvRecovery->finalize(); 
 
+#ifdef UFFD_TRACKING
+        // The descriptor table is shared, so the userfaultfd would outlive us.
+        xuffd::getInstance().detach();
+#endif
     }
 
     static inline void closeFence(void) {
@@ -284,6 +326,11 @@ public:
     /// @brief Spawn a thread.
     static inline void* spawn(threadFunction *fn, void *arg) {
 
+#ifdef LAZY_RECOVERY
+        // Only waits if the child cannot take over the pages not restored yet
+        xlazyrecovery::getInstance().beforeSpawn();
+#endif
+
         // If system is not protected, we should open protection.
         if ( !_protection_enabled ) {
             openMemoryProtection();
@@ -347,6 +394,8 @@ public:
 
         // Commit pageInfo
         commitCacheBuffer();
+#else
+        commitUnlockedCache();
 #endif
 
         if ( !_fence_enabled ) {
@@ -630,6 +679,15 @@ public:
     static void commitCacheBuffer(void){
         xmemory::commitCacheBuffer();
     }
+
+    // A transaction ended outside of every critical section: the page lookup
+    // info buffered so far is consistent, commit it or a crash before the next
+    // unlock recovers the pages as they were before.
+    static void commitUnlockedCache(void){
+        if ( GET_METACOUNTER(globalLockCountMax) == 0 ) {
+            commitCacheBuffer();
+        }
+    }
        
     static void mutex_unlock(pthread_mutex_t *mutex) {
         if ( !_fence_enabled )
@@ -710,6 +768,7 @@ public:
         }
         waitToken();
         atomicEnd(false);
+        commitUnlockedCache();
         determ::getInstance().barrier_wait(barrier, _thread_index);
 
         return 0;
@@ -783,9 +842,19 @@ public:
     static void atomicBegin(bool cleanup) {
         fflush(stdout);
 
+#ifdef GROUP_COMMIT
+        // The previous transaction must be durable before this one starts.
+        xgroupcommit::getInstance().waitPending();
+#endif
+
         if ( !_protection_enabled )
             return;
 
+#ifdef LOG_CLEANER
+        // Wait for the log cleaner if the logs exceed their budget.
+        xlogcleaner::getInstance().throttle();
+#endif
+
         // Now start.
         TRACE("=========%d: starts a Xact ==============\n", getpid());
         lprintf("-----------Xact starts---------\n");
@@ -0,0 +1,152 @@
+// -*- C++ -*-
+#ifndef _XSOFTDIRTY_H_
+#define _XSOFTDIRTY_H_
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   xsoftdirty.h
+ * @brief  Fault-free write tracking through the soft-dirty page table bits.
+ */
+
+#include <fcntl.h>
+#include <new>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "xdefines.h"
+
+/* Writing "4" to /proc/self/clear_refs clears the soft-dirty bit of every
+ * pte of the process; the kernel sets it again on the next write to the
+ * page, without delivering any signal. Bit 55 of a /proc/self/pagemap entry
+ * reports the bit.
+ *
+ * Both files are opened for every call: the descriptor table is shared
+ * between nvthreads processes, and /proc/self is resolved at open time.
+ *
+ * Kernels built without CONFIG_MEM_SOFT_DIRTY accept clear_refs but never
+ * set the bit, so availability is probed once by writing to a scratch page.
+ */
+class xsoftdirty {
+  enum { PM_SOFT_DIRTY = 55 };
+  enum { SCAN_ENTRIES = 512 };
+
+public:
+  xsoftdirty() {
+    _probed = false;
+    _available = false;
+  }
+
+  static xsoftdirty& getInstance(void) {
+    static char buf[sizeof(xsoftdirty)];
+    static xsoftdirty * theOneTrueObject = new (buf) xsoftdirty();
+    return *theOneTrueObject;
+  }
+
+  // Whether the running kernel maintains soft-dirty bits.
+  bool available(void) {
+    if (!_probed) {
+      _available = probe();
+      _probed = true;
+    }
+    return _available;
+  }
+
+  // Start a new tracking interval for the whole process.
+  bool clear(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd == -1) {
+      return false;
+    }
+    bool ret = (write(fd, "4", 1) == 1);
+    close(fd);
+    return ret;
+  }
+
+  // Call func(page) for every page in [start, start + pages * PageSize)
+  // written since the last clear(). Returns false if pagemap is unreadable.
+  template <class Func>
+  bool scan(void * start, size_t pages, Func& func) {
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    if (fd == -1) {
+      return false;
+    }
+
+    uint64_t entries[SCAN_ENTRIES];
+    off_t offset = ((uintptr_t)start / xdefines::PageSize) * sizeof(uint64_t);
+
+    for (size_t done = 0; done < pages; ) {
+      size_t n = pages - done;
+      if (n > SCAN_ENTRIES) {
+        n = SCAN_ENTRIES;
+      }
+
+      ssize_t bytes = pread(fd, entries, n * sizeof(uint64_t), offset + done * sizeof(uint64_t));
+      if (bytes <= 0) {
+        close(fd);
+        return false;
+      }
+
+      n = bytes / sizeof(uint64_t);
+      for (size_t i = 0; i < n; i++) {
+        if (entries[i] & (1ULL << PM_SOFT_DIRTY)) {
+          func(done + i);
+        }
+      }
+      done += n;
+    }
+
+    close(fd);
+    return true;
+  }
+
+private:
+  struct counter {
+    size_t pages;
+    counter() : pages(0) { }
+    void operator()(size_t page) { pages++; }
+  };
+
+  bool probe(void) {
+    volatile char * page = (volatile char *)mmap(NULL, xdefines::PageSize, PROT_READ | PROT_WRITE,
+                                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED) {
+      return false;
+    }
+
+    bool works = false;
+    page[0] = 1;
+    if (clear()) {
+      struct counter before;
+      struct counter after;
+
+      if (scan((void *)page, 1, before) && before.pages == 0) {
+        page[0] = 2;
+        works = (scan((void *)page, 1, after) && after.pages == 1);
+      }
+    }
+
+    munmap((void *)page, xdefines::PageSize);
+    return works;
+  }
+
+  bool _probed;
+  bool _available;
+};
+
+#endif
@@ -0,0 +1,216 @@
+// -*- C++ -*-
+#ifndef _XUFFD_H_
+#define _XUFFD_H_
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   xuffd.h
+ * @brief  Write tracking through userfaultfd write-protect mode.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+#include "xdefines.h"
+#include "xworkers.h"
+
+#ifndef UFFD_FEATURE_WP_UNPOPULATED
+#define UFFD_FEATURE_WP_UNPOPULATED (1 << 13)
+#endif
+
+/* Instead of a SIGSEGV and an mprotect() per page, write-protected pages
+ * raise a userfaultfd event. A handler thread owned by the process records
+ * the page through the region's callback and lifts the protection of that
+ * page, which also wakes the faulting thread. Protection for whole ranges
+ * is re-armed with a single UFFDIO_WRITEPROTECT.
+ *
+ * Write protection on shared memory requires a shmem backing file, so
+ * regions tracked this way are backed by memfd_create(). Unpopulated pages
+ * are protected with pte markers (UFFD_FEATURE_WP_UNPOPULATED), so pages
+ * dropped by MADV_DONTNEED stay protected once re-armed.
+ *
+ * A userfaultfd is bound to the address space that created it. A forked
+ * child loses the protection of its parent and has to attach a new one.
+ */
+class xuffd {
+  enum { MAX_REGIONS = 4 };
+
+public:
+  // Called by the handler thread with the address of a first write.
+  typedef void (*writeFunc)(void * owner, void * addr);
+
+  xuffd() {
+    _pid = 0;
+    _fd = -1;
+    _regions = 0;
+    _stack = NULL;
+  }
+
+  static xuffd& getInstance(void) {
+    static char buf[sizeof(xuffd)];
+    static xuffd * theOneTrueObject = new (buf) xuffd();
+    return *theOneTrueObject;
+  }
+
+  // Make sure the current process owns a userfaultfd and a handler thread.
+  bool attach(void) {
+    pid_t pid = syscall(SYS_getpid);
+    if (pid == _pid) {
+      return (_fd != -1);
+    }
+
+    // The descriptor table is shared between nvthreads processes, so the
+    // parent's descriptor must be left alone.
+    _pid = pid;
+    _fd = -1;
+    _regions = 0;
+
+    int fd = syscall(SYS_userfaultfd, O_CLOEXEC);
+    if (fd == -1) {
+      return false;
+    }
+
+    struct uffdio_api api;
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    api.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP | UFFD_FEATURE_WP_HUGETLBFS_SHMEM
+                   | UFFD_FEATURE_WP_UNPOPULATED;
+    if (ioctl(fd, UFFDIO_API, &api) != 0) {
+      close(fd);
+      return false;
+    }
+
+    _fd = fd;
+    if (!xworkers::spawnThread(handlerMain, this, &_stack)) {
+      close(fd);
+      _fd = -1;
+      return false;
+    }
+    return true;
+  }
+
+  // Release the userfaultfd of an exiting process.
+  void detach(void) {
+    if (_pid == syscall(SYS_getpid) && _fd != -1) {
+      close(_fd);
+      _fd = -1;
+    }
+  }
+
+  // Register [start, start + size) for write-protect tracking.
+  bool registerRange(void * start, size_t size, writeFunc func, void * owner) {
+    if (_fd == -1 || _regions == MAX_REGIONS) {
+      return false;
+    }
+
+    struct uffdio_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.range.start = (uintptr_t)start;
+    reg.range.len = size;
+    reg.mode = UFFDIO_REGISTER_MODE_WP;
+    if (ioctl(_fd, UFFDIO_REGISTER, &reg) != 0) {
+      return false;
+    }
+
+    struct region * r = &_region[_regions];
+    r->start = (uintptr_t)start;
+    r->end = (uintptr_t)start + size;
+    r->func = func;
+    r->owner = owner;
+    _regions++;
+    return true;
+  }
+
+  // The mapping of the region is gone (closeProtection), so is its registration.
+  void unregisterRange(void * start) {
+    for (int i = 0; i < _regions; i++) {
+      if (_region[i].start == (uintptr_t)start) {
+        _region[i] = _region[--_regions];
+        return;
+      }
+    }
+  }
+
+  // Arm or lift write protection for a page-aligned range.
+  inline bool protect(void * start, size_t size, bool enable) {
+    struct uffdio_writeprotect wp;
+    wp.range.start = (uintptr_t)start;
+    wp.range.len = size;
+    wp.mode = enable ? UFFDIO_WRITEPROTECT_MODE_WP : 0;
+    return (xworkers::rawsyscall(SYS_ioctl, _fd, UFFDIO_WRITEPROTECT, (long)&wp) == 0);
+  }
+
+private:
+  struct region {
+    uintptr_t start;
+    uintptr_t end;
+    writeFunc func;
+    void * owner;
+  };
+
+  static int handlerMain(void * arg) {
+    xuffd * uffd = (xuffd *)arg;
+    int fd = uffd->_fd;
+    struct uffd_msg msg;
+
+    while (true) {
+      long n = xworkers::rawsyscall(SYS_read, fd, (long)&msg, sizeof(msg));
+      if (n == -EINTR || n == -EAGAIN) {
+        continue;
+      } else if (n != sizeof(msg)) {
+        // The descriptor was closed.
+        return 0;
+      }
+
+      if (msg.event != UFFD_EVENT_PAGEFAULT
+          || !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+        continue;
+      }
+
+      uintptr_t addr = msg.arg.pagefault.address & ~(uintptr_t)xdefines::PAGE_SIZE_MASK;
+      for (int i = 0; i < uffd->_regions; i++) {
+        struct region * r = &uffd->_region[i];
+        if (addr >= r->start && addr < r->end) {
+          r->func(r->owner, (void *)addr);
+          break;
+        }
+      }
+
+      // Lifting the protection wakes up the faulting thread.
+      struct uffdio_writeprotect wp;
+      wp.range.start = addr;
+      wp.range.len = xdefines::PageSize;
+      wp.mode = 0;
+      xworkers::rawsyscall(SYS_ioctl, fd, UFFDIO_WRITEPROTECT, (long)&wp);
+    }
+    return 0;
+  }
+
+  pid_t _pid;
+  int _fd;
+  char * _stack;
+  int _regions;
+  struct region _region[MAX_REGIONS];
+};
+
+#endif
@@ -0,0 +1,327 @@
+// -*- C++ -*-
+#ifndef _XURING_H_
+#define _XURING_H_
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   xuring.h
+ * @brief  Asynchronous log writes through io_uring.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* A small io_uring of one process, driven through the raw system calls.
+ *
+ * Log writes are queued from one of two registered buffers and the caller
+ * goes on filling the other one. A durable point queues the last write
+ * linked to an fdatasync, drained behind every earlier write, and waits
+ * for that single completion.
+ *
+ * Writes that complete short are finished with pwrite(); the fdatasync
+ * linked to them is then cancelled by the kernel and done synchronously.
+ *
+ * The ring memory is shared with the kernel only, not with the nvthreads
+ * processes forked later; every process sets up its own ring.
+ */
+class xuring {
+  enum { ENTRIES = 16 };
+  enum { BUFFERS = 2 };
+
+public:
+  // No constructor: the owning MemoryLog is a static object that can be
+  // set up before its constructor runs, so the state relies on zero
+  // initialization and is only valid once setup() recorded the pid.
+
+  // Set up the ring of the current process. Returns false when io_uring
+  // is not available; the caller then stays with synchronous writes.
+  bool setup(void) {
+    pid_t pid = syscall(SYS_getpid);
+    if (pid == _pid) {
+      return (_fd != -1);
+    }
+
+    // What was inherited belongs to the parent; its descriptor is shared.
+    if (_pid != 0 && _fd != -1) {
+      unmapRings();
+    }
+    _pid = pid;
+    _fd = -1;
+    _queued = 0;
+    _inflight = 0;
+    _registered = false;
+    memset(_slot, 0, sizeof(_slot));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(SYS_io_uring_setup, ENTRIES, &params);
+    if (fd == -1) {
+      return false;
+    }
+
+    _sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    _sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    _sqRing = (char*)mmap(NULL, _sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    _cqRing = (char*)mmap(NULL, _cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    _sqes = (struct io_uring_sqe*)mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                       fd, IORING_OFF_SQES);
+    if (_sqRing == MAP_FAILED || _cqRing == MAP_FAILED || _sqes == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+
+    _sqHead = (unsigned*)(_sqRing + params.sq_off.head);
+    _sqTail = (unsigned*)(_sqRing + params.sq_off.tail);
+    _sqMask = *(unsigned*)(_sqRing + params.sq_off.ring_mask);
+    _sqArray = (unsigned*)(_sqRing + params.sq_off.array);
+    _cqHead = (unsigned*)(_cqRing + params.cq_off.head);
+    _cqTail = (unsigned*)(_cqRing + params.cq_off.tail);
+    _cqMask = *(unsigned*)(_cqRing + params.cq_off.ring_mask);
+    _cqes = (struct io_uring_cqe*)(_cqRing + params.cq_off.cqes);
+
+    _fd = fd;
+    return true;
+  }
+
+  // Release the ring of an exiting process.
+  void teardown(void) {
+    if (_pid == syscall(SYS_getpid) && _fd != -1) {
+      unmapRings();
+      close(_fd);
+      _fd = -1;
+    }
+  }
+
+  // Register the buffers writes are issued from. Nothing may be in flight.
+  void registerBuffers(char* buf0, char* buf1, unsigned long size) {
+    if (_registered) {
+      syscall(SYS_io_uring_register, _fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    }
+    struct iovec iov[BUFFERS];
+    iov[0].iov_base = buf0;
+    iov[0].iov_len = size;
+    iov[1].iov_base = buf1;
+    iov[1].iov_len = size;
+    // Unregistered buffers still work, just with plain writes.
+    _registered = (syscall(SYS_io_uring_register, _fd, IORING_REGISTER_BUFFERS, iov, BUFFERS) == 0);
+  }
+
+  // Queue a write from registered buffer "index" and submit it.
+  void write(int fd, char* buf, unsigned long len, off_t offset, int index) {
+    waitBuffer(index);
+    prepWrite(fd, buf, len, offset, index, 0);
+    submit(0);
+  }
+
+  // Queue the last write of a transaction linked to an fdatasync of the
+  // file, behind all writes in flight, and wait until it is durable.
+  void writeDurable(int fd, char* buf, unsigned long len, off_t offset, int index) {
+    if (len > 0) {
+      waitBuffer(index);
+      prepWrite(fd, buf, len, offset, index, IOSQE_IO_LINK | IOSQE_IO_DRAIN);
+    }
+    struct io_uring_sqe* sqe = nextSqe();
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->flags = (len > 0) ? 0 : IOSQE_IO_DRAIN;
+    sqe->fd = fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = SYNC_TAG | (uint64_t)fd;
+    _inflight++;
+    submit(0);
+
+    _synced = false;
+    _repaired = false;
+    waitAll();
+    if (!_synced || _repaired) {
+      if (fdatasync(fd) != 0) {
+        perror("fdatasync(): ");
+        abort();
+      }
+    }
+  }
+
+  // Wait for the completion of the write issued from buffer "index", if any.
+  void waitBuffer(int index) {
+    while (_slot[index].busy) {
+      reap(true);
+    }
+  }
+
+  // Wait for every completion.
+  void waitAll(void) {
+    while (_inflight > 0) {
+      reap(true);
+    }
+  }
+
+private:
+  static const uint64_t SYNC_TAG = 1ULL << 63;
+
+  struct slot {
+    bool busy;
+    int fd;
+    char* buf;
+    unsigned long len;
+    off_t offset;
+  };
+
+  struct io_uring_sqe* nextSqe(void) {
+    unsigned tail = *_sqTail;
+    // The ring has room for a chain; make sure the kernel consumed older entries.
+    while (tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= ENTRIES) {
+      submit(0);
+    }
+    unsigned index = tail & _sqMask;
+    struct io_uring_sqe* sqe = &_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    _sqArray[index] = index;
+    __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+    _queued++;
+    return sqe;
+  }
+
+  void prepWrite(int fd, char* buf, unsigned long len, off_t offset, int index, int flags) {
+    struct slot* s = &_slot[index];
+    s->busy = true;
+    s->fd = fd;
+    s->buf = buf;
+    s->len = len;
+    s->offset = offset;
+
+    struct io_uring_sqe* sqe = nextSqe();
+    sqe->opcode = _registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->flags = flags;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = _registered ? index : 0;
+    sqe->user_data = index;
+    _inflight++;
+  }
+
+  void submit(unsigned wait) {
+    while (true) {
+      long rv = syscall(SYS_io_uring_enter, _fd, _queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+      if (rv >= 0) {
+        _queued -= (rv < (long)_queued) ? rv : _queued;
+        return;
+      }
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        perror("io_uring_enter(): ");
+        abort();
+      }
+    }
+  }
+
+  // Handle the available completions, waiting for one if "block" is set.
+  void reap(bool block) {
+    unsigned head = *_cqHead;
+    if (head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE)) {
+      if (!block) {
+        return;
+      }
+      submit(1);
+      return;
+    }
+
+    while (head != __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe* cqe = &_cqes[head & _cqMask];
+      complete(cqe->user_data, cqe->res);
+      head++;
+      __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+    }
+  }
+
+  void complete(uint64_t tag, int res) {
+    _inflight--;
+    if (tag & SYNC_TAG) {
+      // A cancelled fdatasync is redone by writeDurable().
+      if (res < 0 && res != -ECANCELED) {
+        errno = -res;
+        perror("io_uring fdatasync: ");
+        abort();
+      }
+      _synced = (res == 0);
+      return;
+    }
+
+    struct slot* s = &_slot[tag];
+    unsigned long done = (res > 0) ? res : 0;
+    if (res < 0 && res != -EINTR && res != -EAGAIN && res != -ECANCELED) {
+      errno = -res;
+      perror("io_uring write: ");
+      abort();
+    }
+    if (done < s->len) {
+      // Finish what the kernel did not write.
+      _repaired = true;
+      while (done < s->len) {
+        ssize_t sz = pwrite(s->fd, s->buf + done, s->len - done, s->offset + done);
+        if (sz == -1) {
+          perror("pwrite (records): ");
+          abort();
+        }
+        done += sz;
+      }
+    }
+    s->busy = false;
+  }
+
+  void unmapRings(void) {
+    munmap(_sqRing, _sqSize);
+    munmap(_cqRing, _cqSize);
+    munmap(_sqes, _sqesSize);
+  }
+
+  pid_t _pid;
+  int _fd;
+  unsigned _queued;
+  int _inflight;
+  bool _registered;
+  bool _synced;
+  bool _repaired;
+  struct slot _slot[BUFFERS];
+
+  char* _sqRing;
+  char* _cqRing;
+  struct io_uring_sqe* _sqes;
+  size_t _sqSize;
+  size_t _cqSize;
+  size_t _sqesSize;
+  unsigned* _sqHead;
+  unsigned* _sqTail;
+  unsigned* _sqArray;
+  unsigned _sqMask;
+  unsigned* _cqHead;
+  unsigned* _cqTail;
+  unsigned _cqMask;
+  struct io_uring_cqe* _cqes;
+};
+
+#endif
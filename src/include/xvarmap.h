@@ -0,0 +1,252 @@
+// -*- C++ -*-
+#ifndef _XVARMAP_H_
+#define _XVARMAP_H_
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   xvarmap.h
+ * @brief  Binary variable map with an on-disk hash index.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "crc32c.h"
+
+// Variables nvmalloc() can name in one run.
+#ifndef NVTHREAD_VARMAP_RECORDS
+#define NVTHREAD_VARMAP_RECORDS (1UL << 20)
+#endif
+
+// The index is probed by masking with its size.
+#if NVTHREAD_VARMAP_RECORDS <= 0 || (NVTHREAD_VARMAP_RECORDS & (NVTHREAD_VARMAP_RECORDS - 1)) != 0
+#error "NVTHREAD_VARMAP_RECORDS must be a power of two"
+#endif
+
+#define VARMAP_MAGIC 0x4e565641524d4150ULL
+
+/* varmap = variable mapping, variable name <-> metadata */
+struct varmap_entry {
+    char name[128];
+    size_t size;
+    int pageNo;
+    int pageOffset;
+};
+
+/* The variable map is one file, mapped shared by every thread of the run:
+ *
+ *   [ header page | index: Buckets slots | Records fixed size records ]
+ *
+ * nvmalloc() claims the next record, fills it in and links it into the
+ * index, an open addressing table of record numbers probed linearly from
+ * the hash of the name. Claims and links are atomic, so threads append
+ * without a lock. The first variable of a name is the one found, as with
+ * the text map this replaces.
+ *
+ * Nothing is synced on nvmalloc(); sync() makes the appended records
+ * durable before the transaction that follows commits, so a variable is
+ * in the map once data of it can be recovered. A record carries a checksum;
+ * one torn by a crash is not found, and a record whose index slot was lost
+ * is found by scanning the records.
+ *
+ * The file is sparse: only the pages of records and slots in use take
+ * space. Threads forked after open() share the mapping. The object has no
+ * constructor, as nvrecovery is set up before static constructors run.
+ */
+class xvarmap {
+public:
+  enum { Records = NVTHREAD_VARMAP_RECORDS };
+  enum { Buckets = 2 * NVTHREAD_VARMAP_RECORDS };
+  enum { HeaderSize = 4096 };
+
+  struct header {
+    uint64_t magic;
+    uint64_t records;
+    uint64_t buckets;
+    uint64_t recordSize;
+    volatile uint64_t count;    // records claimed
+  };
+
+  struct record {
+    struct varmap_entry entry;
+    uint64_t hash;
+    uint32_t crc;               // of the record with crc 0
+    uint32_t pad;
+  };
+
+  // Create the map at path, or with create false open the one there.
+  // Returns false if the file cannot be mapped or is not a variable map.
+  bool open(const char * path, bool create) {
+    _map = NULL;
+    int fd = ::open(path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY, 0644);
+    if (fd == -1) {
+      return false;
+    }
+    if (create && ftruncate(fd, fileSize()) != 0) {
+      ::close(fd);
+      return false;
+    }
+
+    // The descriptor table is shared by all threads; the mapping is enough.
+    int prot = create ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    void * map = mmap(NULL, fileSize(), prot, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+      return false;
+    }
+    _map = (char *)map;
+    _header = (struct header *)_map;
+    _index = (volatile uint32_t *)(_map + HeaderSize);
+    _records = (struct record *)(_map + HeaderSize + Buckets * sizeof(uint32_t));
+    _dirtyEnd = 0;
+
+    if (create) {
+      _header->records = Records;
+      _header->buckets = Buckets;
+      _header->recordSize = sizeof(struct record);
+      _header->count = 0;
+      _header->magic = VARMAP_MAGIC;
+    } else if (_header->magic != VARMAP_MAGIC || _header->records != Records
+               || _header->buckets != Buckets || _header->recordSize != sizeof(struct record)) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close(void) {
+    if (_map != NULL) {
+      munmap(_map, fileSize());
+      _map = NULL;
+    }
+  }
+
+  bool mapped(void) {
+    return _map != NULL;
+  }
+
+  // Add a variable; durable once sync() returns.
+  void append(const char * name, size_t size, int pageNo, int pageOffset) {
+    uint64_t n = __sync_fetch_and_add(&_header->count, 1);
+    if (n >= Records) {
+      fprintf(stderr, "%d: more than %lu variables, raise NVTHREAD_VARMAP_RECORDS\n", getpid(), (unsigned long)Records);
+      ::abort();
+    }
+
+    struct record * r = &_records[n];
+    memset(r, 0, sizeof(*r));
+    strncpy(r->entry.name, name, sizeof(r->entry.name) - 1);
+    r->entry.size = size;
+    r->entry.pageNo = pageNo;
+    r->entry.pageOffset = pageOffset;
+    r->hash = hash(r->entry.name);
+    r->crc = crc32c::compute(r, sizeof(*r));
+
+    for (uint64_t b = r->hash & (Buckets - 1); ; b = (b + 1) & (Buckets - 1)) {
+      uint32_t slot = _index[b];
+      if (slot == 0 && __sync_bool_compare_and_swap(&_index[b], 0, (uint32_t)(n + 1))) {
+        break;
+      }
+      slot = _index[b];
+      // An earlier variable of the same name keeps the slot.
+      if (sameName(&_records[slot - 1], r)) {
+        break;
+      }
+    }
+
+    unsigned long end = HeaderSize + Buckets * sizeof(uint32_t) + (n + 1) * sizeof(struct record);
+    if (end > _dirtyEnd) {
+      _dirtyEnd = end;
+    }
+  }
+
+  // Make the records appended by this process durable.
+  void sync(void) {
+    if (_dirtyEnd == 0) {
+      return;
+    }
+    if (msync(_map, (_dirtyEnd + HeaderSize - 1) & ~(unsigned long)(HeaderSize - 1), MS_SYNC) != 0) {
+      fprintf(stderr, "%d: msync of the variable map failed: %s\n", getpid(), strerror(errno));
+      ::abort();
+    }
+    _dirtyEnd = 0;
+  }
+
+  // The variable named name, NULL if there is none.
+  struct varmap_entry * find(const char * name) {
+    char key[sizeof(((struct varmap_entry *)0)->name)];
+    memset(key, 0, sizeof(key));
+    strncpy(key, name, sizeof(key) - 1);
+    uint64_t h = hash(key);
+
+    for (uint64_t b = h & (Buckets - 1); _index[b] != 0; b = (b + 1) & (Buckets - 1)) {
+      struct record * r = &_records[_index[b] - 1];
+      if (r->hash == h && intact(r) && strcmp(r->entry.name, key) == 0) {
+        return &r->entry;
+      }
+    }
+
+    // The slot may not have reached the disk when the record did.
+    uint64_t count = (_header->count < Records) ? _header->count : Records;
+    for (uint64_t n = 0; n < count; n++) {
+      struct record * r = &_records[n];
+      if (r->hash == h && intact(r) && strcmp(r->entry.name, key) == 0) {
+        return &r->entry;
+      }
+    }
+    return NULL;
+  }
+
+  static size_t fileSize(void) {
+    return HeaderSize + Buckets * sizeof(uint32_t) + Records * sizeof(struct record);
+  }
+
+private:
+  // FNV-1a
+  static uint64_t hash(const char * name) {
+    uint64_t h = 14695981039346656037ULL;
+    for (; *name != '\0'; name++) {
+      h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+    }
+    return h;
+  }
+
+  static bool intact(struct record * r) {
+    struct record copy = *r;
+    copy.crc = 0;
+    return crc32c::compute(&copy, sizeof(copy)) == r->crc;
+  }
+
+  static bool sameName(struct record * a, struct record * b) {
+    return a->hash == b->hash && strcmp(a->entry.name, b->entry.name) == 0;
+  }
+
+  char * _map;
+  struct header * _header;
+  volatile uint32_t * _index;
+  struct record * _records;
+  unsigned long _dirtyEnd;      // bytes of the file appended to since the last sync
+};
+
+#endif
@@ -0,0 +1,236 @@
+// -*- C++ -*-
+#ifndef _XWORKERS_H_
+#define _XWORKERS_H_
+/*
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+/*
+ * @file   xworkers.h
+ * @brief  Per-process pool of helper threads used to split bulk page work.
+ */
+
+#include <errno.h>
+#include <new>
+#include <stdint.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "xdefines.h"
+
+/* Every nvthreads "thread" is a separate process, so the helpers have to be
+ * spawned per process. They are created lazily the first time a job is
+ * run and again whenever the pid changes, since a forked child only inherits
+ * the calling thread.
+ *
+ * Helpers are raw clone() threads sharing the address space of the owner.
+ * They never touch malloc, stdio or TLS, run with all signals blocked and
+ * are torn down implicitly by exit_group() when the owner process exits.
+ */
+class xworkers {
+public:
+  enum { HELPER_STACK_SIZE = 65536 };
+
+  // A job works on shards [0, shards); each call handles one shard.
+  typedef void (*jobFunc)(void * arg, int shard);
+
+  xworkers() {
+    _pid = 0;
+    _helpers = 0;
+    for (int i = 0; i < xdefines::MAX_HELPER_THREADS; i++) {
+      _stacks[i] = NULL;
+    }
+  }
+
+  static xworkers& getInstance(void) {
+    static char buf[sizeof(xworkers)];
+    static xworkers * theOneTrueObject = new (buf) xworkers();
+    return *theOneTrueObject;
+  }
+
+  // How many threads (helpers plus the caller), up to "wanted", can work on a job.
+  int available(int wanted) {
+    checkHelpers(wanted - 1);
+    return (_helpers + 1 < wanted) ? _helpers + 1 : wanted;
+  }
+
+  // Run a job with shards split between the caller and the helpers.
+  // Returns when every shard has been processed.
+  void run(jobFunc func, void * arg, int shards) {
+    checkHelpers(shards - 1);
+
+    int generation = _generation + 1;
+
+    _func = func;
+    _arg = arg;
+    _shards = shards;
+    _doneShards = 0;
+    __sync_synchronize();
+
+    // Shards are claimed from a counter tagged with the job generation, so a
+    // helper that wakes up late can never pick up a shard of a newer job.
+    _claim = (uint64_t)generation << 32;
+    _generation = generation;
+
+    if (_helpers > 0 && shards > 1) {
+      futex(&_generation, FUTEX_WAKE_PRIVATE, _helpers);
+    }
+
+    work(generation);
+
+    // Wait for the shards that were picked up by helpers.
+    int done;
+    while ((done = _doneShards) != shards) {
+      futex(&_doneShards, FUTEX_WAIT_PRIVATE, done);
+    }
+  }
+
+  // Helper threads share the owner's TLS, so they must not make system calls
+  // through the libc wrappers, which would store failures into the owner's errno.
+  static long rawsyscall(long number, long a1, long a2, long a3, long a4 = 0) {
+#if defined(__x86_64__)
+    long ret;
+    register long r10 asm("r10") = a4;
+    asm volatile("syscall"
+                 : "=a"(ret)
+                 : "0"(number), "D"(a1), "S"(a2), "d"(a3), "r"(r10)
+                 : "rcx", "r11", "memory");
+    return ret;
+#else
+    long ret = syscall(number, a1, a2, a3, a4);
+    return (ret == -1) ? -errno : ret;
+#endif
+  }
+
+  // Start a helper thread running fn(arg) on a stack of its own. The thread
+  // inherits a fully blocked signal mask, so the SIGSEGV handler and the
+  // SIGUSR1 ownership notifications stay on the owner.
+  static bool spawnThread(int (*fn)(void *), void * arg, char ** stack) {
+    if (*stack == NULL) {
+      void * area = mmap(NULL, HELPER_STACK_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+      if (area == MAP_FAILED) {
+        return false;
+      }
+      *stack = (char *)area;
+    }
+
+    sigset_t all, old;
+    sigfillset(&all);
+    sigprocmask(SIG_SETMASK, &all, &old);
+
+    int tid = clone(fn, *stack + HELPER_STACK_SIZE,
+                    CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND
+                    | CLONE_THREAD | CLONE_SYSVSEM, arg);
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return (tid != -1);
+  }
+
+private:
+  static long futex(volatile int * addr, int op, int val) {
+    return rawsyscall(SYS_futex, (long)addr, op, val, 0);
+  }
+
+  void work(int generation) {
+    while (true) {
+      uint64_t claim = _claim;
+      int shard = (int)(claim & 0xFFFFFFFF);
+
+      if ((int)(claim >> 32) != generation || shard >= _shards) {
+        return;
+      }
+      if (!__sync_bool_compare_and_swap(&_claim, claim, claim + 1)) {
+        continue;
+      }
+
+      _func(_arg, shard);
+      if (__sync_add_and_fetch(&_doneShards, 1) == _shards) {
+        futex(&_doneShards, FUTEX_WAKE_PRIVATE, 1);
+      }
+    }
+  }
+
+  static int helperMain(void * arg) {
+    xworkers * pool = (xworkers *)arg;
+    int seen = pool->_generation;
+
+    while (true) {
+      int generation;
+      while ((generation = pool->_generation) == seen) {
+        futex(&pool->_generation, FUTEX_WAIT_PRIVATE, seen);
+      }
+      seen = generation;
+      pool->work(generation);
+    }
+    return 0;
+  }
+
+  // Make sure this process owns up to "wanted" helpers.
+  void checkHelpers(int wanted) {
+    pid_t pid = syscall(SYS_getpid);
+
+    if (pid != _pid) {
+      // Helpers of the parent do not exist in a forked child.
+      _pid = pid;
+      _helpers = 0;
+      _generation = 0;
+
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      _maxHelpers = (cpus > 1) ? cpus - 1 : 0;
+      if (_maxHelpers > xdefines::MAX_HELPER_THREADS) {
+        _maxHelpers = xdefines::MAX_HELPER_THREADS;
+      }
+    }
+
+    if (wanted > _maxHelpers) {
+      wanted = _maxHelpers;
+    }
+
+    while (_helpers < wanted) {
+      if (!spawnHelper(_helpers)) {
+        // Stay with what we have; the caller always takes part in the job.
+        _maxHelpers = _helpers;
+        break;
+      }
+      _helpers++;
+    }
+  }
+
+  bool spawnHelper(int index) {
+    return spawnThread(helperMain, this, &_stacks[index]);
+  }
+
+  pid_t _pid;
+  int _helpers;
+  int _maxHelpers;
+  char * _stacks[xdefines::MAX_HELPER_THREADS];
+
+  // Current job.
+  jobFunc _func;
+  void * _arg;
+  int _shards;
+  volatile uint64_t _claim;
+  volatile int _doneShards;
+  volatile int _generation;
+};
+
+#endif
@@ -124,9 +124,56 @@ void dump_stats(void){
     PRINT_COUNTER(dirtypage_owned);
     PRINT_COUNTER(dirtypage_inserted);
     PRINT_COUNTER(faults);
+    PRINT_COUNTER(trackarms);
+    PRINT_COUNTER(softdirtyswitch);
+    PRINT_COUNTER(softdirtyscans);
+    PRINT_COUNTER(softdirtypages);
+    PRINT_COUNTER(updatecalls);
+    PRINT_COUNTER(updatepages);
+    PRINT_COUNTER(retainedpages);
+    PRINT_COUNTER(retaindrops);
+    PRINT_COUNTER(silentpages);
+    PRINT_COUNTER(twinreused);
+    PRINT_COUNTER(pageentrychunks);
+    PRINT_COUNTER(logcopied);
+    PRINT_COUNTER(diffpages);
+    PRINT_COUNTER(diffbytes);
+    PRINT_COUNTER(zeropages);
+    PRINT_COUNTER(lzpages);
+    PRINT_COUNTER(packraw);
+    PRINT_COUNTER(packbytes);
+    PRINT_COUNTER(packtime);
+#ifdef ENABLE_PROFILING
+    if (global_data->stats.packbytes_count > 0) {
+      fprintf(stderr, " pack ratio: %.2f, cost: %.1f us/MB\n",
+              (double)global_data->stats.packraw_count / global_data->stats.packbytes_count,
+              (double)global_data->stats.packtime_count / 1000 / ((double)global_data->stats.packraw_count / 1048576));
+    }
+#endif
+    PRINT_COUNTER(groupflushes);
+    PRINT_COUNTER(groupcommits);
+    PRINT_COUNTER(groupwait);
+    PRINT_COUNTER(cleanrounds);
+    PRINT_COUNTER(cleanfolded);
+    PRINT_COUNTER(cleanreclaimed);
+    PRINT_COUNTER(cleanwait);
+    PRINT_COUNTER(pmemlines);
+    PRINT_COUNTER(nvmdelay);
+    PRINT_COUNTER(replaypages);
+    PRINT_COUNTER(replaybytes);
+    PRINT_COUNTER(recoverfiles);
+    PRINT_COUNTER(tornpages);
+    PRINT_COUNTER(imagepages);
+    PRINT_COUNTER(lazyfaults);
+#ifdef ENABLE_PROFILING
+    fprintf(stderr, " groupsaved count: %lu\n",
+            (unsigned long)(global_data->stats.groupcommits_count - global_data->stats.groupflushes_count));
+#endif
+    fprintf(stderr, " twinhighwater count: %d\n", xbitmap::getInstance().highWater());
     PRINT_COUNTER(twinpage);
     PRINT_COUNTER(suspectpage);
     PRINT_COUNTER(slowpage);
+    PRINT_COUNTER(parallelcommit);
     PRINT_COUNTER(lazypage);
     PRINT_COUNTER(shorttrans);
 
@@ -147,6 +194,10 @@ void dump_stats(void){
 
 void finalize() {
 
+#ifdef LAZY_RECOVERY
+    // The image is complete, and its pages counted, before the heap goes
+    xlazyrecovery::getInstance().finish();
+#endif
 #ifdef ENABLE_PROFILING
     dump_stats();
 #endif
@@ -0,0 +1,155 @@
+/*
+ * Microbenchmark for the page diff-and-merge kernels in xpagediff.h.
+ *
+ * For each kernel the cpu supports, merges pages where 1%, 10% and 100% of
+ * the bytes differ from the twin and reports the throughput in bytes of
+ * page processed per second. The old _mm_maskmoveu_si128 loop is measured
+ * as well for reference.
+ *
+ * The equality kernels are then checked against memcmp() on pages differing
+ * in one byte at every position class, and timed on identical pages, their
+ * worst case.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <emmintrin.h>
+
+#include "xpagediff.h"
+
+// Keep prof.h happy; the benchmark does not collect statistics.
+runtime_data_t *global_data;
+
+#define NPAGES 256
+#define ROUNDS 200
+
+static void mergeMaskmove(const void *local, const void *twin, void *dest) {
+    const __m128i *localbuf = (const __m128i *)local;
+    const __m128i *twinbuf = (const __m128i *)twin;
+    __m128i *destbuf = (__m128i *)dest;
+    __m128i allones = _mm_set1_epi32(-1);
+
+    for (size_t i = 0; i < xdefines::PageSize / sizeof(__m128i); i++) {
+        __m128i localChunk = _mm_load_si128(&localbuf[i]);
+        __m128i eqChunk = _mm_cmpeq_epi8(localChunk, _mm_load_si128(&twinbuf[i]));
+        _mm_maskmoveu_si128(localChunk, _mm_xor_si128(allones, eqChunk), (char *)&destbuf[i]);
+    }
+}
+
+static char *pages(void) {
+    char *p = (char *)mmap(NULL, NPAGES * xdefines::PageSize, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(-1);
+    }
+    return p;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+    const size_t bytes = NPAGES * xdefines::PageSize;
+    const int percents[] = { 1, 10, 100 };
+    char *local = pages(), *twin = pages(), *dest = pages(), *expect = pages();
+
+    srand(12345);
+    printf("%-10s %8s %14s\n", "kernel", "modified", "bytes/sec");
+
+    for (int p = 0; p < 3; p++) {
+        for (size_t i = 0; i < bytes; i++) {
+            twin[i] = rand();
+            local[i] = twin[i];
+            if (rand() % 100 < percents[p]) {
+                local[i] = ~twin[i];
+            }
+        }
+
+        // Reference result from the scalar kernel.
+        memset(expect, 0x5a, bytes);
+        for (int n = 0; n < NPAGES; n++) {
+            xpagediff::getKernel(xpagediff::KERNEL_SCALAR)(local + n * xdefines::PageSize,
+                                                           twin + n * xdefines::PageSize,
+                                                           expect + n * xdefines::PageSize);
+        }
+
+        for (int k = -1; k < xpagediff::KERNEL_NUM; k++) {
+            xpagediff::mergeFunc merge;
+            const char *name;
+
+            if (k < 0) {
+                merge = mergeMaskmove;
+                name = "maskmoveu";
+            } else {
+                merge = xpagediff::getKernel((xpagediff::kernel)k);
+                name = xpagediff::kernelName((xpagediff::kernel)k);
+            }
+            if (merge == NULL) {
+                printf("%-10s %7d%% %14s\n", name, percents[p], "unsupported");
+                continue;
+            }
+
+            memset(dest, 0x5a, bytes);
+            double start = now();
+            for (int r = 0; r < ROUNDS; r++) {
+                for (int n = 0; n < NPAGES; n++) {
+                    merge(local + n * xdefines::PageSize, twin + n * xdefines::PageSize,
+                          dest + n * xdefines::PageSize);
+                }
+            }
+            double elapsed = now() - start;
+
+            if (memcmp(dest, expect, bytes) != 0) {
+                printf("%-10s %7d%% %14s\n", name, percents[p], "WRONG RESULT");
+                return 1;
+            }
+            printf("%-10s %7d%% %14.3e\n", name, percents[p], (double)bytes * ROUNDS / elapsed);
+        }
+    }
+
+    // Equality kernels.
+    memcpy(local, twin, bytes);
+    for (int k = 0; k < xpagediff::KERNEL_NUM; k++) {
+        xpagediff::equalFunc equal = xpagediff::getEqualKernel((xpagediff::kernel)k);
+        const char *name = xpagediff::kernelName((xpagediff::kernel)k);
+
+        if (equal == NULL) {
+            printf("%-10s %8s %14s\n", name, "equal", "unsupported");
+            continue;
+        }
+
+        for (size_t off = 0; off < xdefines::PageSize; off += 61) {
+            local[off] = ~local[off];
+            bool same = equal(local, twin);
+            local[off] = ~local[off];
+            if (same || !equal(local, twin)) {
+                printf("%-10s %8s %14s\n", name, "equal", "WRONG RESULT");
+                return 1;
+            }
+        }
+
+        int found = 0;
+        double start = now();
+        for (int r = 0; r < ROUNDS; r++) {
+            for (int n = 0; n < NPAGES; n++) {
+                found += equal(local + n * xdefines::PageSize, twin + n * xdefines::PageSize);
+            }
+        }
+        double elapsed = now() - start;
+
+        if (found != ROUNDS * NPAGES) {
+            printf("%-10s %8s %14s\n", name, "equal", "WRONG RESULT");
+            return 1;
+        }
+        printf("%-10s %8s %14.3e\n", name, "equal", (double)bytes * ROUNDS / elapsed);
+    }
+
+    printf("selected kernel: %s\n", xpagediff::kernelName(xpagediff::getInstance().current()));
+    return 0;
+}
@@ -0,0 +1,51 @@
+#!/bin/bash
+# Run each test twice: the first run crashes, the second one recovers and
+# exits with 0 only if it recovered what it expects. The crash record of a
+# test is dropped first so its first run starts afresh.
+
+failed=0
+
+# The log directory of exe's crash record
+logdir() {
+    local nvid=$(sed -n "s|^$1, ||p" /tmp/nvlib.crash 2>/dev/null)
+    if [ -n "$nvid" ]; then
+        echo /mnt/ramdisk/nvthreads/$nvid
+    fi
+}
+
+run() {
+    local exe=$(readlink -f $1)
+    local out=$1.out
+    shift
+
+    # nvid is seeded with the time, a test started within the same second
+    # as the last one must not find its logs.
+    local dir=$(logdir $exe)
+    if [ -n "$dir" ]; then
+        rm -rf $dir
+        sed -i "\\|^$exe, |d" /tmp/nvlib.crash
+    fi
+
+    ( $exe "$@"; true ) > /dev/null 2>&1
+    dir=$(logdir $exe)
+    if $exe "$@" > $out 2>&1; then
+        echo "PASS $(basename $exe) $@"
+    else
+        echo "FAIL $(basename $exe) $@"
+        tail -n 5 $out
+        failed=1
+    fi
+    if [ -n "$dir" ]; then
+        rm -rf $dir
+    fi
+    if [ -f /tmp/nvlib.crash ]; then
+        sed -i "\\|^$exe, |d" /tmp/nvlib.crash
+    fi
+}
+
+run recover_stress.o
+run recover_epoch.o
+run recover_torn.o none
+run recover_torn.o trunc
+run recover_torn.o crc
+exit $failed
@@ -0,0 +1,111 @@
+/*
+(c) Copyright [2017] Hewlett Packard Enterprise Development LP
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License, version 2 as published by the
+Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+// Verify recovery when a thread commits several transactions within one
+// epoch: signaling a condition variable while holding a lock commits without
+// a new epoch, so the transactions land in the same log file. Pages are
+// rewritten across those transactions; the last write of each page has to be
+// recovered. Run it twice: the second run recovers and compares every page.
+// Result: exits with 1 if any page differs
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "nvrecovery.h"
+
+#define NTHREADS 2
+#define PAGES 16
+#define WRITES 6
+#define PageSize 4096
+
+pthread_mutex_t gm;
+pthread_cond_t cv;
+char *c;
+
+// Thread id owns pages 8 + 4 * id to 11 + 4 * id and writes them WRITES
+// times round robin, committing after every write.
+void *t(void *args){
+    long id = (long)args;
+
+    pthread_mutex_lock(&gm);
+    for (int k = 0; k < WRITES; k++) {
+        memset(c + (8 + id * 4 + k % 4) * PageSize, 'A' + k, PageSize);
+        pthread_cond_signal(&cv);
+    }
+    pthread_mutex_unlock(&gm);
+    return NULL;
+}
+
+// Main writes pages 4 * id and 1 + 4 * id once thread id started, the
+// other pages below 8 are never written.
+static char expected(int page) {
+    int k;
+
+    if ( page >= 8 ) {
+        for (k = WRITES - 1; k % 4 != page % 4; k--) {
+        }
+        return 'A' + k;
+    }
+    if ( page % 4 < 2 ) {
+        return 'a' + page / 4;
+    }
+    return 0;
+}
+
+int main(){
+    pthread_mutex_init(&gm, NULL);
+    pthread_cond_init(&cv, NULL);
+    pthread_t tid[NTHREADS];
+
+    printf("Checking crash status\n");
+    if ( isCrashed() ) {
+        printf("I need to recover!\n");
+        char *ptr = (char *)calloc(PAGES, PageSize);
+        int mismatches = 0;
+        nvrecover(ptr, PAGES * PageSize, (char *)"c");
+        for (int i = 0; i < PAGES * PageSize; i++) {
+            if ( ptr[i] != expected(i / PageSize) ) {
+                if ( i % PageSize == 0 ) {
+                    printf("page %d starts with 0x%02x, expected 0x%02x\n", i / PageSize, (unsigned char)ptr[i],
+                           (unsigned char)expected(i / PageSize));
+                }
+                mismatches++;
+            }
+        }
+        printf("c: %d of %d bytes differ\n", mismatches, PAGES * PageSize);
+        free(ptr);
+        printf("-------------main exits-------------------\n");
+        return mismatches == 0 ? 0 : 1;
+    }
+
+    printf("Program did not crash before, continue normal execution.\n");
+    c = (char *)nvmalloc(PAGES * PageSize, (char *)"c");
+
+    // Main only writes while a thread runs: memory is not protected, nor
+    // logged, while it is the only thread.
+    for (long i = 0; i < NTHREADS; i++) {
+        pthread_create(&tid[i], NULL, t, (void *)i);
+        memset(c + i * 4 * PageSize, 'a' + i, 2 * PageSize);
+    }
+    for (int i = 0; i < NTHREADS; i++) {
+        pthread_join(tid[i], NULL);
+    }
+    printf("internally abort!\n");
+    abort();
+}
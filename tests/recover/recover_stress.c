@@ -0,0 +1,119 @@
+/*
+(c) Copyright [2017] Hewlett Packard Enterprise Development LP
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License, version 2 as published by the
+Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+// Verify that every word written under a lock or between barriers is recovered
+// with the value of its last write, including the transactions threads end by
+// exiting. Run it twice: the first run crashes, the second one recovers and
+// compares every word with the expected value.
+// Result: exits with 1 if any word differs
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "nvrecovery.h"
+
+#define NTHREADS 4
+#define WORDS (4096 * 8)
+#define ROUNDS 20
+
+pthread_mutex_t gm;
+pthread_barrier_t bar;
+int *locked;
+int *unlocked;
+
+// Word i belongs to thread i % NTHREADS. In a round thread id writes every
+// stride-th of its words in each array, the last round it did is recovered.
+static int stride(int round) {
+    return NTHREADS * (1 + round % 3);
+}
+
+static int expected(int i, int round_offset) {
+    int id = i % NTHREADS;
+    for (int round = ROUNDS; round >= 1; round--) {
+        if ( (i - id) % stride(round + round_offset) == 0 ) {
+            return round * 1000 + id;
+        }
+    }
+    return -1;
+}
+
+void *t(void *args){
+    long id = (long)args;
+
+    for (int round = 1; round <= ROUNDS; round++) {
+        pthread_mutex_lock(&gm);
+        for (int i = id; i < WORDS; i += stride(round)) {
+            locked[i] = round * 1000 + id;
+        }
+        pthread_mutex_unlock(&gm);
+
+        for (int i = id; i < WORDS; i += stride(round + 1)) {
+            unlocked[i] = round * 1000 + id;
+        }
+        pthread_barrier_wait(&bar);
+    }
+    return NULL;
+}
+
+static int compare(const char *name, int *value, int round_offset) {
+    int mismatches = 0;
+    for (int i = 0; i < WORDS; i++) {
+        int e = expected(i, round_offset);
+        if ( value[i] != e ) {
+            if ( mismatches < 10 ) {
+                printf("%s[%d] = %d, expected %d\n", name, i, value[i], e);
+            }
+            mismatches++;
+        }
+    }
+    printf("%s: %d of %d words differ\n", name, mismatches, WORDS);
+    return mismatches;
+}
+
+int main(){
+    pthread_mutex_init(&gm, NULL);
+    pthread_barrier_init(&bar, NULL, NTHREADS);
+    pthread_t tid[NTHREADS];
+
+    printf("Checking crash status\n");
+    if ( isCrashed() ) {
+        printf("I need to recover!\n");
+        int *ptr = (int *)malloc(WORDS * sizeof(int));
+        int mismatches = 0;
+        nvrecover(ptr, WORDS * sizeof(int), (char *)"locked");
+        mismatches += compare("locked", ptr, 0);
+        nvrecover(ptr, WORDS * sizeof(int), (char *)"unlocked");
+        mismatches += compare("unlocked", ptr, 1);
+        free(ptr);
+        printf("-------------main exits-------------------\n");
+        return mismatches == 0 ? 0 : 1;
+    }
+
+    printf("Program did not crash before, continue normal execution.\n");
+    locked = (int *)nvmalloc(WORDS * sizeof(int), (char *)"locked");
+    unlocked = (int *)nvmalloc(WORDS * sizeof(int), (char *)"unlocked");
+    for (long i = 0; i < NTHREADS; i++) {
+        pthread_create(&tid[i], NULL, t, (void *)i);
+    }
+    for (int i = 0; i < NTHREADS; i++) {
+        pthread_join(tid[i], NULL);
+    }
+    printf("internally abort!\n");
+    abort();
+}
@@ -0,0 +1,185 @@
+/*
+(c) Copyright [2017] Hewlett Packard Enterprise Development LP
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License, version 2 as published by the
+Free Software Foundation.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+// Verify that a torn transaction is not recovered: one thread writes 1 to an
+// array, a second thread then writes 2. Before crashing the program tears the
+// transaction of the second thread, by cutting its log inside the COMMIT
+// record ("trunc") or by flipping a byte of the CRC of the COMMIT record
+// ("crc"). Run it twice with the same argument: the second run recovers and
+// expects every word to be 1, or 2 with "none".
+// Result: exits with 1 if any word differs
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "nvrecovery.h"
+
+#define WORDS (4096 * 4)
+
+pthread_mutex_t gm;
+int *v;
+
+void *t(void *args){
+    for (int i = 0; i < WORDS; i++) {
+        v[i] = (int)(long)args;
+    }
+    return NULL;
+}
+
+// The log directory of this run, from the crash record of the executable
+static bool LogDirectory(char *dir) {
+    char exe[FILENAME_MAX];
+    char buf[FILENAME_MAX];
+    ssize_t ret = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    FILE *fp = fopen("/tmp/nvlib.crash", "r");
+
+    if ( ret == -1 || fp == NULL ) {
+        return false;
+    }
+    exe[ret] = 0;
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        char *token = strtok(buf, ", \n");
+        if ( token != NULL && strcmp(token, exe) == 0 ) {
+            sprintf(dir, "/mnt/ramdisk/nvthreads/%s/logs/", strtok(NULL, ", \n"));
+            fclose(fp);
+            return true;
+        }
+    }
+    fclose(fp);
+    return false;
+}
+
+// Find the COMMIT record of the newest transaction that logged pages. Log
+// segments (CIRCULAR_LOG) are walked from their tail, other files from 0.
+static bool FindNewestCommit(const char *dir, char *fn, off_t *pos) {
+    DIR *d = opendir(dir);
+    struct dirent *ent;
+    unsigned long newest = 0;
+    bool found = false;
+
+    while (d != NULL && (ent = readdir(d)) != NULL) {
+        char path[FILENAME_MAX];
+        int tid;
+        if ( sscanf(ent->d_name, "MemLog_%d", &tid) != 1 ) {
+            continue;
+        }
+        sprintf(path, "%s%s", dir, ent->d_name);
+        int fd = open(path, O_RDONLY);
+        if ( fd == -1 ) {
+            continue;
+        }
+
+        struct LogSegmentHeader segment;
+        unsigned long offset = 0;
+        unsigned long ringSize = 0;
+        if ( pread(fd, &segment, sizeof(segment), 0) == sizeof(segment)
+             && memcmp(segment.magic, LOG_SEGMENT_MAGIC, sizeof(segment.magic)) == 0 ) {
+            offset = segment.tail;
+            ringSize = segment.ringSize;
+        }
+
+        struct LogRecordHeader header;
+        for (;;) {
+            off_t at = ringSize ? LogDefines::SegmentHeaderSize + offset % ringSize : offset;
+            if ( pread(fd, &header, sizeof(header), at) != sizeof(header)
+                 || header.magic != LOG_RECORD_MAGIC || header.offset != offset ) {
+                break;
+            }
+            if ( header.type == LOG_RECORD_COMMIT && header.count > 0 && (!found || header.xactID >= newest) ) {
+                newest = header.xactID;
+                strcpy(fn, path);
+                *pos = at;
+                found = true;
+            }
+            offset += header.length;
+        }
+        close(fd);
+    }
+    if ( d != NULL ) {
+        closedir(d);
+    }
+    return found;
+}
+
+// Tear the newest transaction as the mode says
+static bool Tear(const char *mode) {
+    char dir[FILENAME_MAX];
+    char fn[FILENAME_MAX];
+    off_t pos;
+
+    if ( !LogDirectory(dir) || !FindNewestCommit(dir, fn, &pos) ) {
+        printf("Cannot find the COMMIT record to tear\n");
+        return false;
+    }
+    printf("Tearing the transaction committed at %ld in %s: %s\n", (long)pos, fn, mode);
+
+    int fd = open(fn, O_RDWR);
+    bool torn = false;
+    if ( strcmp(mode, "trunc") == 0 ) {
+        torn = (ftruncate(fd, pos + sizeof(struct LogRecordHeader) / 2) == 0);
+    } else {
+        unsigned char byte;
+        off_t at = pos + offsetof(struct LogRecordHeader, crc);
+        if ( pread(fd, &byte, 1, at) == 1 ) {
+            byte ^= 0xFF;
+            torn = (pwrite(fd, &byte, 1, at) == 1);
+        }
+    }
+    close(fd);
+    return torn;
+}
+
+int main(int argc, char **argv){
+    const char *mode = (argc > 1) ? argv[1] : "crc";
+    int expect = (strcmp(mode, "none") == 0) ? 2 : 1;
+    pthread_mutex_init(&gm, NULL);
+    pthread_t tid;
+
+    printf("Checking crash status\n");
+    if ( isCrashed() ) {
+        printf("I need to recover!\n");
+        int *ptr = (int *)malloc(WORDS * sizeof(int));
+        int mismatches = 0;
+        nvrecover(ptr, WORDS * sizeof(int), (char *)"v");
+        for (int i = 0; i < WORDS; i++) {
+            if ( ptr[i] != expect ) {
+                mismatches++;
+            }
+        }
+        printf("v: %d of %d words differ from %d\n", mismatches, WORDS, expect);
+        free(ptr);
+        printf("-------------main exits-------------------\n");
+        return mismatches == 0 ? 0 : 1;
+    }
+
+    printf("Program did not crash before, continue normal execution.\n");
+    v = (int *)nvmalloc(WORDS * sizeof(int), (char *)"v");
+    pthread_create(&tid, NULL, t, (void *)1);
+    pthread_join(tid, NULL);
+    pthread_create(&tid, NULL, t, (void *)2);
+    pthread_join(tid, NULL);
+
+    if ( strcmp(mode, "none") != 0 && !Tear(mode) ) {
+        exit(1);
+    }
+    printf("internally abort!\n");
+    abort();
+}